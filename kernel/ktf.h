@@ -37,6 +37,7 @@ struct ktf_context {
 	ktf_context_cb cleanup;	   /* Optional callback upon context release */
 	int config_errno;	   /* If config_cb set: state of configuration */
 	struct ktf_context_type *type; /* Associated type, must be set */
+	u32 id;			   /* Numeric ID user space can refer to the context by */
 };
 
 typedef struct ktf_context* (*ktf_context_alloc)(struct ktf_context_type *ct);
@@ -393,8 +394,12 @@ static inline int ktf_no_probe_support(void)
 #define	KTF_THREAD_WAIT_STARTED(t)	(wait_for_completion(&((t)->started)))
 #define	KTF_THREAD_WAIT_COMPLETED(t)	(wait_for_completion(&((t)->completed)))
 
+/* The number of passed assertions, by any test, not yet reported to user space */
 u32 ktf_get_assertion_count(void);
 
+/* The number of assertions made so far in the current run of the test */
+u32 ktf_get_run_assertion_count(struct ktf_test *self);
+
 /**
  * ASSERT_TRUE() - fail and return if @C evaluates to false
  * @C: Boolean expression to evaluate
@@ -0,0 +1,123 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktf_bench.c: Microbenchmark support for tests defined with BENCH()
+ *
+ * The number of operations per sample is scaled up until a sample takes
+ * KTF_BENCH_TARGET_NS, which also serves to warm up caches and branch predictors.
+ * Then KTF_BENCH_SAMPLES samples are taken, and the statistics of the time
+ * per operation returned with the test results.
+ */
+
+#include <linux/bitops.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/timex.h>
+#include "ktf.h"
+#include "ktf_nl.h"
+#include "ktf_compat.h"
+
+/* Upper limit for the number of operations per sample */
+#define KTF_BENCH_MAX_ITERS	(1ULL << 32)
+
+/* Significant bits kept of the deviations from the mean */
+#define KTF_BENCH_DEV_BITS	26
+
+static u64 ktf_bench_sample(struct ktf_test *self, struct ktf_context *ctx, u32 value,
+			    ktf_bench_loop loop, u64 iters, u64 *cycles)
+{
+	cycles_t c;
+	u64 t;
+
+	t = ktime_get_ns();
+	c = get_cycles();
+	loop(self, ctx, value, iters);
+	c = get_cycles() - c;
+	t = ktime_get_ns() - t;
+	if (cycles)
+		*cycles = c;
+	return t;
+}
+
+/* Find the number of operations needed for a sample to take KTF_BENCH_TARGET_NS */
+static u64 ktf_bench_scale(struct ktf_test *self, struct ktf_context *ctx, u32 value,
+			   ktf_bench_loop loop)
+{
+	u64 iters = 1, t, next;
+
+	for (;;) {
+		t = ktf_bench_sample(self, ctx, value, loop, iters, NULL);
+		if (t >= KTF_BENCH_TARGET_NS || iters >= KTF_BENCH_MAX_ITERS)
+			return iters;
+
+		/* Aim a bit above the target, but grow by at most 10x at a time,
+		 * since the first rounds are too short to be accurate:
+		 */
+		next = t ? div64_u64(iters * KTF_BENCH_TARGET_NS * 14, t * 10) : iters * 10;
+		iters = clamp_t(u64, next, iters + 1, iters * 10);
+		iters = min_t(u64, iters, KTF_BENCH_MAX_ITERS);
+		cond_resched();
+	}
+}
+
+static int ktf_bench_cmp(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+void ktf_bench_run(struct ktf_test *self, struct ktf_context *ctx, u32 value,
+		   ktf_bench_loop loop)
+{
+	struct ktf_bench_stats st = { .samples = KTF_BENCH_SAMPLES };
+	u64 *ps, sum = 0, cycles = 0, c, var = 0, d, dmax = 0;
+	u32 i, shift;
+
+	ps = kcalloc(st.samples, sizeof(u64), GFP_KERNEL);
+	if (!ps) {
+		ktf_fail("Out of memory for benchmark samples");
+		return;
+	}
+
+	st.iters = ktf_bench_scale(self, ctx, value, loop);
+
+	for (i = 0; i < st.samples; i++) {
+		/* Keep sub-ns resolution by using ps per operation */
+		ps[i] = div64_u64(ktf_bench_sample(self, ctx, value, loop, st.iters, &c) * 1000,
+				  st.iters);
+		sum += ps[i];
+		cycles += c;
+		cond_resched();
+	}
+
+	st.mean = div64_u64(sum, st.samples);
+	for (i = 0; i < st.samples; i++)
+		dmax = max(dmax, ps[i] > st.mean ? ps[i] - st.mean : st.mean - ps[i]);
+
+	/* Deviations of a few ms in ps would overflow when squared, so scale them
+	 * down by as many bits as needed to keep the squares within 52 bits:
+	 */
+	shift = dmax >> KTF_BENCH_DEV_BITS ? fls64(dmax) - KTF_BENCH_DEV_BITS : 0;
+	for (i = 0; i < st.samples; i++) {
+		d = (ps[i] > st.mean ? ps[i] - st.mean : st.mean - ps[i]) >> shift;
+		var += d * d;
+	}
+	st.stddev = int_sqrt64(div64_u64(var, st.samples)) << shift;
+
+	sort(ps, st.samples, sizeof(u64), ktf_bench_cmp, NULL);
+	st.min = ps[0];
+	st.median = st.samples & 1 ? ps[st.samples / 2] :
+		(ps[st.samples / 2 - 1] + ps[st.samples / 2]) / 2;
+	st.cycles = div64_u64(cycles * 1000, st.iters * st.samples);
+	kfree(ps);
+
+	tlog(T_DEBUG, "Benchmark %s.%s: %llu iterations, mean %llu ps, median %llu ps",
+	     self->tclass, self->name, st.iters, st.mean, st.median);
+	ktf_resp_bench(self->resp, &st);
+}
+EXPORT_SYMBOL(ktf_bench_run);
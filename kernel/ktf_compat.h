@@ -51,8 +51,20 @@ static inline unsigned int stack_trace_save(unsigned long *store, unsigned int s
 }
 #endif
 
+#if (KERNEL_VERSION(4, 0, 0) > LINUX_VERSION_CODE)
+#define genl_has_listeners(family, net, group) (1)
+#endif
+
 #if (KERNEL_VERSION(5, 11, 0) > LINUX_VERSION_CODE)
 #define nla_strscpy nla_strlcpy
 #endif
 
+#if (KERNEL_VERSION(4, 20, 0) > LINUX_VERSION_CODE)
+#define int_sqrt64(x) int_sqrt(x)
+#endif
+
+#if (KERNEL_VERSION(5, 17, 0) > LINUX_VERSION_CODE)
+#define module_put_and_kthread_exit(code) module_put_and_exit(code)
+#endif
+
 #endif
@@ -10,12 +10,14 @@
  */
 
 #include <linux/module.h>
+#include <linux/idr.h>
 #include <rdma/ib_verbs.h>
 #include "ktf.h"
 #include "ktf_kallsyms.h"
 #include "ktf_test.h"
 #include "ktf_debugfs.h"
 #include "ktf_nl.h"
+#include "ktf_shm.h"
 
 MODULE_LICENSE("GPL");
 
@@ -35,6 +37,9 @@ static DEFINE_SPINLOCK(context_lock);
 /* global linked list of all ktf_handle objects that have contexts */
 LIST_HEAD(context_handles);
 
+/* Contexts by ID, also protected by context_lock */
+static DEFINE_IDR(context_ids);
+
 module_param_named(debug_mask, ktf_debug_mask, ulong, 0644);
 
 static int __ktf_handle_add_ctx_type(struct ktf_handle *handle,
@@ -63,6 +68,7 @@ static int __ktf_context_add(struct ktf_handle *handle, struct ktf_context *ctx,
 			     struct ktf_context_type *ct)
 {
 	unsigned long flags;
+	bool new_handle = false;
 	int ret;
 
 	ktf_map_elem_init(&ctx->elem, name);
@@ -71,21 +77,36 @@ static int __ktf_context_add(struct ktf_handle *handle, struct ktf_context *ctx,
 	ctx->config_errno = ENOENT; /* 0 here means configuration is ok */
 	ctx->type = ct;
 	ctx->cleanup = ct->cleanup;
+	ctx->id = 0;
 
+	idr_preload(GFP_KERNEL);
 	spin_lock_irqsave(&context_lock, flags);
 	ret = ktf_map_insert(&handle->ctx_map, &ctx->elem);
 	if (!ret) {
+		int id = idr_alloc_cyclic(&context_ids, ctx, 1, 0, GFP_NOWAIT);
+
+		/* Without an ID, the context can still be referred to by name */
+		if (id > 0)
+			ctx->id = id;
 		ctx->handle = handle;
 		if (ktf_map_size(&handle->ctx_map) == 1) {
 			handle->id = ++ktf_context_maxid;
 			INIT_LIST_HEAD(&handle->handle_list);
 			list_add(&handle->handle_list, &context_handles);
+			new_handle = true;
 		}
 	}
 	spin_unlock_irqrestore(&context_lock, flags);
-	if (!ret)
+	idr_preload_end();
+	if (!ret) {
 		tlog(T_DEBUG, "added %scontext %s with type %s",
 		     (cfg_cb ? "configurable " : ""), name, ct->name);
+		/* A new handle ID changes how the handle's tests are reported */
+		if (new_handle)
+			ktf_catalog_change(KTF_CHANGE_RESYNC, handle->id, NULL, name, ctx->id);
+		else
+			ktf_catalog_change(KTF_CHANGE_CTX_ADD, handle->id, NULL, name, ctx->id);
+	}
 	return ret;
 }
 
@@ -163,6 +184,7 @@ void ktf_context_remove(struct ktf_context *ctx)
 {
 	struct ktf_handle *handle;
 	unsigned long flags = 0;
+	bool last;
 
 	if (!ctx) {
 		terr("A test case tried to remove an invalid context!");
@@ -172,11 +194,17 @@ void ktf_context_remove(struct ktf_context *ctx)
 
 	spin_lock_irqsave(&context_lock, flags);
 	ktf_map_remove(&handle->ctx_map, ctx->elem.key);
-	if (!ktf_has_contexts(handle))
+	if (ctx->id)
+		idr_remove(&context_ids, ctx->id);
+	last = !ktf_has_contexts(handle);
+	if (last)
 		list_del(&handle->handle_list);
 	spin_unlock_irqrestore(&context_lock, flags);
 
 	tlog(T_DEBUG, "removed context %s at %p", ctx->elem.key, ctx);
+	/* Without contexts, the handle is no longer reported */
+	ktf_catalog_change(last ? KTF_CHANGE_RESYNC : KTF_CHANGE_CTX_DEL,
+			   handle->id, NULL, ctx->elem.key, 0);
 
 	if (ctx->cleanup)
 		ctx->cleanup(ctx);
@@ -206,6 +234,22 @@ struct ktf_context *ktf_find_context(struct ktf_handle *handle, const char *name
 }
 EXPORT_SYMBOL(ktf_find_context);
 
+/* Contexts are not reference counted for their lifetime (see ktf_context_set_config),
+ * so no reference is taken here:
+ */
+struct ktf_context *ktf_find_context_id(struct ktf_handle *handle, u32 id)
+{
+	struct ktf_context *ctx;
+	unsigned long flags;
+
+	spin_lock_irqsave(&context_lock, flags);
+	ctx = idr_find(&context_ids, id);
+	if (ctx && ctx->handle != handle)
+		ctx = NULL;
+	spin_unlock_irqrestore(&context_lock, flags);
+	return ctx;
+}
+
 struct ktf_context *ktf_find_create_context(struct ktf_handle *handle, const char *name,
 					    const char *type_name)
 {
@@ -310,10 +354,18 @@ static int __init ktf_init(void)
 {
 	int ret;
 	ktf_kallsyms_init();
+	ktf_catalog_init();
 	ktf_debugfs_init();
+	ret = ktf_shm_init();
+	if (ret) {
+		terr("Unable to register device for shared memory");
+		ktf_debugfs_cleanup();
+		goto failure;
+	}
 	ret = ktf_nl_register();
 	if (ret) {
 		terr("Unable to register protocol with netlink");
+		ktf_shm_cleanup();
 		ktf_debugfs_cleanup();
 		goto failure;
 	}
@@ -326,7 +378,9 @@ failure:
 static void __exit ktf_exit(void)
 {
 	ktf_nl_unregister();
+	ktf_shm_cleanup();
 	ktf_cleanup();
+	idr_destroy(&context_ids);
 }
 
 /* Generic setup function for client modules */
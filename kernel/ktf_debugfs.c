@@ -36,12 +36,16 @@ static void ktf_debugfs_print_result(struct seq_file *seq, struct ktf_test *t)
 {
 	struct timespec64 now;
 
-	if (t && strlen(t->log) > 0) {
+	if (!t)
+		return;
+	ktf_test_log_lock();
+	if (t->log && strlen(t->log) > 0) {
 		ktime_get_ts64(&now);
 		seq_printf(seq, "[%s/%s, %lld seconds ago] %s\n",
 			   t->tclass, t->name,
 			   (u64)(now.tv_sec - t->lastrun.tv_sec), t->log);
 	}
+	ktf_test_log_unlock();
 }
 
 /* /sys/kernel/debug/ktf/results/<testset>-tests/<test> shows specific result */
@@ -7,6 +7,15 @@
  * ktf_nl.c: ktf netlink protocol implementation
  */
 #include <linux/version.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/workqueue.h>
+#include <linux/module.h>
+#if (KERNEL_VERSION(4, 11, 0) <= LINUX_VERSION_CODE)
+#include <linux/sched/signal.h>
+#else
+#include <linux/sched.h>
+#endif
 #include <net/netlink.h>
 #include <net/genetlink.h>
 #define NL_INTERNAL 1
@@ -16,6 +25,7 @@
 #include "ktf.h"
 #include "ktf_cov.h"
 #include "ktf_compat.h"
+#include "ktf_shm.h"
 
 /* Generic netlink support to communicate with user level
  * test framework.
@@ -24,9 +34,10 @@
 /* Callback functions defined below */
 static int ktf_run(struct sk_buff *skb, struct genl_info *info);
 static int ktf_query(struct sk_buff *skb, struct genl_info *info);
+static int ktf_query_dump(struct sk_buff *skb, struct netlink_callback *cb);
 static int ktf_cov_cmd(struct sk_buff *skb, struct genl_info *info);
 static int ktf_ctx_cfg(struct sk_buff *skb, struct genl_info *info);
-static int send_version_only(struct sk_buff *skb, struct genl_info *info);
+static int send_version_only(struct sk_buff *skb, struct genl_info *info, bool gen);
 
 /* operation definitions - see ktf_unlproto.h for definitions */
 static struct genl_ops ktf_ops[] = {
@@ -37,6 +48,7 @@ static struct genl_ops ktf_ops[] = {
 		.policy = ktf_gnl_policy,
 #endif
 		.doit = ktf_query,
+		.dumpit = ktf_query_dump,
 	},
 	{
 		.cmd = KTF_C_RUN,
@@ -64,6 +76,15 @@ static struct genl_ops ktf_ops[] = {
 	}
 };
 
+/* multicast groups - see ktf_unlproto.h for definitions */
+enum ktf_mcgrp {
+	KTF_MCGRP_EV,
+};
+
+static const struct genl_multicast_group ktf_mcgrps[] = {
+	[KTF_MCGRP_EV] = { .name = KTF_MCGRP_EVENTS },
+};
+
 /* family definition */
 static struct genl_family ktf_gnl_family = {
 #if (KERNEL_VERSION(4, 10, 0) > LINUX_VERSION_CODE)
@@ -81,6 +102,8 @@ static struct genl_family ktf_gnl_family = {
 #if (KERNEL_VERSION(3, 13, 7) < LINUX_VERSION_CODE)
 	.ops = ktf_ops,
 	.n_ops = ARRAY_SIZE(ktf_ops),
+	.mcgrps = ktf_mcgrps,
+	.n_mcgrps = ARRAY_SIZE(ktf_mcgrps),
 #endif
 };
 
@@ -99,14 +122,16 @@ static int check_version(enum ktf_cmd cmd, struct sk_buff *skb, struct genl_info
 		 * Respond to it with a version only:
 		 */
 		if (cmd == KTF_C_QUERY)
-			return send_version_only(skb, info);
+			return send_version_only(skb, info, false);
 		return -EINVAL;
 	}
 	return 0;
 }
 
-/* Reply with just version information to let user space report the issue: */
-static int send_version_only(struct sk_buff *skb, struct genl_info *info)
+/* Reply with just version information to let user space report the issue,
+ * and the catalog generation if gen is set:
+ */
+static int send_version_only(struct sk_buff *skb, struct genl_info *info, bool gen)
 {
 	struct sk_buff *resp_skb = nlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
 	void *data;
@@ -121,6 +146,8 @@ static int send_version_only(struct sk_buff *skb, struct genl_info *info)
 		goto resp_failure;
 	}
 	nla_put_u64_64bit(resp_skb, KTF_A_VERSION, KTF_VERSION_LATEST, 0);
+	if (gen)
+		nla_put_u64_64bit(resp_skb, KTF_A_GEN, ktf_catalog_generation(), 0);
 
 	/* Recompute message header */
 	genlmsg_end(resp_skb, data);
@@ -133,8 +160,81 @@ resp_failure:
 	return retval;
 }
 
+/* Get a copy of a FILTER attribute: NULL if there is none, or an ERR_PTR */
+static char *ktf_get_filter(const struct nlattr *attr)
+{
+	char *filter;
+
+	if (!attr)
+		return NULL;
+	filter = kmalloc(nla_len(attr) + 1, GFP_KERNEL);
+	if (!filter)
+		return ERR_PTR(-ENOMEM);
+	nla_strscpy(filter, attr, nla_len(attr) + 1);
+	return filter;
+}
+
+#define KTF_MAX_FULLNAME (3 * KTF_MAX_NAME + 3)
+
+/* The name of a test as seen by user space: set.test or set.test_context */
+static void ktf_test_fullname(char *buf, size_t sz, struct ktf_test *t, const char *ctxname)
+{
+	if (ctxname)
+		snprintf(buf, sz, "%s.%s_%s", t->tclass, t->name, ctxname);
+	else
+		snprintf(buf, sz, "%s.%s", t->tclass, t->name);
+}
+
+/* Does test t match filter in any of the contexts user space sees it in? */
+static bool ktf_test_matches(struct ktf_test *t, const char *filter)
+{
+	char name[KTF_MAX_FULLNAME];
+	struct ktf_context *ctx;
+
+	if (!filter)
+		return true;
+	if (!t->handle->id) {
+		if (t->handle->require_context)
+			return false;
+		ktf_test_fullname(name, sizeof(name), t, NULL);
+		return ktf_filter_match(filter, name);
+	}
+	for (ctx = ktf_find_first_context(t->handle); ctx; ctx = ktf_find_next_context(ctx)) {
+		ktf_test_fullname(name, sizeof(name), t, ktf_context_name(ctx));
+		if (ktf_filter_match(filter, name)) {
+			/* we hold reference to ctx here - drop it! */
+			ktf_map_elem_put(&ctx->elem);
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Does any test in tc match filter? */
+static bool ktf_case_matches(struct ktf_case *tc, const char *filter)
+{
+	struct ktf_test *t;
+
+	if (!filter)
+		return true;
+	ktf_testcase_for_each_test(t, tc) {
+		if (ktf_test_matches(t, filter)) {
+			ktf_test_put(t);
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Does user space know about test and context IDs? */
+static bool ktf_ids_ok(const struct nlattr *version_attr)
+{
+	return version_attr && nla_get_u64(version_attr) >= KTF_VERSION_IDS;
+}
+
 /* Send data about one testcase */
-static int send_test_data(struct sk_buff *resp_skb, struct ktf_case *tc)
+static int send_test_data(struct sk_buff *resp_skb, struct ktf_case *tc, const char *filter,
+			  bool ids)
 {
 	struct nlattr *nest_attr;
 	struct ktf_test *t;
@@ -147,6 +247,8 @@ static int send_test_data(struct sk_buff *resp_skb, struct ktf_case *tc)
 
 	nest_attr = nla_nest_start(resp_skb, KTF_A_TEST);
 	ktf_testcase_for_each_test(t, tc) {
+		if (!ktf_test_matches(t, filter))
+			continue;
 		cnt++;
 		/* A test is not valid if the handle requires a context and none is present */
 		if (t->handle->id) {
@@ -157,6 +259,8 @@ static int send_test_data(struct sk_buff *resp_skb, struct ktf_case *tc)
 			continue;
 		}
 		stat = nla_put_string(resp_skb, KTF_A_STR, t->name);
+		if (!stat && ids)
+			stat = nla_put_u32(resp_skb, KTF_A_TID, t->id);
 		if (stat)
 			goto fail;
 	}
@@ -170,7 +274,7 @@ fail:
 	return stat;
 }
 
-static int send_handle_data(struct sk_buff *resp_skb, struct ktf_handle *handle)
+static int send_handle_data(struct sk_buff *resp_skb, struct ktf_handle *handle, bool ids)
 {
 	struct ktf_context_type *ct;
 	struct nlattr *nest_attr;
@@ -202,19 +306,106 @@ static int send_handle_data(struct sk_buff *resp_skb, struct ktf_handle *handle)
 	/* Then send all the contexts themselves */
 	ctx = ktf_find_first_context(handle);
 	while (ctx) {
-		nla_put_string(resp_skb, KTF_A_STR, ktf_context_name(ctx));
+		stat = nla_put_string(resp_skb, KTF_A_STR, ktf_context_name(ctx));
+		if (stat)
+			goto fail;
 		if (ctx->config_cb) {
 			stat = nla_put_string(resp_skb, KTF_A_MOD, ctx->type->name);
 			if (stat)
-				return stat;
+				goto fail;
 			stat = nla_put_u32(resp_skb, KTF_A_STAT, ctx->config_errno);
 			if (stat)
-				return stat;
+				goto fail;
+		}
+		if (ids) {
+			stat = nla_put_u32(resp_skb, KTF_A_CID, ctx->id);
+			if (stat)
+				goto fail;
 		}
 		ctx = ktf_find_next_context(ctx);
 	}
 	nla_nest_end(resp_skb, nest_attr);
 	return 0;
+fail:
+	/* we hold reference to ctx here - drop it! */
+	ktf_map_elem_put(&ctx->elem);
+	return stat;
+}
+
+/* Add the catalog changes following generation gen to resp_skb,
+ * returns -ESTALE if user space needs a full query instead:
+ */
+static int send_changes(struct sk_buff *resp_skb, u64 gen, u64 cur_gen, bool ids)
+{
+	struct ktf_change_entry chg;
+	struct nlattr *nest_attr, *change_attr;
+
+	if (gen > cur_gen)
+		return -ESTALE;
+	nest_attr = nla_nest_start(resp_skb, KTF_A_CLIST);
+	if (!nest_attr)
+		return -EMSGSIZE;
+	while (gen++ < cur_gen) {
+		if (ktf_catalog_get_change(gen, &chg) || chg.type == KTF_CHANGE_RESYNC)
+			goto stale;
+		change_attr = nla_nest_start(resp_skb, KTF_A_LIST);
+		if (!change_attr ||
+		    nla_put_u32(resp_skb, KTF_A_NUM, chg.type) ||
+		    nla_put_u32(resp_skb, KTF_A_HID, chg.hid) ||
+		    (chg.setname[0] && nla_put_string(resp_skb, KTF_A_SNAM, chg.setname)) ||
+		    nla_put_string(resp_skb, KTF_A_STR, chg.name))
+			goto stale;
+		if (ids && chg.id &&
+		    nla_put_u32(resp_skb, chg.type == KTF_CHANGE_TEST_ADD ? KTF_A_TID : KTF_A_CID,
+				chg.id))
+			goto stale;
+		nla_nest_end(resp_skb, change_attr);
+	}
+	nla_nest_end(resp_skb, nest_attr);
+	return 0;
+stale:
+	/* Too many changes to fit is also handled by a full query */
+	nla_nest_cancel(resp_skb, nest_attr);
+	return -ESTALE;
+}
+
+/* QUERY with a generation: Respond with only the changes since that generation */
+static int ktf_query_changes(struct sk_buff *skb, struct genl_info *info)
+{
+	struct sk_buff *resp_skb;
+	u64 gen, cur_gen;
+	void *data;
+	int retval;
+
+	gen = nla_get_u64(info->attrs[KTF_A_GEN]);
+	cur_gen = ktf_catalog_generation();
+
+	resp_skb = nlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
+	if (!resp_skb)
+		return -ENOMEM;
+
+	data = genlmsg_put_reply(resp_skb, info, &ktf_gnl_family,
+				 0, KTF_C_QUERY);
+	if (!data) {
+		retval = -ENOMEM;
+		goto resp_failure;
+	}
+	nla_put_u64_64bit(resp_skb, KTF_A_VERSION, KTF_VERSION_LATEST, 0);
+	nla_put_u64_64bit(resp_skb, KTF_A_GEN, cur_gen, 0);
+
+	tlog(T_DEBUG, "Query for changes since generation %llu (current %llu)", gen, cur_gen);
+	if (send_changes(resp_skb, gen, cur_gen, ktf_ids_ok(info->attrs[KTF_A_VERSION])))
+		nla_put_u32(resp_skb, KTF_A_STAT, ESTALE);
+
+	/* Recompute message header */
+	genlmsg_end(resp_skb, data);
+
+	retval = genlmsg_reply(resp_skb, info);
+resp_failure:
+	/* Free buffer if failure */
+	if (retval)
+		nlmsg_free(resp_skb);
+	return retval;
 }
 
 static int ktf_query(struct sk_buff *skb, struct genl_info *info)
@@ -225,15 +416,31 @@ static int ktf_query(struct sk_buff *skb, struct genl_info *info)
 	struct nlattr *nest_attr;
 	struct ktf_handle *handle;
 	struct ktf_case *tc;
+	char *filter;
+	bool ids;
+	u64 gen;
 
 	retval = check_version(KTF_C_QUERY, skb, info);
 	if (retval)
 		return retval;
+	ids = ktf_ids_ok(info->attrs[KTF_A_VERSION]);
+
+	if (info->attrs[KTF_A_GEN])
+		return ktf_query_changes(skb, info);
+	if (info->attrs[KTF_A_NUM] && !nla_get_u32(info->attrs[KTF_A_NUM]))
+		return send_version_only(skb, info, true);
+
+	filter = ktf_get_filter(info->attrs[KTF_A_FILTER]);
+	if (IS_ERR(filter))
+		return PTR_ERR(filter);
 
-	/* No options yet, just send a response */
+	/* Changes after this generation are picked up by a later query for changes */
+	gen = ktf_catalog_generation();
 	resp_skb = nlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
-	if (!resp_skb)
+	if (!resp_skb) {
+		kfree(filter);
 		return -ENOMEM;
+	}
 
 	data = genlmsg_put_reply(resp_skb, info, &ktf_gnl_family,
 				 0, KTF_C_QUERY);
@@ -243,6 +450,7 @@ static int ktf_query(struct sk_buff *skb, struct genl_info *info)
 	}
 
 	nla_put_u64_64bit(resp_skb, KTF_A_VERSION, KTF_VERSION_LATEST, 0);
+	nla_put_u64_64bit(resp_skb, KTF_A_GEN, gen, 0);
 
 	/* Add all test sets to the report
 	 *  We send test info as follows:
@@ -254,7 +462,7 @@ static int ktf_query(struct sk_buff *skb, struct genl_info *info)
 		/* Traverse list of handles with contexts */
 		nest_attr = nla_nest_start(resp_skb, KTF_A_HLIST);
 		list_for_each_entry(handle, &context_handles, handle_list) {
-			retval = send_handle_data(resp_skb, handle);
+			retval = send_handle_data(resp_skb, handle, ids);
 			if (retval)
 				goto resp_failure;
 		}
@@ -270,7 +478,9 @@ static int ktf_query(struct sk_buff *skb, struct genl_info *info)
 		goto resp_failure;
 	}
 	ktf_for_each_testcase(tc) {
-		retval = send_test_data(resp_skb, tc);
+		if (!ktf_case_matches(tc, filter))
+			continue;
+		retval = send_test_data(resp_skb, tc, filter, ids);
 		if (retval) {
 			retval = -ENOMEM;
 			goto resp_failure;
@@ -288,120 +498,1328 @@ resp_failure:
 	/* Free buffer if failure */
 	if (retval)
 		nlmsg_free(resp_skb);
+	kfree(filter);
 	return retval;
 }
 
-static int ktf_run_func(struct sk_buff *skb, const char *ctxname,
-			const char *setname, const char *testname,
-			u32 value, void *oob_data, size_t oob_data_sz)
+/* A QUERY dump is resumed from these cursors, kept in cb->args: */
+enum ktf_dump_cursor {
+	KTF_DUMP_PHASE, /* What we are sending (enum ktf_dump_phase) */
+	KTF_DUMP_POS,	/* Index of the next handle or test set to send */
+	KTF_DUMP_TEST,	/* Index of the next test to send within the current test set */
+};
+
+enum ktf_dump_phase {
+	KTF_DUMP_HANDLES,
+	KTF_DUMP_SETS,
+	KTF_DUMP_DONE,
+};
+
+/* Send as many handles as will fit in skb */
+static int ktf_dump_handles(struct sk_buff *skb, struct netlink_callback *cb, bool ids)
 {
-	struct ktf_case *testset = ktf_case_find(setname);
+	struct ktf_handle *handle;
+	struct nlattr *nest_attr;
+	long pos = 0;
+	int cnt = 0;
+	void *mark;
+
+	nest_attr = nla_nest_start(skb, KTF_A_HLIST);
+	if (!nest_attr)
+		return -EMSGSIZE;
+
+	list_for_each_entry(handle, &context_handles, handle_list) {
+		if (pos++ < cb->args[KTF_DUMP_POS])
+			continue;
+		mark = skb_tail_pointer(skb);
+		if (send_handle_data(skb, handle, ids)) {
+			nlmsg_trim(skb, mark);
+			if (!cnt) {
+				nla_nest_cancel(skb, nest_attr);
+				return -EMSGSIZE;
+			}
+			nla_nest_end(skb, nest_attr);
+			return 0;
+		}
+		cb->args[KTF_DUMP_POS]++;
+		cnt++;
+	}
+
+	if (cnt)
+		nla_nest_end(skb, nest_attr);
+	else
+		nla_nest_cancel(skb, nest_attr);
+	cb->args[KTF_DUMP_PHASE] = KTF_DUMP_SETS;
+	cb->args[KTF_DUMP_POS] = 0;
+	return 0;
+}
+
+/* Send the tests of one test set from the current test cursor. Returns 0 if
+ * the rest of the set was sent, -EAGAIN if only some of it fit, or -EMSGSIZE if none did:
+ */
+static int ktf_dump_set(struct sk_buff *skb, struct netlink_callback *cb,
+			struct ktf_case *tc, const char *filter, bool ids)
+{
+	struct nlattr *nest_attr;
 	struct ktf_test *t;
-	int tn = 0;
+	long pos = 0;
+	int cnt = 0;
+	void *mark;
+
+	if (nla_put_string(skb, KTF_A_STR, ktf_case_name(tc)))
+		return -EMSGSIZE;
+	nest_attr = nla_nest_start(skb, KTF_A_TEST);
+	if (!nest_attr)
+		return -EMSGSIZE;
+
+	ktf_testcase_for_each_test(t, tc) {
+		if (pos++ < cb->args[KTF_DUMP_TEST])
+			continue;
+		if (!ktf_test_matches(t, filter)) {
+			cb->args[KTF_DUMP_TEST]++;
+			continue;
+		}
+		mark = skb_tail_pointer(skb);
+		/* A test is not valid if the handle requires a context and none is present */
+		if (t->handle->id) {
+			if (nla_put_u32(skb, KTF_A_HID, t->handle->id))
+				goto full;
+		} else if (t->handle->require_context) {
+			cb->args[KTF_DUMP_TEST]++;
+			continue;
+		}
+		if (nla_put_string(skb, KTF_A_STR, t->name) ||
+		    (ids && nla_put_u32(skb, KTF_A_TID, t->id)))
+			goto full;
+		cb->args[KTF_DUMP_TEST]++;
+		cnt++;
+	}
+	nla_nest_end(skb, nest_attr);
+	return 0;
+full:
+	/* we hold reference to t here - drop it! */
+	ktf_test_put(t);
+	nlmsg_trim(skb, mark);
+	nla_nest_end(skb, nest_attr);
+	return cnt ? -EAGAIN : -EMSGSIZE;
+}
+
+/* Send as many test sets as will fit in skb, splitting sets if necessary */
+static int ktf_dump_sets(struct sk_buff *skb, struct netlink_callback *cb, const char *filter,
+			 bool ids)
+{
+	struct nlattr *nest_attr;
+	struct ktf_case *tc;
+	long pos = 0;
+	int cnt = 0;
+	void *mark;
+	int stat;
+
+	if (nla_put_u32(skb, KTF_A_NUM, ktf_case_count()))
+		return -EMSGSIZE;
+	nest_attr = nla_nest_start(skb, KTF_A_LIST);
+	if (!nest_attr)
+		return -EMSGSIZE;
 
-	if (!testset) {
-		tlog(T_INFO, "No such testset \"%s\"", setname);
-		return -EFAULT;
+	ktf_for_each_testcase(tc) {
+		if (pos++ < cb->args[KTF_DUMP_POS])
+			continue;
+		if (!cb->args[KTF_DUMP_TEST] && !ktf_case_matches(tc, filter)) {
+			cb->args[KTF_DUMP_POS]++;
+			continue;
+		}
+		mark = skb_tail_pointer(skb);
+		stat = ktf_dump_set(skb, cb, tc, filter, ids);
+		if (stat) {
+			/* The set did not fit completely - continue with it in the next part */
+			ktf_case_put(tc);
+			if (stat == -EMSGSIZE) {
+				nlmsg_trim(skb, mark);
+				if (!cnt)
+					return stat;
+			}
+			nla_nest_end(skb, nest_attr);
+			return 0;
+		}
+		cb->args[KTF_DUMP_POS]++;
+		cb->args[KTF_DUMP_TEST] = 0;
+		cnt++;
 	}
+	nla_nest_end(skb, nest_attr);
+	cb->args[KTF_DUMP_PHASE] = KTF_DUMP_DONE;
+	return 0;
+}
 
-	/* Execute test functions */
-	ktf_testcase_for_each_test(t, testset) {
-		if (t->fun && strcmp(t->name, testname) == 0) {
-			struct ktf_context *ctx = ktf_find_context(t->handle, ctxname);
+/* QUERY as a dump: Send the handles and test sets as a multipart message,
+ * resuming from the cursors in cb->args for each part:
+ */
+static int ktf_query_dump(struct sk_buff *skb, struct netlink_callback *cb)
+{
+	struct nlattr *version_attr;
+	void *data, *mark;
+	char *filter;
+	bool ids;
+	u64 gen;
+	int stat;
+
+	if (cb->args[KTF_DUMP_PHASE] == KTF_DUMP_DONE)
+		return 0;
+
+	version_attr = nlmsg_find_attr(cb->nlh, GENL_HDRLEN, KTF_A_VERSION);
+	if (!version_attr) {
+		terr("received netlink msg with no version!");
+		return -EINVAL;
+	}
+	ids = ktf_ids_ok(version_attr);
 
-			ktf_run_hook(skb, ctx, t, value, oob_data, oob_data_sz);
-		} else if (!t->fun) {
-			tlog(T_DEBUG, "** no function for test %s.%s **", t->tclass, t->name);
+	/* Sample the generation before the first part: user space uses the first GEN */
+	gen = ktf_catalog_generation();
+	data = genlmsg_put(skb, NETLINK_CB(cb->skb).portid, cb->nlh->nlmsg_seq,
+			   &ktf_gnl_family, NLM_F_MULTI, KTF_C_QUERY);
+	if (!data)
+		return -EMSGSIZE;
+	nla_put_u64_64bit(skb, KTF_A_VERSION, KTF_VERSION_LATEST, 0);
+	nla_put_u64_64bit(skb, KTF_A_GEN, gen, 0);
+
+	if (ktf_version_check(nla_get_u64(version_attr))) {
+		/* Respond with version only to let user space report the issue */
+		cb->args[KTF_DUMP_PHASE] = KTF_DUMP_DONE;
+		goto out;
+	}
+
+	/* The filter is in the original request, which is kept for every part */
+	filter = ktf_get_filter(nlmsg_find_attr(cb->nlh, GENL_HDRLEN, KTF_A_FILTER));
+	if (IS_ERR(filter)) {
+		genlmsg_cancel(skb, data);
+		return PTR_ERR(filter);
+	}
+
+	if (cb->args[KTF_DUMP_PHASE] == KTF_DUMP_HANDLES) {
+		stat = ktf_dump_handles(skb, cb, ids);
+		if (stat || cb->args[KTF_DUMP_PHASE] == KTF_DUMP_HANDLES)
+			goto part_done;
+		/* All handles sent - fill up with test sets if there's room */
+		mark = skb_tail_pointer(skb);
+		stat = ktf_dump_sets(skb, cb, filter, ids);
+		if (stat == -EMSGSIZE) {
+			nlmsg_trim(skb, mark);
+			stat = 0;
 		}
-		tn++;
+	} else {
+		stat = ktf_dump_sets(skb, cb, filter, ids);
+	}
+part_done:
+	kfree(filter);
+	if (stat) {
+		twarn("Unable to fit a single handle or test in a message");
+		genlmsg_cancel(skb, data);
+		return stat;
+	}
+out:
+	genlmsg_end(skb, data);
+	return skb->len;
+}
+
+static int ktf_run_func(struct ktf_run_resp *resp, struct ktf_context *ctx,
+			struct ktf_test *t, u32 value, void *oob_data, size_t oob_data_sz,
+			u32 repeat, u32 run_for)
+{
+	if (!t->fun) {
+		tlog(T_DEBUG, "** no function for test %s.%s **", t->tclass, t->name);
+		return 0;
+	}
+
+	if (repeat || run_for)
+		return ktf_run_repeat(resp, ctx, t, value, oob_data, oob_data_sz,
+				      repeat, run_for);
+	return ktf_run_hook(resp, ctx, t, value, oob_data, oob_data_sz);
+}
+
+/* Terminate a multipart response */
+static int ktf_send_done(struct net *net, u32 portid, u32 seq)
+{
+	struct sk_buff *resp_skb = nlmsg_new(sizeof(int), GFP_KERNEL);
+	struct nlmsghdr *nlh;
+
+	if (!resp_skb)
+		return -ENOMEM;
+	nlh = nlmsg_put(resp_skb, portid, seq, NLMSG_DONE, sizeof(int), NLM_F_MULTI);
+	if (!nlh) {
+		nlmsg_free(resp_skb);
+		return -EMSGSIZE;
 	}
-	tlog(T_DEBUG, "Set %s contained %d tests", ktf_case_name(testset), tn);
-	ktf_case_put(testset);
+	*(int *)nlmsg_data(nlh) = 0;
+	nlmsg_end(resp_skb, nlh);
+	return genlmsg_unicast(net, resp_skb, portid);
+}
+
+static int ktf_resp_put(struct sk_buff *skb, int result, const char *file,
+			int line, const char *report)
+{
+	if (nla_put_u32(skb, KTF_A_STAT, result))
+		return -EMSGSIZE;
+	if (!file)
+		return 0;
+	if (nla_put_string(skb, KTF_A_FILE, file) ||
+	    nla_put_u32(skb, KTF_A_NUM, line) ||
+	    nla_put_string(skb, KTF_A_STR, report))
+		return -EMSGSIZE;
 	return 0;
 }
 
-static int ktf_run(struct sk_buff *skb, struct genl_info *info)
+/* Start an event message about test t, or return NULL if nobody is listening */
+static struct sk_buff *ktf_event_new(enum ktf_event ev, struct ktf_test *t, void **hdr)
 {
-	u32 value = 0;
-	struct sk_buff *resp_skb;
-	void *data;
-	int retval = 0;
-	struct nlattr *nest_attr, *data_attr;
+#if (KERNEL_VERSION(3, 13, 7) < LINUX_VERSION_CODE)
+	struct sk_buff *skb;
+
+	if (!genl_has_listeners(&ktf_gnl_family, &init_net, KTF_MCGRP_EV))
+		return NULL;
+
+	skb = genlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
+	if (!skb)
+		return NULL;
+	*hdr = genlmsg_put(skb, 0, 0, &ktf_gnl_family, 0, KTF_C_EVENT);
+	if (!*hdr ||
+	    nla_put_u64_64bit(skb, KTF_A_VERSION, KTF_VERSION_LATEST, 0) ||
+	    nla_put_u32(skb, KTF_A_EVENT, ev) ||
+	    nla_put_u64_64bit(skb, KTF_A_TIME, ktime_get_real_ns(), 0) ||
+	    nla_put_string(skb, KTF_A_SNAM, t->tclass) ||
+	    nla_put_string(skb, KTF_A_TNAM, t->name)) {
+		nlmsg_free(skb);
+		return NULL;
+	}
+	return skb;
+#else
+	/* No multicast group support */
+	return NULL;
+#endif
+}
+
+static void ktf_event_send(struct sk_buff *skb, void *hdr)
+{
+	genlmsg_end(skb, hdr);
+	/* Fails if the last listener just left, which is fine */
+	genlmsg_multicast(&ktf_gnl_family, skb, 0, KTF_MCGRP_EV, GFP_KERNEL);
+}
+
+void ktf_event_test(enum ktf_event ev, struct ktf_test *t, struct ktf_context *ctx)
+{
+	struct sk_buff *skb;
+	void *hdr;
+
+	skb = ktf_event_new(ev, t, &hdr);
+	if (!skb)
+		return;
+	tlog(T_MCAST, "event %d for test %s.%s", ev, t->tclass, t->name);
+	if ((ctx && nla_put_string(skb, KTF_A_STR, ktf_context_name(ctx))) ||
+	    (ev == KTF_EVENT_TEST_END &&
+	     (nla_put_u32(skb, KTF_A_NUM, t->run_asserts) ||
+	      nla_put_u32(skb, KTF_A_STAT, t->run_failures)))) {
+		nlmsg_free(skb);
+		return;
+	}
+	ktf_event_send(skb, hdr);
+}
+
+void ktf_event_assert(struct ktf_test *t, int result, const char *file,
+		      int line, const char *report)
+{
+	struct sk_buff *skb;
+	void *hdr;
+
+	skb = ktf_event_new(KTF_EVENT_ASSERT, t, &hdr);
+	if (!skb)
+		return;
+	tlog(T_MCAST, "assert event for test %s.%s", t->tclass, t->name);
+	if (ktf_resp_put(skb, result, file, line, report)) {
+		nlmsg_free(skb);
+		return;
+	}
+	ktf_event_send(skb, hdr);
+}
+
+/* Max time to hold back error reports before sending a partial response */
+#define KTF_RESP_FLUSH_INTERVAL (HZ / 10)
+
+/* Start a new part of a RUN response */
+static int ktf_resp_start(struct ktf_run_resp *resp)
+{
+	char report[64];
+
+	resp->skb = nlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
+	if (!resp->skb)
+		return -ENOMEM;
+
+	resp->hdr = genlmsg_put(resp->skb, resp->portid, resp->seq, &ktf_gnl_family,
+				resp->flags, KTF_C_RUN);
+	if (!resp->hdr) {
+		nlmsg_free(resp->skb);
+		resp->skb = NULL;
+		return -ENOMEM;
+	}
+
+	if (resp->flags & NLM_F_MULTI)
+		nla_put_u32(resp->skb, KTF_A_NUM, resp->index);
+	if (resp->setname) {
+		nla_put_string(resp->skb, KTF_A_SNAM, resp->setname);
+		nla_put_string(resp->skb, KTF_A_TNAM, resp->testname);
+		if (resp->ctxname)
+			nla_put_string(resp->skb, KTF_A_STR, resp->ctxname);
+	}
+	resp->nest = nla_nest_start(resp->skb, KTF_A_LIST);
+	resp->reports = 0;
+
+	/* Let user space know about any error reports it did not get */
+	if (resp->lost) {
+		snprintf(report, sizeof(report), "%u error report(s) lost", resp->lost);
+		if (!ktf_resp_put(resp->skb, 0, "ktf", 0, report)) {
+			resp->reports = resp->lost;
+			resp->lost = 0;
+		}
+	}
+	return 0;
+}
+
+/* Send the current part of a RUN response */
+static int ktf_resp_send(struct ktf_run_resp *resp)
+{
+	int retval;
+
+	nla_nest_end(resp->skb, resp->nest);
+	genlmsg_end(resp->skb, resp->hdr);
+
+	/* Note: The buffer is consumed by the send, also upon failure */
+	retval = genlmsg_unicast(resp->net, resp->skb, resp->portid);
+	resp->skb = NULL;
+	return retval;
+}
+
+/* Send the results so far as a partial response and start a new part */
+static int ktf_resp_flush(struct ktf_run_resp *resp)
+{
+	int retval = ktf_resp_send(resp);
+
+	if (retval) {
+		/* Most likely a receive buffer overrun in user space */
+		tlog(T_DEBUG, "Failed to send partial response - status %d", retval);
+		resp->lost += resp->reports;
+	}
+	resp->flushed = jiffies;
+	return ktf_resp_start(resp);
+}
+
+void ktf_resp_timing(struct ktf_run_resp *resp, u64 duration, u64 *iter_ns, u32 iters)
+{
+	if (!resp) {
+		kfree(iter_ns);
+		return;
+	}
+	mutex_lock(&resp->lock);
+	if (resp->abandoned) {
+		kfree(iter_ns);
+	} else {
+		kfree(resp->iter_ns);
+		resp->timed = true;
+		resp->duration = duration;
+		resp->iter_ns = iter_ns;
+		resp->iters = iters;
+	}
+	mutex_unlock(&resp->lock);
+}
+
+void ktf_resp_bench(struct ktf_run_resp *resp, const struct ktf_bench_stats *stats)
+{
+	struct ktf_bench_stats *bench;
+
+	if (!resp)
+		return;
+	bench = kmemdup(stats, sizeof(*stats), GFP_KERNEL);
+	mutex_lock(&resp->lock);
+	if (resp->abandoned) {
+		kfree(bench);
+	} else {
+		kfree(resp->bench);
+		resp->bench = bench;
+	}
+	mutex_unlock(&resp->lock);
+}
+
+static void ktf_resp_put_bench(struct ktf_run_resp *resp)
+{
+	struct ktf_bench_stats *st = resp->bench;
+	struct nlattr *nest = nla_nest_start(resp->skb, KTF_A_BENCH);
+
+	if (!nest)
+		return;
+	if (nla_put_u64_64bit(resp->skb, KTF_BENCH_A_ITERS, st->iters, 0) ||
+	    nla_put_u32(resp->skb, KTF_BENCH_A_SAMPLES, st->samples) ||
+	    nla_put_u64_64bit(resp->skb, KTF_BENCH_A_MEAN, st->mean, 0) ||
+	    nla_put_u64_64bit(resp->skb, KTF_BENCH_A_MEDIAN, st->median, 0) ||
+	    nla_put_u64_64bit(resp->skb, KTF_BENCH_A_STDDEV, st->stddev, 0) ||
+	    nla_put_u64_64bit(resp->skb, KTF_BENCH_A_MIN, st->min, 0) ||
+	    (st->cycles && nla_put_u64_64bit(resp->skb, KTF_BENCH_A_CYCLES, st->cycles, 0))) {
+		nla_nest_cancel(resp->skb, nest);
+		twarn("No room for benchmark results in the response");
+		return;
+	}
+	nla_nest_end(resp->skb, nest);
+}
+
+void ktf_resp_repeat(struct ktf_run_resp *resp, const struct ktf_repeat_stats *stats)
+{
+	struct ktf_repeat_stats *repeat;
+
+	if (!resp)
+		return;
+	repeat = kmemdup(stats, sizeof(*stats), GFP_KERNEL);
+	mutex_lock(&resp->lock);
+	if (resp->abandoned) {
+		kfree(repeat);
+	} else {
+		kfree(resp->repeat);
+		resp->repeat = repeat;
+	}
+	mutex_unlock(&resp->lock);
+}
+
+static void ktf_resp_put_repeat(struct ktf_run_resp *resp)
+{
+	struct ktf_repeat_stats *st = resp->repeat;
+	struct nlattr *nest = nla_nest_start(resp->skb, KTF_A_RSTATS);
+
+	if (!nest)
+		return;
+	if (nla_put_u32(resp->skb, KTF_REPEAT_A_RUNS, st->runs) ||
+	    nla_put_u32(resp->skb, KTF_REPEAT_A_FAILED, st->failed_runs) ||
+	    nla_put_u64_64bit(resp->skb, KTF_REPEAT_A_ASSERTS, st->asserts, 0) ||
+	    nla_put_u64_64bit(resp->skb, KTF_REPEAT_A_FAILURES, st->failures, 0) ||
+	    nla_put_u64_64bit(resp->skb, KTF_REPEAT_A_FASTEST, st->fastest, 0) ||
+	    nla_put_u64_64bit(resp->skb, KTF_REPEAT_A_MEAN, st->mean, 0) ||
+	    nla_put_u64_64bit(resp->skb, KTF_REPEAT_A_SLOWEST, st->slowest, 0)) {
+		nla_nest_cancel(resp->skb, nest);
+		twarn("No room for the summary of repeated runs in the response");
+		return;
+	}
+	nla_nest_end(resp->skb, nest);
+}
+
+#define KTF_MAX_METRIC_UNIT 15
+
+/* A metric reported by a test, kept until the final part of the response */
+struct ktf_metric {
+	struct list_head list;
+	s64 value;
+	char name[KTF_MAX_NAME + 1];
+	char unit[KTF_MAX_METRIC_UNIT + 1];
+};
+
+void ktf_resp_metric(struct ktf_run_resp *resp, const char *name, s64 value, const char *unit)
+{
+	struct ktf_metric *m;
+
+	if (!resp)
+		return;
+	mutex_lock(&resp->lock);
+	if (resp->abandoned)
+		goto out;
+	list_for_each_entry(m, &resp->metrics, list)
+		if (!strncmp(m->name, name, KTF_MAX_NAME))
+			goto found;
+	m = kzalloc(sizeof(*m), GFP_KERNEL);
+	if (!m) {
+		twarn("Out of memory for metric %s", name);
+		goto out;
+	}
+	(void)strscpy(m->name, name, sizeof(m->name));
+	list_add_tail(&m->list, &resp->metrics);
+found:
+	m->value = value;
+	(void)strscpy(m->unit, unit ? unit : "", sizeof(m->unit));
+out:
+	mutex_unlock(&resp->lock);
+}
+
+static void ktf_resp_put_metrics(struct ktf_run_resp *resp)
+{
+	struct nlattr *mlist, *nest;
+	struct ktf_metric *m;
+
+	mlist = nla_nest_start(resp->skb, KTF_A_MLIST);
+	if (!mlist)
+		goto full;
+	list_for_each_entry(m, &resp->metrics, list) {
+		nest = nla_nest_start(resp->skb, KTF_A_METRIC);
+		if (!nest ||
+		    nla_put_string(resp->skb, KTF_METRIC_A_NAME, m->name) ||
+		    nla_put_u64_64bit(resp->skb, KTF_METRIC_A_VALUE, (u64)m->value, 0) ||
+		    nla_put_string(resp->skb, KTF_METRIC_A_UNIT, m->unit)) {
+			nla_nest_cancel(resp->skb, mlist);
+			goto full;
+		}
+		nla_nest_end(resp->skb, nest);
+	}
+	nla_nest_end(resp->skb, mlist);
+	return;
+full:
+	twarn("No room for the metrics in the response");
+}
+
+/* Free what was kept for the final part of the response */
+static void ktf_resp_clear(struct ktf_run_resp *resp)
+{
+	struct ktf_metric *m, *tmp;
+
+	kfree(resp->iter_ns);
+	resp->iter_ns = NULL;
+	kfree(resp->bench);
+	resp->bench = NULL;
+	kfree(resp->repeat);
+	resp->repeat = NULL;
+	list_for_each_entry_safe(m, tmp, &resp->metrics, list) {
+		list_del(&m->list);
+		kfree(m);
+	}
+}
+
+/* Add the time spent running the test to the final part of the response */
+static void ktf_resp_put_timing(struct ktf_run_resp *resp)
+{
+	struct nlattr *ilist;
+	u32 i;
+
+	if (!resp->timed || nla_put_u64_64bit(resp->skb, KTF_A_DURATION, resp->duration, 0))
+		return;
+	if (!resp->iters)
+		return;
+	ilist = nla_nest_start(resp->skb, KTF_A_ILIST);
+	if (!ilist)
+		return;
+	for (i = 0; i < resp->iters; i++)
+		if (nla_put_u64_64bit(resp->skb, KTF_A_DURATION, resp->iter_ns[i], 0))
+			break;
+	if (i < resp->iters) {
+		nla_nest_cancel(resp->skb, ilist);
+		tlog(T_DEBUG, "No room for the times of %u iterations in the response", resp->iters);
+	} else {
+		nla_nest_end(resp->skb, ilist);
+	}
+}
+
+void ktf_resp_report(struct ktf_run_resp *resp, int result, const char *file,
+		     int line, const char *report)
+{
+	void *mark;
+
+	mutex_lock(&resp->lock);
+	if (resp->abandoned) {
+		mutex_unlock(&resp->lock);
+		return;
+	}
+	if (!resp->skb && ktf_resp_start(resp))
+		goto lost;
+
+	mark = skb_tail_pointer(resp->skb);
+	if (ktf_resp_put(resp->skb, result, file, line, report)) {
+		nlmsg_trim(resp->skb, mark);
+		if (!resp->stream || ktf_resp_flush(resp))
+			goto lost;
+		mark = skb_tail_pointer(resp->skb);
+		if (ktf_resp_put(resp->skb, result, file, line, report)) {
+			nlmsg_trim(resp->skb, mark);
+			goto lost;
+		}
+	}
+	if (file)
+		resp->reports++;
+
+	/* Don't keep user space waiting for the end of long running tests */
+	if (file && resp->stream && time_after(jiffies, resp->flushed + KTF_RESP_FLUSH_INTERVAL))
+		ktf_resp_flush(resp);
+	mutex_unlock(&resp->lock);
+	return;
+lost:
+	if (file)
+		resp->lost++;
+	mutex_unlock(&resp->lock);
+}
+
+/* User space supports partial RUN responses */
+static bool ktf_resp_stream_ok(struct genl_info *info)
+{
+	return info->attrs[KTF_A_VERSION] &&
+		nla_get_u64(info->attrs[KTF_A_VERSION]) >= KTF_VERSION_STREAM;
+}
+
+/* A request to run a single test. With a timeout, the request is shared
+ * between the worker executing the RUN request and the thread running the test,
+ * which may outlive the worker if the test times out:
+ */
+struct ktf_run_req {
+	struct kref kref;
+	struct ktf_run_resp resp;
+	struct completion done;
 	char ctxname_store[KTF_MAX_NAME + 1];
-	char *ctxname = ctxname_store;
+	char *ctxname;
 	char setname[KTF_MAX_NAME + 1];
 	char testname[KTF_MAX_NAME + 1];
-	void *oob_data = NULL;
-	size_t oob_data_sz = 0;
+	u32 tid;		/* Test and context IDs, if user space has them */
+	u32 cid;
+	struct ktf_test *t;	/* The test to run, once looked up */
+	struct ktf_context *ctx;
+	u32 value;
+	void *oob_data;
+	size_t oob_data_sz;
+	struct ktf_shm *shm;	/* Region holding oob_data, if shared */
+	struct module *owner;	/* Module of the test, held while supervised */
+	u32 repeat;		/* Repeated runs in the kernel, if any */
+	u32 run_for;
+	int retval;
+};
 
-	retval = check_version(KTF_C_RUN, skb, info);
+/* A RUN request. Tests are run from a workqueue instead of from the request
+ * handler, so that a long running test does not hold up other requests.
+ * The requests of each client (netlink port) are executed in the order
+ * received, while the requests of different clients run concurrently:
+ */
+struct ktf_run_cmd {
+	struct list_head list;	/* Linkage for the client's queue */
+	struct net *net;	/* Where to send the replies */
+	u32 portid;
+	u32 seq;
+	struct nlmsghdr nlh;	/* Header of the request, for the ack */
+	bool ack;		/* User space wants an ack when the request is done */
+	bool stream;		/* User space supports partial responses */
+	u32 timeout;
+	u32 repeat;
+	u32 run_for;
+	struct nlattr *blist;	/* The tests of a batch, */
+	char *filter;		/* or a filter selecting the tests to run, */
+	struct ktf_run_req *req;	/* or a single test */
+};
+
+/* The queue of RUN requests from a client */
+struct ktf_client {
+	struct list_head list;	/* Linkage for ktf_clients */
+	struct net *net;
+	u32 portid;
+	struct list_head cmds;
+	u32 queued;		/* Number of requests in cmds */
+	struct work_struct work;
+};
+
+/* Max number of RUN requests a client can have waiting to be executed */
+#define KTF_MAX_QUEUED_RUNS 64
+
+static LIST_HEAD(ktf_clients);
+static DEFINE_SPINLOCK(ktf_clients_lock);
+static struct workqueue_struct *ktf_run_wq;
+
+static struct ktf_run_req *ktf_run_req_alloc(void)
+{
+	struct ktf_run_req *req = kzalloc(sizeof(*req), GFP_KERNEL);
+
+	if (!req)
+		return NULL;
+	kref_init(&req->kref);
+	mutex_init(&req->resp.lock);
+	INIT_LIST_HEAD(&req->resp.metrics);
+	init_completion(&req->done);
+	return req;
+}
+
+/* Repeated runs apply to each test of a batch */
+static void ktf_run_req_repeat(struct ktf_run_req *req, struct ktf_run_cmd *cmd)
+{
+	req->repeat = cmd->repeat;
+	req->run_for = cmd->run_for;
+}
+
+static void ktf_run_req_release(struct kref *kref)
+{
+	struct ktf_run_req *req = container_of(kref, struct ktf_run_req, kref);
+
+	if (req->t)
+		ktf_test_put(req->t);
+	module_put(req->owner);
+	if (req->shm)
+		ktf_shm_put(req->shm);
+	else
+		kfree(req->oob_data);
+	kfree(req);
+}
+
+static void ktf_run_req_put(struct ktf_run_req *req)
+{
+	kref_put(&req->kref, ktf_run_req_release);
+}
+
+/* Find the test and context to run: Directly by ID if user space has them
+ * from the query, otherwise by name:
+ */
+static int ktf_run_req_lookup(struct ktf_run_req *req)
+{
+	struct ktf_case *tc;
+
+	if (req->t)
+		return 0;
+
+	if (req->tid) {
+		req->t = ktf_test_find_id(req->tid);
+		if (!req->t) {
+			tlog(T_INFO, "No test with ID %u", req->tid);
+			return -ENOENT;
+		}
+		(void)strscpy(req->setname, req->t->tclass, sizeof(req->setname));
+		(void)strscpy(req->testname, req->t->name, sizeof(req->testname));
+	} else {
+		tc = ktf_case_find(req->setname);
+		if (!tc) {
+			tlog(T_INFO, "No such testset \"%s\"", req->setname);
+			return -EFAULT;
+		}
+		req->t = ktf_test_find(tc, req->testname);
+		ktf_case_put(tc);
+		if (!req->t) {
+			tlog(T_INFO, "No test \"%s\" in testset \"%s\"", req->testname, req->setname);
+			return -ENOENT;
+		}
+	}
+
+	if (req->cid) {
+		req->ctx = ktf_find_context_id(req->t->handle, req->cid);
+		if (!req->ctx) {
+			tlog(T_INFO, "No context with ID %u for test %s.%s", req->cid,
+			     req->setname, req->testname);
+			return -ENOENT;
+		}
+	} else {
+		req->ctx = ktf_find_context(req->t->handle, req->ctxname);
+	}
+	return 0;
+}
+
+static int ktf_run_req_func(struct ktf_run_req *req)
+{
+	return ktf_run_func(&req->resp, req->ctx, req->t,
+			    req->value, req->oob_data, req->oob_data_sz,
+			    req->repeat, req->run_for);
+}
+
+static int ktf_run_thread(void *arg)
+{
+	struct ktf_run_req *req = arg;
+
+	/* Let the supervisor interrupt killable waits if the test times out */
+	allow_signal(SIGKILL);
+	req->retval = ktf_run_req_func(req);
+	complete(&req->done);
+	ktf_run_req_put(req);
+
+	/* An abandoned thread may outlive the module of the test, but not ktf */
+	module_put_and_kthread_exit(0);
+}
+
+/* A test that times out keeps running until it returns on its own, so the
+ * module implementing it is held by the request, which the thread running
+ * the test keeps a reference to. The module then cannot be unloaded until
+ * the test returns:
+ */
+static int ktf_run_req_hold_module(struct ktf_run_req *req)
+{
+	struct module *mod;
+	int retval = 0;
+
+	preempt_disable();
+	mod = __module_text_address((unsigned long)req->t->fun);
+	if (mod && !try_module_get(mod))
+		retval = -ENODEV;
+	else
+		req->owner = mod;
+	preempt_enable();
+	return retval;
+}
+
+/* Run a test in a separate thread, and abandon it if it does not complete in time */
+static int ktf_run_supervised(struct ktf_run_req *req, u32 timeout)
+{
+	struct task_struct *task;
+	int retval;
+
+	if (!req->owner) {
+		retval = ktf_run_req_hold_module(req);
+		if (retval)
+			return retval;
+	}
+
+	__module_get(THIS_MODULE);
+	kref_get(&req->kref);
+	task = kthread_create(ktf_run_thread, req, "ktf_run");
+	if (IS_ERR(task)) {
+		ktf_run_req_put(req);
+		module_put(THIS_MODULE);
+		return PTR_ERR(task);
+	}
+	get_task_struct(task);
+	wake_up_process(task);
+
+	if (wait_for_completion_timeout(&req->done, msecs_to_jiffies(timeout))) {
+		retval = req->retval;
+	} else {
+		twarn("Test %s.%s timed out after %u ms - abandoning it",
+		      req->setname, req->testname, timeout);
+		send_sig(SIGKILL, task, 1);
+		retval = -ETIMEDOUT;
+	}
+	put_task_struct(task);
+	return retval;
+}
+
+/* Run a test and send a reply with the results. Replies to batch requests
+ * are parts of a multipart message, and identify the test by its index
+ * within the batch. If user space supports it, results are streamed
+ * as partial replies while the test runs:
+ */
+static int ktf_run_reply(struct ktf_run_cmd *cmd, int flags, u32 index,
+			 struct ktf_run_req *req)
+{
+	struct ktf_run_resp *resp = &req->resp;
+	int retval;
+
+	resp->net = cmd->net;
+	resp->portid = cmd->portid;
+	resp->seq = cmd->seq;
+	resp->flags = flags;
+	resp->index = index;
+	resp->stream = cmd->stream;
+	resp->flushed = jiffies;
+	if (resp->stream)
+		resp->flags |= NLM_F_MULTI;
+
+	/* Start building a response */
+	retval = ktf_resp_start(resp);
 	if (retval)
 		return retval;
 
-	if (info->attrs[KTF_A_STR])
-		nla_strscpy(ctxname, info->attrs[KTF_A_STR], KTF_MAX_NAME);
+	retval = ktf_run_req_lookup(req);
+	if (!retval && cmd->timeout)
+		retval = ktf_run_supervised(req, cmd->timeout);
+	else if (!retval)
+		retval = ktf_run_req_func(req);
+
+	/* A test that timed out may still be running, so from here on it must not
+	 * add to the response:
+	 */
+	mutex_lock(&resp->lock);
+	resp->abandoned = true;
+
+	/* The last partial response may have left us without a buffer */
+	if (!resp->skb && ktf_resp_start(resp)) {
+		ktf_resp_clear(resp);
+		mutex_unlock(&resp->lock);
+		return -ENOMEM;
+	}
+	if (resp->lost)
+		twarn("%u error reports for test %s.%s did not fit in the response",
+		      resp->lost, req->setname, req->testname);
+	nla_nest_end(resp->skb, resp->nest);
+	nla_put_u32(resp->skb, KTF_A_STAT, retval);
+	if (retval != -ETIMEDOUT) {
+		if (resp->bench)
+			ktf_resp_put_bench(resp);
+		ktf_resp_put_timing(resp);
+		if (!list_empty(&resp->metrics))
+			ktf_resp_put_metrics(resp);
+		if (resp->repeat)
+			ktf_resp_put_repeat(resp);
+	}
+	ktf_resp_clear(resp);
+
+	/* Recompute message header */
+	genlmsg_end(resp->skb, resp->hdr);
+
+	/* Note: The buffer is consumed by the send, also upon failure */
+	retval = genlmsg_unicast(resp->net, resp->skb, resp->portid);
+	resp->skb = NULL;
+	mutex_unlock(&resp->lock);
+	if (!retval)
+		tlog(T_DEBUG, "Sent reply for test %s.%s", req->setname, req->testname);
 	else
-		ctxname = NULL;
+		twarn("Failed to send reply for test %s.%s - value %d",
+		      req->setname, req->testname, retval);
+
+	/* A streamed response to a single test is terminated here, a batch in ktf_run_batch */
+	if (!retval && resp->stream && !(flags & NLM_F_MULTI))
+		retval = ktf_send_done(cmd->net, cmd->portid, cmd->seq);
+	return retval;
+}
 
-	if (!info->attrs[KTF_A_SNAM])	{
+/* Run each of the tests in a BLIST in order, with a separate reply for each */
+static int ktf_run_batch(struct ktf_run_cmd *cmd)
+{
+	struct ktf_run_req *req;
+	struct nlattr *entry, *nla;
+	int rem, rem2, retval;
+	u32 index = 0;
+
+	nla_for_each_nested(entry, cmd->blist, rem) {
+		if (nla_type(entry) != KTF_A_TEST)
+			continue;
+
+		req = ktf_run_req_alloc();
+		if (!req)
+			return -ENOMEM;
+		ktf_run_req_repeat(req, cmd);
+		nla_for_each_nested(nla, entry, rem2) {
+			switch (nla_type(nla)) {
+			case KTF_A_SNAM:
+				nla_strscpy(req->setname, nla, KTF_MAX_NAME);
+				break;
+			case KTF_A_TNAM:
+				nla_strscpy(req->testname, nla, KTF_MAX_NAME);
+				break;
+			case KTF_A_STR:
+				nla_strscpy(req->ctxname_store, nla, KTF_MAX_NAME);
+				req->ctxname = req->ctxname_store;
+				break;
+			case KTF_A_TID:
+				req->tid = nla_get_u32(nla);
+				break;
+			case KTF_A_CID:
+				req->cid = nla_get_u32(nla);
+				break;
+			case KTF_A_NUM:
+				req->value = nla_get_u32(nla);
+				break;
+			}
+		}
+
+		tlog(T_DEBUG, "Batch request #%u for testset %s, test %s (ID %u)",
+		     index, req->setname, req->testname, req->tid);
+		retval = ktf_run_reply(cmd, NLM_F_MULTI, index++, req);
+		ktf_run_req_put(req);
+		if (retval)
+			return retval;
+	}
+	return ktf_send_done(cmd->net, cmd->portid, cmd->seq);
+}
+
+/* Run test t in context ctx (or none) if it matches filter */
+static int ktf_run_match(struct ktf_run_cmd *cmd, const char *filter, struct ktf_test *t,
+			 struct ktf_context *ctx, u32 *index)
+{
+	const char *ctxname = ctx ? ktf_context_name(ctx) : NULL;
+	char name[KTF_MAX_FULLNAME];
+	struct ktf_run_req *req;
+	int retval;
+
+	ktf_test_fullname(name, sizeof(name), t, ctxname);
+	if (!ktf_filter_match(filter, name))
+		return 0;
+
+	req = ktf_run_req_alloc();
+	if (!req)
+		return -ENOMEM;
+	(void)strscpy(req->setname, t->tclass, sizeof(req->setname));
+	(void)strscpy(req->testname, t->name, sizeof(req->testname));
+	if (ctxname) {
+		(void)strscpy(req->ctxname_store, ctxname, sizeof(req->ctxname_store));
+		req->ctxname = req->ctxname_store;
+	}
+	ktf_run_req_repeat(req, cmd);
+
+	/* Already found, so no lookup needed */
+	ktf_test_get(t);
+	req->t = t;
+	req->ctx = ctx;
+
+	/* User space does not know the tests in advance, so identify them by name */
+	req->resp.setname = req->setname;
+	req->resp.testname = req->testname;
+	req->resp.ctxname = req->ctxname;
+
+	tlog(T_DEBUG, "Matching request #%u for %s", *index, name);
+	retval = ktf_run_reply(cmd, NLM_F_MULTI, (*index)++, req);
+	ktf_run_req_put(req);
+	return retval;
+}
+
+/* Run every test that matches a FILTER, in each of its contexts, with a separate reply for each */
+static int ktf_run_matching(struct ktf_run_cmd *cmd)
+{
+	const char *filter = cmd->filter;
+	struct ktf_context *ctx;
+	struct ktf_case *tc;
+	struct ktf_test *t;
+	u32 index = 0;
+	int retval;
+
+	ktf_for_each_testcase(tc) {
+		ktf_testcase_for_each_test(t, tc) {
+			if (!t->fun)
+				continue;
+			if (!t->handle->id) {
+				if (t->handle->require_context)
+					continue;
+				retval = ktf_run_match(cmd, filter, t, NULL, &index);
+				if (retval)
+					goto fail;
+				continue;
+			}
+			for (ctx = ktf_find_first_context(t->handle); ctx;
+			     ctx = ktf_find_next_context(ctx)) {
+				retval = ktf_run_match(cmd, filter, t, ctx, &index);
+				if (retval) {
+					ktf_map_elem_put(&ctx->elem);
+					goto fail;
+				}
+			}
+		}
+	}
+	tlog(T_DEBUG, "Ran %u tests matching the filter", index);
+	return ktf_send_done(cmd->net, cmd->portid, cmd->seq);
+fail:
+	/* we hold references to t and tc here - drop them! */
+	ktf_test_put(t);
+	ktf_case_put(tc);
+	return retval;
+}
+
+/* Parse a request to run a single test */
+static int ktf_run_req_parse(struct ktf_run_cmd *cmd, struct genl_info *info)
+{
+	struct nlattr *data_attr;
+	struct ktf_run_req *req;
+	struct ktf_shm *shm;
+
+	/* The test can be identified by ID instead of by name */
+	if (!info->attrs[KTF_A_TID] && !info->attrs[KTF_A_SNAM])	{
 		terr("received KTF_CT_RUN msg without testset name!");
 		return -EINVAL;
 	}
-	nla_strscpy(setname, info->attrs[KTF_A_SNAM], KTF_MAX_NAME);
-
-	if (!info->attrs[KTF_A_TNAM])	{  /* Test name wo/context */
+	if (!info->attrs[KTF_A_TID] && !info->attrs[KTF_A_TNAM])	{  /* Test name wo/context */
 		terr("received KTF_CT_RUN msg without test name!");
 		return -EINVAL;
 	}
-	nla_strscpy(testname, info->attrs[KTF_A_TNAM], KTF_MAX_NAME);
+	if (info->attrs[KTF_A_SHM] && (!info->attrs[KTF_A_SOFF] || !info->attrs[KTF_A_SLEN])) {
+		terr("received KTF_CT_RUN msg with incomplete shared memory reference!");
+		return -EINVAL;
+	}
+
+	req = ktf_run_req_alloc();
+	if (!req)
+		return -ENOMEM;
+
+	if (info->attrs[KTF_A_STR]) {
+		nla_strscpy(req->ctxname_store, info->attrs[KTF_A_STR], KTF_MAX_NAME);
+		req->ctxname = req->ctxname_store;
+	}
+	if (info->attrs[KTF_A_TID])
+		req->tid = nla_get_u32(info->attrs[KTF_A_TID]);
+	else {
+		nla_strscpy(req->setname, info->attrs[KTF_A_SNAM], KTF_MAX_NAME);
+		nla_strscpy(req->testname, info->attrs[KTF_A_TNAM], KTF_MAX_NAME);
+	}
+	if (info->attrs[KTF_A_CID])
+		req->cid = nla_get_u32(info->attrs[KTF_A_CID]);
+	ktf_run_req_repeat(req, cmd);
 
 	if (info->attrs[KTF_A_NUM])	{
 		/* Using NUM field as optional u32 input parameter to test */
-		value = nla_get_u32(info->attrs[KTF_A_NUM]);
+		req->value = nla_get_u32(info->attrs[KTF_A_NUM]);
 	}
 
 	data_attr = info->attrs[KTF_A_DATA];
-	if (data_attr)	{
+	if (info->attrs[KTF_A_SHM]) {
+		/* User space provides out-of-band data in place in a shared memory region: */
+		req->oob_data_sz = nla_get_u64(info->attrs[KTF_A_SLEN]);
+		shm = ktf_shm_get(nla_get_u32(info->attrs[KTF_A_SHM]),
+				  nla_get_u64(info->attrs[KTF_A_SOFF]),
+				  req->oob_data_sz, &req->oob_data);
+		if (IS_ERR(shm)) {
+			terr("invalid shared memory reference in KTF_CT_RUN msg");
+			req->oob_data = NULL;
+			ktf_run_req_put(req);
+			return PTR_ERR(shm);
+		}
+		req->shm = shm;
+	} else if (data_attr)	{
 		/* User space sends out-of-band data: */
-		oob_data = nla_memdup(data_attr, GFP_KERNEL);
-		oob_data_sz = nla_len(data_attr);
+		req->oob_data = nla_memdup(data_attr, GFP_KERNEL);
+		req->oob_data_sz = nla_len(data_attr);
 	}
 
-	tlog(T_DEBUG, "Request for testset %s, test %s", setname, testname);
+	tlog(T_DEBUG, "Request for testset %s, test %s (ID %u)", req->setname, req->testname,
+	     req->tid);
+	cmd->req = req;
+	return 0;
+}
 
-	/* Start building a response */
-	resp_skb = nlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
-	if (!resp_skb)
+static void ktf_run_cmd_free(struct ktf_run_cmd *cmd)
+{
+	if (cmd->req)
+		ktf_run_req_put(cmd->req);
+	kfree(cmd->blist);
+	kfree(cmd->filter);
+	put_net(cmd->net);
+	kfree(cmd);
+}
+
+/* Acknowledge a request, or report that it failed, the way netlink does
+ * for requests that are complete when the request handler returns:
+ */
+static void ktf_send_ack(struct ktf_run_cmd *cmd, int err)
+{
+	struct sk_buff *skb = nlmsg_new(sizeof(struct nlmsgerr), GFP_KERNEL);
+	struct nlmsgerr *errmsg;
+	struct nlmsghdr *nlh;
+
+	if (!skb)
+		return;
+	nlh = nlmsg_put(skb, cmd->portid, cmd->seq, NLMSG_ERROR, sizeof(*errmsg), 0);
+	if (!nlh) {
+		nlmsg_free(skb);
+		return;
+	}
+	errmsg = nlmsg_data(nlh);
+	errmsg->error = err;
+	errmsg->msg = cmd->nlh;
+	nlmsg_end(skb, nlh);
+	if (genlmsg_unicast(cmd->net, skb, cmd->portid))
+		tlog(T_DEBUG, "Failed to send ack for request %u", cmd->seq);
+}
+
+static void ktf_run_cmd_exec(struct ktf_run_cmd *cmd)
+{
+	int retval;
+
+	if (cmd->blist)
+		retval = ktf_run_batch(cmd);
+	else if (cmd->filter)
+		retval = ktf_run_matching(cmd);
+	else
+		retval = ktf_run_reply(cmd, 0, 0, cmd->req);
+
+	if (retval || cmd->ack)
+		ktf_send_ack(cmd, retval);
+}
+
+/* Execute the requests of a client in order until there are no more */
+static void ktf_client_work(struct work_struct *work)
+{
+	struct ktf_client *client = container_of(work, struct ktf_client, work);
+	struct ktf_run_cmd *cmd;
+
+	for (;;) {
+		spin_lock(&ktf_clients_lock);
+		if (list_empty(&client->cmds)) {
+			list_del(&client->list);
+			spin_unlock(&ktf_clients_lock);
+			kfree(client);
+			return;
+		}
+		cmd = list_first_entry(&client->cmds, struct ktf_run_cmd, list);
+		list_del(&cmd->list);
+		client->queued--;
+		spin_unlock(&ktf_clients_lock);
+
+		ktf_run_cmd_exec(cmd);
+		ktf_run_cmd_free(cmd);
+	}
+}
+
+/* Queue a request to be executed after the client's earlier requests,
+ * unless the client already has KTF_MAX_QUEUED_RUNS requests waiting:
+ */
+static int ktf_run_queue(struct ktf_run_cmd *cmd)
+{
+	struct ktf_client *client, *new_client;
+	int retval = 0;
+
+	new_client = kzalloc(sizeof(*new_client), GFP_KERNEL);
+	if (!new_client)
 		return -ENOMEM;
 
-	data = genlmsg_put_reply(resp_skb, info, &ktf_gnl_family,
-				 0, KTF_C_RUN);
-	if (!data) {
-		retval = -ENOMEM;
-		goto put_fail;
+	spin_lock(&ktf_clients_lock);
+	list_for_each_entry(client, &ktf_clients, list) {
+		if (client->net == cmd->net && client->portid == cmd->portid) {
+			if (client->queued < KTF_MAX_QUEUED_RUNS) {
+				list_add_tail(&cmd->list, &client->cmds);
+				client->queued++;
+			} else {
+				retval = -EBUSY;
+			}
+			spin_unlock(&ktf_clients_lock);
+			kfree(new_client);
+			return retval;
+		}
 	}
+	new_client->net = cmd->net;
+	new_client->portid = cmd->portid;
+	INIT_LIST_HEAD(&new_client->cmds);
+	INIT_WORK(&new_client->work, ktf_client_work);
+	list_add_tail(&cmd->list, &new_client->cmds);
+	new_client->queued = 1;
+	list_add(&new_client->list, &ktf_clients);
+	queue_work(ktf_run_wq, &new_client->work);
+	spin_unlock(&ktf_clients_lock);
+	return 0;
+}
 
-	nest_attr = nla_nest_start(resp_skb, KTF_A_LIST);
-	retval = ktf_run_func(resp_skb, ctxname, setname, testname, value, oob_data, oob_data_sz);
-	nla_nest_end(resp_skb, nest_attr);
-	nla_put_u32(resp_skb, KTF_A_STAT, retval);
+static int ktf_run(struct sk_buff *skb, struct genl_info *info)
+{
+	struct nlattr *blist = info->attrs[KTF_A_BLIST];
+	bool ack = info->nlhdr->nlmsg_flags & NLM_F_ACK;
+	struct ktf_run_cmd *cmd;
+	int retval;
 
-	/* Recompute message header */
-	genlmsg_end(resp_skb, data);
+	retval = check_version(KTF_C_RUN, skb, info);
+	if (retval)
+		return retval;
+
+	cmd = kzalloc(sizeof(*cmd), GFP_KERNEL);
+	if (!cmd)
+		return -ENOMEM;
+	cmd->net = get_net(genl_info_net(info));
+	cmd->portid = info->snd_portid;
+	cmd->seq = info->snd_seq;
+	cmd->nlh = *info->nlhdr;
+	cmd->ack = ack;
+	cmd->stream = ktf_resp_stream_ok(info);
+	if (info->attrs[KTF_A_TMO])
+		cmd->timeout = nla_get_u32(info->attrs[KTF_A_TMO]);
+	if (info->attrs[KTF_A_REPEAT])
+		cmd->repeat = nla_get_u32(info->attrs[KTF_A_REPEAT]);
+	if (info->attrs[KTF_A_RUNFOR])
+		cmd->run_for = nla_get_u32(info->attrs[KTF_A_RUNFOR]);
+
+	/* The request message is gone once we return, so keep what we need of it */
+	if (blist) {
+		cmd->blist = kmemdup(blist, blist->nla_len, GFP_KERNEL);
+		if (!cmd->blist)
+			retval = -ENOMEM;
+	} else if (info->attrs[KTF_A_FILTER]) {
+		cmd->filter = ktf_get_filter(info->attrs[KTF_A_FILTER]);
+		if (IS_ERR(cmd->filter)) {
+			retval = PTR_ERR(cmd->filter);
+			cmd->filter = NULL;
+		}
+	} else {
+		retval = ktf_run_req_parse(cmd, info);
+	}
 
-	retval = genlmsg_reply(resp_skb, info);
 	if (!retval)
-		tlog(T_DEBUG, "Sent reply for test %s.%s", setname, testname);
-	else
-		twarn("Failed to send reply for test %s.%s - value %d",
-		      setname, testname, retval);
+		retval = ktf_run_queue(cmd);
+	if (retval) {
+		ktf_run_cmd_free(cmd);
+		return retval;
+	}
 
-	kfree(oob_data);
-put_fail:
-	/* Free buffer if failure */
-	if (retval)
-		nlmsg_free(resp_skb);
-	return retval;
+	/* The ack is sent by ktf_run_cmd_exec after the replies, so that user space
+	 * sees the same order as if the tests ran here. -EINTR tells the netlink core
+	 * that the handler replies itself, and so not to ack the request now:
+	 */
+	return ack ? -EINTR : 0;
 }
 
 static int ktf_cov_cmd(struct sk_buff *skb,
@@ -521,16 +1939,25 @@ static int ktf_ctx_cfg(struct sk_buff *skb, struct genl_info *info)
 
 int ktf_nl_register(void)
 {
+	int stat;
+
+	ktf_run_wq = alloc_workqueue("ktf_run", WQ_UNBOUND, 0);
+	if (!ktf_run_wq)
+		return -ENOMEM;
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 7))
-	int stat = genl_register_family_with_ops(&ktf_gnl_family, ktf_ops,
-						 ARRAY_SIZE(ktf_ops));
+	stat = genl_register_family_with_ops(&ktf_gnl_family, ktf_ops,
+					     ARRAY_SIZE(ktf_ops));
 #else
-	int stat = genl_register_family(&ktf_gnl_family);
+	stat = genl_register_family(&ktf_gnl_family);
 #endif
+	if (stat)
+		destroy_workqueue(ktf_run_wq);
 	return stat;
 }
 
 void ktf_nl_unregister(void)
 {
 	genl_unregister_family(&ktf_gnl_family);
+	/* No new requests can arrive now - wait for the queued ones to complete */
+	destroy_workqueue(ktf_run_wq);
 }
@@ -8,7 +8,74 @@
 #ifndef KTF_NL_H
 #define KTF_NL_H
 
+#include <linux/mutex.h>
+#include <net/genetlink.h>
+#include "ktf_unlproto.h"
+
 int ktf_nl_register(void);
 void ktf_nl_unregister(void);
 
+struct ktf_bench_stats;
+struct ktf_repeat_stats;
+
+/* A RUN response under construction. If user space supports it, results are
+ * streamed as partial responses whenever the current part is full, or when
+ * results have been held back for too long:
+ */
+struct ktf_run_resp {
+	struct net *net;	/* Where to send the response */
+	u32 portid;
+	u32 seq;
+	struct sk_buff *skb;	/* The current part, if any */
+	void *hdr;
+	struct nlattr *nest;	/* The list of results in the current part */
+	int flags;
+	u32 index;		/* Index of the test within a batch */
+	const char *setname;	/* Identifies the test in each part, if set */
+	const char *testname;
+	const char *ctxname;
+	bool stream;		/* Partial responses are allowed */
+	bool abandoned;		/* The response is complete - drop any further reports */
+	unsigned long flushed;	/* Time (jiffies) of the last partial response */
+	u32 reports;		/* Error reports in the current part */
+	u32 lost;		/* Error reports that did not make it to user space */
+	bool timed;		/* The time spent running the test is set */
+	u64 duration;		/* Time (ns) spent running the test */
+	u64 *iter_ns;		/* Time (ns) spent in each iteration, if more than one */
+	u32 iters;
+	struct ktf_bench_stats *bench;	/* Results of a benchmark, if any */
+	struct list_head metrics;	/* Metrics reported by the test (struct ktf_metric) */
+	struct ktf_repeat_stats *repeat;	/* Summary of repeated runs, if any */
+	struct mutex lock;	/* Tests may report from multiple threads */
+};
+
+struct ktf_test;
+struct ktf_context;
+
+/* Publish events about test execution to the events multicast group */
+void ktf_event_test(enum ktf_event ev, struct ktf_test *t, struct ktf_context *ctx);
+void ktf_event_assert(struct ktf_test *t, int result, const char *file,
+		      int line, const char *report);
+
+/* Add an assertion count (file == NULL) or an error report to a RUN response */
+void ktf_resp_report(struct ktf_run_resp *resp, int result, const char *file,
+		     int line, const char *report);
+
+/* The most iteration times to report, leaving half the final part of a
+ * response for the other attributes:
+ */
+#define KTF_MAX_ITER_TIMES (NLMSG_DEFAULT_SIZE / 2 / nla_total_size_64bit(sizeof(u64)))
+
+/* Set the time spent running the test - takes ownership of iter_ns */
+void ktf_resp_timing(struct ktf_run_resp *resp, u64 duration, u64 *iter_ns, u32 iters);
+
+/* Add the results of a benchmark to the response */
+void ktf_resp_bench(struct ktf_run_resp *resp, const struct ktf_bench_stats *stats);
+
+/* Add the summary of the repeated runs of a test to the response */
+void ktf_resp_repeat(struct ktf_run_resp *resp, const struct ktf_repeat_stats *stats);
+
+/* Add a metric to the response, or replace the value of a metric with the same name */
+void ktf_resp_metric(struct ktf_run_resp *resp, const char *name, s64 value, const char *unit);
+
 #endif
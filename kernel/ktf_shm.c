@@ -0,0 +1,171 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktf_shm.c: Shared memory regions for passing large out-of-band data
+ *   from user space to tests without copying.
+ *
+ * Each open of the ktf device creates a region, which is allocated by the first
+ * (and only) mmap of the file, and identified in RUN requests by the id
+ * returned by the KTF_IOC_SHM_ID ioctl. The region lives until the file is closed
+ * and unmapped, and no test is using it.
+ */
+
+#include <linux/fs.h>
+#include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include "ktf.h"
+#include "ktf_unlproto.h"
+#include "ktf_shm.h"
+
+struct ktf_shm {
+	struct kref kref;
+	struct list_head list;
+	u32 id;
+	void *vaddr;	/* The buffer, once mapped */
+	size_t size;
+};
+
+static LIST_HEAD(shm_list);
+static DEFINE_SPINLOCK(shm_lock);
+static u32 shm_maxid;
+
+static void ktf_shm_release(struct kref *kref)
+{
+	struct ktf_shm *shm = container_of(kref, struct ktf_shm, kref);
+
+	tlog(T_DEBUG, "freeing shared memory region %u (%zu bytes)", shm->id, shm->size);
+	vfree(shm->vaddr);
+	kfree(shm);
+}
+
+void ktf_shm_put(struct ktf_shm *shm)
+{
+	kref_put(&shm->kref, ktf_shm_release);
+}
+
+struct ktf_shm *ktf_shm_get(u32 id, u64 off, u64 len, void **data)
+{
+	struct ktf_shm *shm;
+	unsigned long flags;
+
+	spin_lock_irqsave(&shm_lock, flags);
+	list_for_each_entry(shm, &shm_list, list) {
+		if (shm->id != id)
+			continue;
+		if (!shm->vaddr || off > shm->size || len > shm->size - off) {
+			spin_unlock_irqrestore(&shm_lock, flags);
+			return ERR_PTR(-ERANGE);
+		}
+		kref_get(&shm->kref);
+		spin_unlock_irqrestore(&shm_lock, flags);
+		*data = shm->vaddr + off;
+		return shm;
+	}
+	spin_unlock_irqrestore(&shm_lock, flags);
+	return ERR_PTR(-ENOENT);
+}
+
+static int ktf_shm_open(struct inode *inode, struct file *file)
+{
+	struct ktf_shm *shm = kzalloc(sizeof(*shm), GFP_KERNEL);
+	unsigned long flags;
+
+	if (!shm)
+		return -ENOMEM;
+	kref_init(&shm->kref);
+	spin_lock_irqsave(&shm_lock, flags);
+	shm->id = ++shm_maxid;
+	list_add(&shm->list, &shm_list);
+	spin_unlock_irqrestore(&shm_lock, flags);
+	file->private_data = shm;
+	return 0;
+}
+
+static int ktf_shm_close(struct inode *inode, struct file *file)
+{
+	struct ktf_shm *shm = file->private_data;
+	unsigned long flags;
+
+	spin_lock_irqsave(&shm_lock, flags);
+	list_del(&shm->list);
+	spin_unlock_irqrestore(&shm_lock, flags);
+	ktf_shm_put(shm);
+	return 0;
+}
+
+static int ktf_shm_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct ktf_shm *shm = file->private_data;
+	size_t size = vma->vm_end - vma->vm_start;
+	unsigned long flags;
+	void *vaddr;
+	int ret;
+
+	if (vma->vm_pgoff)
+		return -EINVAL;
+
+	vaddr = vmalloc_user(size);
+	if (!vaddr)
+		return -ENOMEM;
+
+	spin_lock_irqsave(&shm_lock, flags);
+	if (shm->vaddr) {
+		spin_unlock_irqrestore(&shm_lock, flags);
+		vfree(vaddr);
+		return -EBUSY;
+	}
+	shm->vaddr = vaddr;
+	shm->size = size;
+	spin_unlock_irqrestore(&shm_lock, flags);
+
+	/* The mapping holds a reference to the file, and thus to the buffer: */
+	ret = remap_vmalloc_range(vma, vaddr, 0);
+	if (ret)
+		return ret;
+	tlog(T_DEBUG, "mapped shared memory region %u (%zu bytes)", shm->id, size);
+	return 0;
+}
+
+static long ktf_shm_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct ktf_shm *shm = file->private_data;
+
+	switch (cmd) {
+	case KTF_IOC_SHM_ID:
+		return put_user(shm->id, (u32 __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+static const struct file_operations ktf_shm_fops = {
+	.owner = THIS_MODULE,
+	.open = ktf_shm_open,
+	.release = ktf_shm_close,
+	.mmap = ktf_shm_mmap,
+	.unlocked_ioctl = ktf_shm_ioctl,
+};
+
+static struct miscdevice ktf_shm_dev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = KTF_SHM_DEV_NAME,
+	.fops = &ktf_shm_fops,
+	.mode = 0600,
+};
+
+int ktf_shm_init(void)
+{
+	return misc_register(&ktf_shm_dev);
+}
+
+void ktf_shm_cleanup(void)
+{
+	misc_deregister(&ktf_shm_dev);
+}
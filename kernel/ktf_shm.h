@@ -0,0 +1,24 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktf_shm.h: Shared memory regions for passing large out-of-band data
+ *   from user space to tests without copying.
+ */
+
+#ifndef _KTF_SHM_H
+#define _KTF_SHM_H
+#include <linux/types.h>
+
+struct ktf_shm;
+
+int ktf_shm_init(void);
+void ktf_shm_cleanup(void);
+
+/* Look up len bytes at offset off of the shared memory region with the given id.
+ * Returns a referenced region with the data in *data, or an ERR_PTR:
+ */
+struct ktf_shm *ktf_shm_get(u32 id, u64 off, u64 len, void **data);
+void ktf_shm_put(struct ktf_shm *shm);
+
+#endif
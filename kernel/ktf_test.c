@@ -6,7 +6,15 @@
  * ktf_test.c: Kernel side code for tracking and reporting ktf test results
  */
 #include <linux/module.h>
+#include <linux/idr.h>
+#include <linux/percpu.h>
 #include <linux/timekeeping.h>
+#include <linux/version.h>
+#if (KERNEL_VERSION(4, 11, 0) <= LINUX_VERSION_CODE)
+#include <linux/sched/signal.h>
+#else
+#include <linux/sched.h>
+#endif
 #include "ktf_test.h"
 #include <net/netlink.h>
 #include <net/genetlink.h>
@@ -19,6 +27,35 @@
 
 #define MAX_PRINTF 4096
 
+/* Failures are recorded in a ring per run until they are reported at the end of
+ * each iteration, or by KTF_FLUSH(). The ring starts with this many entries,
+ * and if failures do not fit because it is full, it is doubled upon reporting,
+ * up to KTF_FAIL_RING_MAX entries. Sizes are powers of 2, so the ring indices
+ * can wrap:
+ */
+#define KTF_FAIL_RING 16
+#define KTF_FAIL_RING_MAX 256
+
+/* Failures that do not fit in the ring are still counted per location, for up to
+ * this many locations, so that their file and line are not lost:
+ */
+#define KTF_FAIL_SITES 8
+
+/* Room for the arguments of a failure report, or the report itself */
+#define KTF_FAIL_WORDS 96
+
+/* Logs are only allocated upon the first failure of a run, starting at this size,
+ * and grow up to log_max bytes. The logs of the last runs kept with the tests
+ * for debugfs are limited to log_keep bytes in total, by discarding the oldest:
+ */
+#define KTF_LOG_MIN 256
+
+static unsigned int ktf_log_max = 16 * KTF_MAX_LOG;
+module_param_named(log_max, ktf_log_max, uint, 0644);
+
+static unsigned long ktf_log_keep = 1024 * 1024;
+module_param_named(log_keep, ktf_log_keep, ulong, 0644);
+
 /* Versioning check:
  * For MAJOR or MINOR changes, both sides are required to
  * have the same version.
@@ -92,12 +129,43 @@ static size_t ktf_case_test_count(struct ktf_case *tc)
 	return ktf_map_size(&tc->tests);
 }
 
+/* Protects the log and time of the last run kept with each test */
+static DEFINE_SPINLOCK(lastrun_lock);
+
+/* Tests with a log kept, the oldest first, and the total size of the logs */
+static LIST_HEAD(kept_logs);
+static size_t kept_log_size;
+
+void ktf_test_log_lock(void)
+{
+	spin_lock(&lastrun_lock);
+}
+
+void ktf_test_log_unlock(void)
+{
+	spin_unlock(&lastrun_lock);
+}
+
+/* Discard a kept log - with lastrun_lock held */
+static void ktf_test_log_drop(struct ktf_test *t)
+{
+	if (!t->log)
+		return;
+	list_del_init(&t->log_list);
+	kept_log_size -= t->log_size;
+	kfree(t->log);
+	t->log = NULL;
+	t->log_size = 0;
+}
+
 /* Called when test refcount reaches 0. */
 static void ktf_test_free(struct ktf_map_elem *elem)
 {
 	struct ktf_test *t = container_of(elem, struct ktf_test, kmap);
 
-	kfree(t->log);
+	spin_lock(&lastrun_lock);
+	ktf_test_log_drop(t);
+	spin_unlock(&lastrun_lock);
 	kfree(t);
 }
 
@@ -136,6 +204,55 @@ struct ktf_case *ktf_case_find(const char *name)
 	return ktf_map_find_entry(&test_cases, name, struct ktf_case, kmap);
 }
 
+struct ktf_test *ktf_test_find(struct ktf_case *tc, const char *name)
+{
+	return ktf_map_find_entry(&tc->tests, name, struct ktf_test, kmap);
+}
+
+/* Tests by ID, to let user space run a test without lookups by name.
+ * IDs are allocated cyclically, so that a stale ID held by user space
+ * is unlikely to refer to a different test:
+ */
+static DEFINE_IDR(test_ids);
+static DEFINE_SPINLOCK(test_id_lock);
+
+static void ktf_test_alloc_id(struct ktf_test *t)
+{
+	int id;
+
+	idr_preload(GFP_KERNEL);
+	spin_lock(&test_id_lock);
+	id = idr_alloc_cyclic(&test_ids, t, 1, 0, GFP_NOWAIT);
+	spin_unlock(&test_id_lock);
+	idr_preload_end();
+
+	/* Without an ID, the test can still be run by name */
+	t->id = id > 0 ? id : 0;
+}
+
+static void ktf_test_free_id(struct ktf_test *t)
+{
+	if (!t->id)
+		return;
+	spin_lock(&test_id_lock);
+	idr_remove(&test_ids, t->id);
+	spin_unlock(&test_id_lock);
+	t->id = 0;
+}
+
+struct ktf_test *ktf_test_find_id(u32 id)
+{
+	struct ktf_test *t;
+
+	spin_lock(&test_id_lock);
+	t = idr_find(&test_ids, id);
+	/* The test is in the map of its test case as long as it has an ID */
+	if (t)
+		ktf_test_get(t);
+	spin_unlock(&test_id_lock);
+	return t;
+}
+
 /* Returns with case refcount increased.  Called with tc_lock held. */
 static struct ktf_case *ktf_case_find_create(const char *name)
 {
@@ -156,73 +273,466 @@ static struct ktf_case *ktf_case_find_create(const char *name)
 	return tc;
 }
 
-static atomic_t assert_cnt = ATOMIC_INIT(0);
+/* The catalog generation is increased by each addition or removal of a test or context,
+ * and the latest changes are kept in a ring to allow user space to query only the changes:
+ */
+#define KTF_CHANGE_LOG_SIZE 256
+static struct ktf_change_entry change_log[KTF_CHANGE_LOG_SIZE];
+static u64 catalog_gen;
+static DEFINE_SPINLOCK(change_lock);
+
+/* Start from a different generation each time ktf is loaded, to make sure
+ * user space cannot mistake changes from different instances:
+ */
+void ktf_catalog_init(void)
+{
+	catalog_gen = ktime_to_ns(ktime_get_real());
+}
+
+void ktf_catalog_change(enum ktf_change type, u32 hid, const char *setname, const char *name,
+			u32 id)
+{
+	struct ktf_change_entry *chg;
+	unsigned long flags;
+
+	spin_lock_irqsave(&change_lock, flags);
+	chg = &change_log[++catalog_gen % KTF_CHANGE_LOG_SIZE];
+	chg->gen = catalog_gen;
+	chg->type = type;
+	chg->hid = hid;
+	chg->id = id;
+	(void)strscpy(chg->setname, setname ? setname : "", sizeof(chg->setname));
+	(void)strscpy(chg->name, name ? name : "", sizeof(chg->name));
+	spin_unlock_irqrestore(&change_lock, flags);
+	tlog(T_DEBUG, "catalog generation %llu: change %d hid %u %s %s",
+	     chg->gen, type, hid, setname ? setname : "", name ? name : "");
+}
+
+u64 ktf_catalog_generation(void)
+{
+	unsigned long flags;
+	u64 gen;
+
+	spin_lock_irqsave(&change_lock, flags);
+	gen = catalog_gen;
+	spin_unlock_irqrestore(&change_lock, flags);
+	return gen;
+}
+
+int ktf_catalog_get_change(u64 gen, struct ktf_change_entry *chg)
+{
+	unsigned long flags;
+	int ret = 0;
+
+	spin_lock_irqsave(&change_lock, flags);
+	if (gen > catalog_gen || catalog_gen - gen >= KTF_CHANGE_LOG_SIZE ||
+	    change_log[gen % KTF_CHANGE_LOG_SIZE].gen != gen)
+		ret = -ENOENT;
+	else
+		*chg = change_log[gen % KTF_CHANGE_LOG_SIZE];
+	spin_unlock_irqrestore(&change_lock, flags);
+	return ret;
+}
+
+/* A failure of an assertion, as recorded by _ktf_assert(). The report is formatted
+ * later, when the failure is reported, so recording it does not allocate or sleep,
+ * and can be done in any context. Like with trace_printk(), only the arguments are
+ * stored, in binary form, if the kernel supports it, otherwise the formatted report:
+ */
+struct ktf_failure {
+	const char *file;
+	int line;
+	const char *fmt;	/* NULL if buf holds the formatted report */
+	u32 buf[KTF_FAIL_WORDS];
+};
+
+/* A location of failures that did not fit in the ring, and how many */
+struct ktf_fail_site {
+	const char *file;
+	int line;
+	u32 count;
+};
+
+/* The state of a single run of a test. The test function gets the run's copy
+ * of the test as self, so that concurrent runs of the same test, from different
+ * clients or in different contexts, each have their own log, results and data.
+ * The copy is not in any map, and must not be reference counted.
+ *
+ * Passed assertions are counted per CPU in self.assert_cnt, so that tests
+ * asserting at a high rate from many threads do not contend on a shared counter.
+ * The counters only ever increase, so they can be summed up at any time
+ * without racing with the threads still counting:
+ */
+struct ktf_run {
+	struct ktf_test self;
+	spinlock_t lock;	/* Multiple threads may fail and update the log */
+	unsigned long counted;	/* Sum of assert_cnt already in run_asserts */
+	struct ktf_failure *fail;	/* Ring of failures not yet reported */
+	u32 fail_size;
+	u32 fail_head;
+	u32 fail_tail;
+	struct ktf_fail_site fail_sites[KTF_FAIL_SITES];	/* Failures not in the ring */
+	u32 fail_nsites;
+	u32 fail_dropped;	/* Failures at more than KTF_FAIL_SITES locations */
+	struct mutex report_lock;	/* Serializes reporting the failures */
+	char *report;		/* Buffer for formatting a failure report */
+	size_t log_len;		/* The log is self.log, protected by report_lock */
+	size_t log_size;
+	bool log_truncated;
+};
+
+static inline struct ktf_run *ktf_run_of(struct ktf_test *self)
+{
+	return container_of(self, struct ktf_run, self);
+}
+
+DEFINE_PER_CPU(unsigned long, ktf_assert_total);
+EXPORT_PER_CPU_SYMBOL(ktf_assert_total);
+
+/* The sum of ktf_assert_total at the last flush of any test */
+static unsigned long ktf_assert_flushed;
+
+static unsigned long ktf_assert_total_sum(void)
+{
+	unsigned long sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += READ_ONCE(per_cpu(ktf_assert_total, cpu));
+	return sum;
+}
+
+/* Passed assertions not yet in run_asserts - called with the run's lock held */
+static unsigned long ktf_run_uncounted(struct ktf_run *run)
+{
+	unsigned long sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += READ_ONCE(*per_cpu_ptr(run->self.assert_cnt, cpu));
+	return sum - run->counted;
+}
 
 void flush_assert_cnt(struct ktf_test *self)
 {
-	if (atomic_read(&assert_cnt)) {
-		tlog(T_DEBUG, "update: %d asserts", atomic_read(&assert_cnt));
-		if (self->skb)
-			nla_put_u32(self->skb, KTF_A_STAT, atomic_read(&assert_cnt));
-		atomic_set(&assert_cnt, 0);
+	struct ktf_run *run = ktf_run_of(self);
+	unsigned long flags, cnt;
+
+	spin_lock_irqsave(&run->lock, flags);
+	cnt = ktf_run_uncounted(run);
+	run->counted += cnt;
+	self->run_asserts += cnt;
+	spin_unlock_irqrestore(&run->lock, flags);
+	WRITE_ONCE(ktf_assert_flushed, ktf_assert_total_sum());
+
+	if (cnt) {
+		tlog(T_DEBUG, "update: %lu asserts", cnt);
+		if (self->resp)
+			ktf_resp_report(self->resp, cnt, NULL, 0, NULL);
 	}
 }
 
 u32 ktf_get_assertion_count(void)
 {
-	return atomic_read(&assert_cnt);
+	return ktf_assert_total_sum() - READ_ONCE(ktf_assert_flushed);
 }
 EXPORT_SYMBOL(ktf_get_assertion_count);
 
-static DEFINE_SPINLOCK(assert_lock);
+u32 ktf_get_run_assertion_count(struct ktf_test *self)
+{
+	struct ktf_run *run = ktf_run_of(self);
+	unsigned long flags;
+	u32 cnt;
+
+	spin_lock_irqsave(&run->lock, flags);
+	cnt = self->run_asserts + ktf_run_uncounted(run);
+	spin_unlock_irqrestore(&run->lock, flags);
+	return cnt;
+}
+EXPORT_SYMBOL(ktf_get_run_assertion_count);
+
+/* Make room for len more bytes in the log of a run, within log_max */
+static void ktf_run_log_grow(struct ktf_run *run, size_t len)
+{
+	size_t max = max_t(size_t, ktf_log_max, KTF_LOG_MIN);
+	size_t size = max_t(size_t, run->log_size, KTF_LOG_MIN);
+	char *log;
+
+	while (size < run->log_len + len + 1 && size < max)
+		size *= 2;
+	size = min(size, max);
+	if (size <= run->log_size)
+		return;
+
+	log = krealloc(run->self.log, size, GFP_KERNEL);
+	if (!log)
+		return;
+	if (!run->self.log)
+		log[0] = '\0';
+	run->self.log = log;
+	run->log_size = size;
+}
+
+/* Report a failure - with the run's report_lock held */
+static void ktf_report_failure(struct ktf_test *self, const char *file, int line,
+			       const char *report)
+{
+	struct ktf_run *run = ktf_run_of(self);
+	const char *lfmt = "file %s line %d: result 0: %s";
+	size_t len;
+
+	if (self->resp)
+		ktf_resp_report(self->resp, 0, file, line, report);
+	ktf_event_assert(self, 0, file, line, report);
+	tlog(T_PRINTK, "file %s line %d: result 0: %s", file, line, report);
+
+	len = snprintf(NULL, 0, lfmt, file, line, report);
+	if (run->log_len + len >= run->log_size)
+		ktf_run_log_grow(run, len);
+	if (run->log_len + len >= run->log_size && !run->log_truncated) {
+		if (!run->log_size)
+			twarn("Unable to allocate a log for test %s.%s",
+			      self->tclass, self->name);
+		else
+			twarn("Log of test %s.%s truncated at %zu bytes - see the log_max parameter",
+			      self->tclass, self->name, run->log_size);
+		run->log_truncated = true;
+	}
+	if (run->log_size)
+		run->log_len += scnprintf(self->log + run->log_len,
+					  run->log_size - run->log_len,
+					  lfmt, file, line, report);
+}
+
+/* Double the size of the failure ring - with the run's report_lock held.
+ * Only the holder of report_lock reads the entries, so they can be moved:
+ */
+static void ktf_fail_ring_grow(struct ktf_run *run)
+{
+	u32 size = run->fail_size * 2;
+	struct ktf_failure *fail, *old;
+	unsigned long flags;
+	u32 i;
+
+	if (size > KTF_FAIL_RING_MAX)
+		return;
+	fail = kmalloc_array(size, sizeof(*fail), GFP_KERNEL | __GFP_NOWARN);
+	if (!fail)
+		return;
+
+	spin_lock_irqsave(&run->lock, flags);
+	for (i = run->fail_tail; i != run->fail_head; i++)
+		fail[i % size] = run->fail[i % run->fail_size];
+	old = run->fail;
+	run->fail = fail;
+	run->fail_size = size;
+	spin_unlock_irqrestore(&run->lock, flags);
+	kfree(old);
+}
+
+/* Report the recorded failures, preceded by the count of passed assertions */
+static void ktf_report_failures(struct ktf_test *self)
+{
+	struct ktf_run *run = ktf_run_of(self);
+	struct ktf_fail_site sites[KTF_FAIL_SITES];
+	struct ktf_failure *f;
+	unsigned long flags;
+	u32 dropped, nsites, i;
+
+	mutex_lock(&run->report_lock);
+	flush_assert_cnt(self);
+	for (;;) {
+		spin_lock_irqsave(&run->lock, flags);
+		if (run->fail_tail == run->fail_head) {
+			nsites = run->fail_nsites;
+			memcpy(sites, run->fail_sites, nsites * sizeof(*sites));
+			run->fail_nsites = 0;
+			dropped = run->fail_dropped;
+			run->fail_dropped = 0;
+			spin_unlock_irqrestore(&run->lock, flags);
+			break;
+		}
+		spin_unlock_irqrestore(&run->lock, flags);
+
+		/* Only we move the tail, so the entry stays put until we are done with it */
+		f = &run->fail[run->fail_tail % run->fail_size];
+#ifdef CONFIG_BINARY_PRINTF
+		if (f->fmt) {
+			bstr_printf(run->report, MAX_PRINTF, f->fmt, f->buf);
+			ktf_report_failure(self, f->file, f->line, run->report);
+		} else
+#endif
+			ktf_report_failure(self, f->file, f->line, (char *)f->buf);
+
+		spin_lock_irqsave(&run->lock, flags);
+		run->fail_tail++;
+		spin_unlock_irqrestore(&run->lock, flags);
+	}
+	for (i = 0; i < nsites; i++) {
+		snprintf(run->report, MAX_PRINTF,
+			 "%u more failure(s) here - reports dropped as there were more than %u"
+			 " failures between reports (see KTF_FLUSH)", sites[i].count, run->fail_size);
+		ktf_report_failure(self, sites[i].file, sites[i].line, run->report);
+	}
+	if (dropped) {
+		snprintf(run->report, MAX_PRINTF,
+			 "%u failure report(s) dropped - more than %u failures between reports"
+			 " (see KTF_FLUSH)", dropped, run->fail_size);
+		ktf_report_failure(self, "ktf", 0, run->report);
+	}
+	if (nsites || dropped)
+		ktf_fail_ring_grow(run);
+	mutex_unlock(&run->report_lock);
+}
+
+void ktf_flush(struct ktf_test *self)
+{
+	might_sleep();
+	ktf_report_failures(self);
+}
+EXPORT_SYMBOL(ktf_flush);
+
+/* Count a failure that did not fit in the ring by its location - with the run's lock held */
+static void ktf_record_dropped(struct ktf_run *run, const char *file, int line)
+{
+	struct ktf_fail_site *site;
+	u32 i;
+
+	for (i = 0; i < run->fail_nsites; i++) {
+		site = &run->fail_sites[i];
+		if (site->line == line && site->file == file) {
+			site->count++;
+			return;
+		}
+	}
+	if (run->fail_nsites == KTF_FAIL_SITES) {
+		run->fail_dropped++;
+		return;
+	}
+	site = &run->fail_sites[run->fail_nsites++];
+	site->file = file;
+	site->line = line;
+	site->count = 1;
+}
+
+/* Record a failure in the ring - with the run's lock held */
+static void ktf_record_failure(struct ktf_run *run, const char *file, int line,
+			       const char *fmt, va_list ap)
+{
+	struct ktf_failure *f;
+	va_list aq;
+
+	if (run->fail_head - run->fail_tail >= run->fail_size) {
+		ktf_record_dropped(run, file, line);
+		return;
+	}
+	f = &run->fail[run->fail_head % run->fail_size];
+	f->file = file;
+	f->line = line;
+	f->fmt = NULL;
+	va_copy(aq, ap);
+#ifdef CONFIG_BINARY_PRINTF
+	if (vbin_printf(f->buf, KTF_FAIL_WORDS, fmt, ap) <= KTF_FAIL_WORDS)
+		f->fmt = fmt;
+	else
+#endif
+		/* Can't defer the formatting - store the report, truncated if need be */
+		vsnprintf((char *)f->buf, sizeof(f->buf), fmt, aq);
+	va_end(aq);
+	run->fail_head++;
+}
 
 long _ktf_assert(struct ktf_test *self, int result, const char *file,
 		 int line, const char *fmt, ...)
 {
-	int len;
-	va_list ap;
-	char *buf;
-	char bufprefix[256];
+	struct ktf_run *run = ktf_run_of(self);
 	unsigned long flags;
+	va_list ap;
 
 	if (result) {
-		atomic_inc(&assert_cnt);
-	} else {
-		flush_assert_cnt(self);
-		buf = kmalloc(MAX_PRINTF, GFP_KERNEL);
-		if (!buf) {
-			terr("file %s line %d: Unable to allocate memory for the error report!",
-			     file, line);
-			goto out;
-		}
-		va_start(ap, fmt);
-		len = vsnprintf(buf, MAX_PRINTF - 1, fmt, ap);
-		buf[len] = 0;
-		va_end(ap);
-		if (self->skb) {
-			nla_put_u32(self->skb, KTF_A_STAT, result);
-			nla_put_string(self->skb, KTF_A_FILE, file);
-			nla_put_u32(self->skb, KTF_A_NUM, line);
-			nla_put_string(self->skb, KTF_A_STR, buf);
-		}
-		(void)snprintf(bufprefix, sizeof(bufprefix) - 1,
-				"file %s line %d: result %d: ", file, line,
-				result);
-		tlog(T_PRINTK, "%s%s", bufprefix, buf);
-		tlogs(T_STACKD, dump_stack());
-
-		/* Multiple threads may try to update log */
-		spin_lock_irqsave(&assert_lock, flags);
-		(void)strncat(self->log, bufprefix, KTF_MAX_LOG);
-		(void)strncat(self->log, buf, KTF_MAX_LOG);
-		spin_unlock_irqrestore(&assert_lock, flags);
-		kfree(buf);
+		ktf_assert_passed(self);
+		return result;
 	}
-out:
+
+	tlogs(T_STACKD, dump_stack());
+	va_start(ap, fmt);
+	spin_lock_irqsave(&run->lock, flags);
+	self->run_asserts++;
+	self->run_failures++;
+	ktf_record_failure(run, file, line, fmt, ap);
+	spin_unlock_irqrestore(&run->lock, flags);
+	va_end(ap);
+
+	/* Reported at the end of the test iteration, or by KTF_FLUSH() */
 	return result;
 }
 EXPORT_SYMBOL(_ktf_assert);
 
+void ktf_metric(struct ktf_test *self, const char *name, s64 value, const char *unit)
+{
+	tlog(T_DEBUG, "%s.%s: metric %s = %lld %s", self->tclass, self->name,
+	     name, value, unit ? unit : "");
+	ktf_resp_metric(self->resp, name, value, unit);
+}
+EXPORT_SYMBOL(ktf_metric);
+
+/* Match name against a single glob pattern [pat, end) with '*' and '?' */
+static bool ktf_glob_match(const char *pat, const char *end, const char *name)
+{
+	const char *star = NULL, *back = NULL;
+
+	while (*name) {
+		if (pat < end && *pat == '*') {
+			star = ++pat;
+			back = name;
+		} else if (pat < end && (*pat == '?' || *pat == *name)) {
+			pat++;
+			name++;
+		} else if (star) {
+			/* Let the last '*' swallow one more character */
+			pat = star;
+			name = ++back;
+		} else {
+			return false;
+		}
+	}
+	while (pat < end && *pat == '*')
+		pat++;
+	return pat == end;
+}
+
+/* Match name against any of the ':' separated patterns in [pats, end) */
+static bool ktf_glob_match_any(const char *pats, const char *end, const char *name)
+{
+	const char *sep;
+
+	while (pats < end) {
+		sep = memchr(pats, ':', end - pats);
+		if (!sep)
+			sep = end;
+		if (ktf_glob_match(pats, sep, name))
+			return true;
+		pats = sep + 1;
+	}
+	return false;
+}
+
+bool ktf_filter_match(const char *filter, const char *name)
+{
+	const char *neg;
+
+	if (!filter || !*filter)
+		return true;
+	neg = strchr(filter, '-');
+	if (!neg)
+		return ktf_glob_match_any(filter, filter + strlen(filter), name);
+
+	/* An empty positive part includes all tests */
+	if (neg > filter && !ktf_glob_match_any(filter, neg, name))
+		return false;
+	return !ktf_glob_match_any(neg + 1, neg + 1 + strlen(neg + 1), name);
+}
+
 /* Add a test to a testcase:
  * Tests are represented by ktf_test objects that are linked into
  * a per-test case map TCase:tests map.
@@ -233,27 +743,20 @@ void  _ktf_add_test(struct __test_desc td, struct ktf_handle *th,
 {
 	struct ktf_case *tc = NULL;
 	struct ktf_test *t;
-	char *log;
 
 	if (ktf_handle_version_check(th))
 		return;
 
-	log = kzalloc(KTF_MAX_LOG, GFP_KERNEL);
-	if (!log)
-		return;
-
 	t = kzalloc(sizeof(*t), GFP_KERNEL);
-	if (!t) {
-		kfree(log);
+	if (!t)
 		return;
-	}
 	t->tclass = td.tclass;
 	t->name = td.name;
 	t->fun = td.fun;
 	t->start = start;
 	t->end = end;
 	t->handle = th;
-	t->log = log;
+	INIT_LIST_HEAD(&t->log_list);
 
 	mutex_lock(&tc_lock);
 	tc = ktf_case_find_create(td.tclass);
@@ -264,16 +767,20 @@ void  _ktf_add_test(struct __test_desc td, struct ktf_handle *th,
 		if (tc)
 			ktf_case_put(tc);
 		mutex_unlock(&tc_lock);
-		kfree(log);
 		kfree(t);
 		return;
 	}
 
 	ktf_debugfs_create_test(t);
+	ktf_test_alloc_id(t);
 
 	tlog(T_LIST, "Added test \"%s.%s\" start = %d, end = %d",
 	     td.tclass, td.name, start, end);
 
+	/* Tests that require a context are not visible until the handle has one */
+	if (th->id || !th->require_context)
+		ktf_catalog_change(KTF_CHANGE_TEST_ADD, th->id, td.tclass, td.name, t->id);
+
 	/* Now since we no longer reference tc/t outside of global map of test
 	 * cases and per-testcase map of tests, drop their refcounts.  This
 	 * is safe to do as refcounts are > 0 due to references for map
@@ -285,16 +792,100 @@ void  _ktf_add_test(struct __test_desc td, struct ktf_handle *th,
 }
 EXPORT_SYMBOL(_ktf_add_test);
 
-void ktf_run_hook(struct sk_buff *skb, struct ktf_context *ctx,
-		  struct ktf_test *t, u32 value,
-		void *oob_data, size_t oob_data_sz)
+static struct ktf_run *ktf_run_alloc(struct ktf_test *t, void *oob_data, size_t oob_data_sz)
+{
+	struct ktf_run *run = kmalloc(sizeof(*run), GFP_KERNEL);
+
+	if (!run) {
+		terr("Unable to allocate state for running test %s.%s", t->tclass, t->name);
+		return NULL;
+	}
+	run->self = *t;
+	run->self.assert_cnt = alloc_percpu(unsigned long);
+	if (!run->self.assert_cnt) {
+		terr("Unable to allocate assertion counters for test %s.%s", t->tclass, t->name);
+		kfree(run);
+		return NULL;
+	}
+	run->fail = kmalloc_array(KTF_FAIL_RING, sizeof(*run->fail), GFP_KERNEL);
+	run->report = kmalloc(MAX_PRINTF, GFP_KERNEL);
+	if (!run->fail || !run->report) {
+		terr("Unable to allocate failure records for test %s.%s", t->tclass, t->name);
+		kfree(run->report);
+		kfree(run->fail);
+		free_percpu(run->self.assert_cnt);
+		kfree(run);
+		return NULL;
+	}
+	spin_lock_init(&run->lock);
+	mutex_init(&run->report_lock);
+	run->counted = 0;
+	run->fail_size = KTF_FAIL_RING;
+	run->fail_head = 0;
+	run->fail_tail = 0;
+	run->fail_nsites = 0;
+	run->fail_dropped = 0;
+	run->log_len = 0;
+	run->log_size = 0;
+	run->log_truncated = false;
+	run->self.log = NULL;
+	run->self.data = oob_data;
+	run->self.data_sz = oob_data_sz;
+	return run;
+}
+
+/* Keep the log and time of the last run with the test, for debugfs.
+ * Only failed runs have a log, so passing tests use no memory for it:
+ */
+static void ktf_run_free(struct ktf_test *t, struct ktf_run *run)
+{
+	struct ktf_test *old;
+
+	spin_lock(&lastrun_lock);
+	ktf_test_log_drop(t);
+	if (run->log_len) {
+		t->log = run->self.log;
+		t->log_size = run->log_size;
+		run->self.log = NULL;
+		list_add_tail(&t->log_list, &kept_logs);
+		kept_log_size += t->log_size;
+		while (kept_log_size > ktf_log_keep) {
+			old = list_first_entry(&kept_logs, struct ktf_test, log_list);
+			ktf_test_log_drop(old);
+		}
+	}
+	t->lastrun = run->self.lastrun;
+	spin_unlock(&lastrun_lock);
+	kfree(run->self.log);
+	kfree(run->report);
+	kfree(run->fail);
+	free_percpu(run->self.assert_cnt);
+	kfree(run);
+}
+
+static void ktf_run_once(struct ktf_run_resp *resp, struct ktf_context *ctx,
+			 struct ktf_test *t, u32 value)
 {
+	u32 iters = t->end > t->start ? t->end - t->start : 0;
+	u64 *iter_ns = NULL;
+	u64 start, iter_start;
 	int i;
 
-	t->log[0] = '\0';
-	t->skb = skb;
-	t->data = oob_data;
-	t->data_sz = oob_data_sz;
+	/* Per iteration times are only of interest for loop tests,
+	 * and only as many as the response can carry:
+	 */
+	if (resp && iters > 1 && iters <= KTF_MAX_ITER_TIMES)
+		iter_ns = kcalloc(iters, sizeof(u64), GFP_KERNEL | __GFP_NOWARN);
+
+	if (t->log)
+		t->log[0] = '\0';
+	ktf_run_of(t)->log_len = 0;
+	ktf_run_of(t)->log_truncated = false;
+	t->resp = resp;
+	t->run_asserts = 0;
+	t->run_failures = 0;
+	ktf_event_test(KTF_EVENT_TEST_START, t, ctx);
+	start = ktime_get_ns();
 	for (i = t->start; i < t->end; i++) {
 		if (!ctx && t->handle->require_context) {
 			terr("Test %s.%s requires a context, but none configured!",
@@ -303,7 +894,7 @@ void ktf_run_hook(struct sk_buff *skb, struct ktf_context *ctx,
 		}
 		/* No need to bump refcnt, this is just for debugging.  Nothing
 		 * should reference the testcase via the handle's current test
-		 * pointer.
+		 * pointer. With concurrent runs, it is the last one started.
 		 */
 		t->handle->current_test = t;
 		tlogs(T_DEBUG,
@@ -313,10 +904,103 @@ void ktf_run_hook(struct sk_buff *skb, struct ktf_context *ctx,
 			printk("[%d:%d]\n", t->start, t->end);
 		);
 		ktime_get_ts64(&t->lastrun);
+		iter_start = ktime_get_ns();
 		t->fun(t, ctx, i, value);
-		flush_assert_cnt(t);
+		if (iter_ns)
+			iter_ns[i - t->start] = ktime_get_ns() - iter_start;
+		ktf_report_failures(t);
 	}
-	t->handle->current_test = NULL;
+	ktf_resp_timing(resp, ktime_get_ns() - start, iter_ns, iter_ns ? iters : 0);
+	cmpxchg(&t->handle->current_test, t, NULL);
+	t->resp = NULL;
+	ktf_event_test(KTF_EVENT_TEST_END, t, ctx);
+}
+
+int ktf_run_hook(struct ktf_run_resp *resp, struct ktf_context *ctx,
+		 struct ktf_test *t, u32 value,
+		 void *oob_data, size_t oob_data_sz)
+{
+	struct ktf_run *run = ktf_run_alloc(t, oob_data, oob_data_sz);
+
+	if (!run)
+		return -ENOMEM;
+	ktf_run_once(resp, ctx, &run->self, value);
+	ktf_run_free(t, run);
+	return 0;
+}
+
+/* Soak and flakiness runs: Only the first run is reported in full, and the
+ * log of the first run that failed, if another. The rest is summarized:
+ */
+int ktf_run_repeat(struct ktf_run_resp *resp, struct ktf_context *ctx,
+		   struct ktf_test *t, u32 value, void *oob_data, size_t oob_data_sz,
+		   u32 repeat, u32 run_for)
+{
+	struct ktf_repeat_stats st = { .fastest = U64_MAX };
+	u64 start = ktime_get_ns(), end = start + (u64)run_for * NSEC_PER_MSEC;
+	u64 run_start, d, total = 0;
+	u32 first_failed = 0;
+	char *first_log = NULL;
+	struct ktf_run *run;
+	char *buf;
+
+	run = ktf_run_alloc(t, oob_data, oob_data_sz);
+	if (!run)
+		return -ENOMEM;
+
+	if (!repeat && !run_for)
+		repeat = 1;
+
+	do {
+		run_start = ktime_get_ns();
+		ktf_run_once(st.runs ? NULL : resp, ctx, &run->self, value);
+		d = ktime_get_ns() - run_start;
+		total += d;
+		st.fastest = min(st.fastest, d);
+		st.slowest = max(st.slowest, d);
+		st.asserts += run->self.run_asserts;
+		st.failures += run->self.run_failures;
+		if (run->self.run_failures) {
+			if (!st.failed_runs) {
+				first_failed = st.runs;
+				if (st.runs)
+					first_log = kstrdup(run->self.log, GFP_KERNEL);
+			}
+			st.failed_runs++;
+		}
+		st.runs++;
+
+		/* Stop if the test timed out */
+		if (fatal_signal_pending(current))
+			break;
+		cond_resched();
+	} while ((!repeat || st.runs < repeat) && (!run_for || ktime_get_ns() < end));
+	ktf_run_free(t, run);
+
+	st.mean = div64_u64(total, st.runs);
+	tlog(T_DEBUG, "Test %s.%s: %u of %u runs failed", t->tclass, t->name,
+	     st.failed_runs, st.runs);
+	if (!resp)
+		goto out;
+
+	ktf_resp_timing(resp, ktime_get_ns() - start, NULL, 0);
+	if (st.failed_runs) {
+		buf = kmalloc(MAX_PRINTF, GFP_KERNEL);
+		if (buf) {
+			if (first_log)
+				snprintf(buf, MAX_PRINTF, "%u of %u runs failed, first in run %u: %s",
+					 st.failed_runs, st.runs, first_failed + 1, first_log);
+			else
+				snprintf(buf, MAX_PRINTF, "%u of %u runs failed",
+					 st.failed_runs, st.runs);
+			ktf_resp_report(resp, 0, __FILE__, __LINE__, buf);
+			kfree(buf);
+		}
+	}
+	ktf_resp_repeat(resp, &st);
+out:
+	kfree(first_log);
+	return 0;
 }
 
 /* Clean up all tests associated with a ktf_handle */
@@ -340,6 +1024,8 @@ void ktf_test_cleanup(struct ktf_handle *th)
 			if (t->handle == th) {
 				tlog(T_DEBUG, "ktf: delete test %s.%s",
 				     t->tclass, t->name);
+				ktf_catalog_change(KTF_CHANGE_TEST_DEL, th->id, t->tclass, t->name, 0);
+				ktf_test_free_id(t);
 				/* removes ref for debugfs */
 				ktf_debugfs_destroy_test(t);
 				/* removes ref for testset map of tests */
@@ -392,6 +1078,7 @@ int ktf_cleanup(void)
 		return -EBUSY;
 	}
 	ktf_debugfs_cleanup();
+	idr_destroy(&test_ids);
 	mutex_unlock(&tc_lock);
 	return 0;
 }
@@ -11,6 +11,7 @@
 #define KTF_TEST_H
 
 #include <net/netlink.h>
+#include <linux/percpu.h>
 #include <linux/version.h>
 #include "ktf_map.h"
 #include "ktf_unlproto.h"
@@ -22,6 +23,7 @@
 struct ktf_context;
 
 struct ktf_test;
+struct ktf_run_resp;
 
 typedef void (*ktf_test_fun) (struct ktf_test *, struct ktf_context* tdev, int, u32);
 
@@ -39,13 +41,19 @@ struct ktf_test {
 	ktf_test_fun fun;
 	int start; /* Start and end value to argument to fun */
 	int end;   /* Defines number of iterations */
-	struct sk_buff *skb; /* sk_buff for recording assertion results */
-	char *log; /* per-test log */
+	struct ktf_run_resp *resp; /* Response for recording assertion results */
+	char *log; /* Log of the current run, in a run's copy of the test, else of the last run */
+	size_t log_size; /* Size of the kept log of the last run, if any */
+	struct list_head log_list; /* Linkage for the kept logs */
 	void *data; /* Test specific out-of-band data */
 	size_t data_sz; /* Size of the data element, if set */
+	u32 run_asserts; /* Assertions in the current/last run */
+	u32 run_failures; /* Failed assertions in the current/last run */
+	unsigned long __percpu *assert_cnt; /* Passed assertions per CPU, during a run */
 	struct timespec64 lastrun; /* last time test was run */
 	struct ktf_debugfs debugfs; /* debugfs info for test */
 	struct ktf_handle *handle; /* Handler for owning module */
+	u32 id; /* Numeric ID user space can refer to the test by, 0 if none */
 };
 
 struct ktf_case {
@@ -76,16 +84,48 @@ void ktf_case_put(struct ktf_case *);
 
 int ktf_version_check(u64 version);
 
-void ktf_run_hook(struct sk_buff *skb, struct ktf_context *ctx,
-		struct ktf_test *t, u32 value,
-		void *oob_data, size_t oob_data_sz);
+/* Run test t, with its own copy of the test state for the run, so that
+ * runs of the same test may execute concurrently. Returns 0 or -ENOMEM:
+ */
+int ktf_run_hook(struct ktf_run_resp *resp, struct ktf_context *ctx,
+		 struct ktf_test *t, u32 value,
+		 void *oob_data, size_t oob_data_sz);
+
+/* Summary of the repeated runs of a test, times are in ns */
+struct ktf_repeat_stats {
+	u32 runs;
+	u32 failed_runs;	/* Runs with at least one failed assertion */
+	u64 asserts;
+	u64 failures;
+	u64 fastest;
+	u64 mean;
+	u64 slowest;
+};
+
+/* Run a test repeat times and/or for run_for ms, whichever ends first */
+int ktf_run_repeat(struct ktf_run_resp *resp, struct ktf_context *ctx,
+		   struct ktf_test *t, u32 value, void *oob_data, size_t oob_data_sz,
+		   u32 repeat, u32 run_for);
 void flush_assert_cnt(struct ktf_test *self);
 
+/* Hold while looking at the log of the last run of a test, which may be discarded any time */
+void ktf_test_log_lock(void);
+void ktf_test_log_unlock(void);
+
+/* Does name match filter, in the syntax of --gtest_filter? A NULL filter matches all */
+bool ktf_filter_match(const char *filter, const char *name);
+
 /* Representation of a test case (a group of tests) */
 struct ktf_case;
 
 struct ktf_case *ktf_case_find(const char *name);
 
+/* Find a test by name within test case tc, or by its ID.
+ * Returns with the test's refcount increased, or NULL if not found:
+ */
+struct ktf_test *ktf_test_find(struct ktf_case *tc, const char *name);
+struct ktf_test *ktf_test_find_id(u32 id);
+
 /* Each module client of the test framework is required to
  * declare at least one ktf_handle via the macro
  * DECLARE_KTF_HANDLE (below)
@@ -97,9 +137,33 @@ struct ktf_handle;
 /* Find the handle associated with handle id hid */
 struct ktf_handle *ktf_handle_find(int hid);
 
+/* Find the context of handle with ID id, or NULL if there is none */
+struct ktf_context *ktf_find_context_id(struct ktf_handle *handle, u32 id);
+
 /* Called upon ktf unload to clean up test cases */
 int ktf_cleanup(void);
 
+/* A change to the catalog of tests and contexts */
+struct ktf_change_entry {
+	u64 gen; /* The catalog generation resulting from this change */
+	enum ktf_change type;
+	u32 hid;
+	u32 id; /* ID of the test or context added, if any */
+	char setname[KTF_MAX_KEY + 1];
+	char name[KTF_MAX_KEY + 1];
+};
+
+/* Record a change to the catalog and bump the generation */
+void ktf_catalog_change(enum ktf_change type, u32 hid, const char *setname, const char *name,
+			u32 id);
+u64 ktf_catalog_generation(void);
+void ktf_catalog_init(void);
+
+/* Get the change that resulted in generation gen,
+ * returns -ENOENT if it is no longer (or not yet) available:
+ */
+int ktf_catalog_get_change(u64 gen, struct ktf_change_entry *chg);
+
 /* The list of handles that have contexts associated with them */
 extern struct list_head context_handles;
 
@@ -182,7 +246,7 @@ struct ktf_handle {
 	unsigned int id; 	      /* A unique nonzero ID for this handle, set iff contexts */
 	bool require_context;	      /* If set, tests are only valid if a context is provided */
 	u64 version;		      /* version assoc. with handle */
-	struct ktf_test *current_test;/* Current test running */
+	struct ktf_test *current_test;/* Last test started, while running */
 };
 
 void ktf_test_cleanup(struct ktf_handle *th);
@@ -298,17 +362,105 @@ void ktf_cleanup_check(void);
 	static void __testname##_body(struct ktf_test *self, struct __fixture *ctx, \
 			int _i, u32 _value)
 
+/* Start a microbenchmark with BENCH(suite_name, bench_name), and add it
+ * with ADD_TEST(bench_name) like other tests. The body is the operation to
+ * measure. KTF calls it in a loop, scaling the number of iterations until each
+ * sample takes KTF_BENCH_TARGET_NS, and then takes KTF_BENCH_SAMPLES
+ * samples. The statistics of the time per operation is returned to user space
+ * with the test results. The body has self, ctx and _value available as in a TEST,
+ * and can use the usual assertions. Use ktf_bench_keep(x) to keep the compiler from
+ * optimizing away the computation of a result x that is otherwise unused:
+ */
+#define BENCH(__testsuite, __testname) \
+	static inline void __testname##_op(struct ktf_test *self, struct ktf_context *ctx, \
+					   u32 _value); \
+	static void __testname##_loop(struct ktf_test *self, struct ktf_context *ctx, \
+				      u32 _value, u64 _iters) \
+	{ \
+		u64 __n; \
+		for (__n = 0; __n < _iters; __n++) \
+			__testname##_op(self, ctx, _value); \
+	} \
+	static void __testname(struct ktf_test *self, struct ktf_context *ctx, \
+			       int _i, u32 _value) \
+	{ \
+		ktf_bench_run(self, ctx, _value, __testname##_loop); \
+	} \
+	struct __test_desc __testname##_setup = \
+	{ .tclass = "" # __testsuite "", .name = "" # __testname "", \
+	  .fun = __testname, .file = __FILE__ }; \
+	\
+	static inline void __testname##_op(struct ktf_test *self, struct ktf_context *ctx, \
+					   u32 _value)
+
+#define ktf_bench_keep(x) barrier_data(&(x))
+
+#define KTF_BENCH_TARGET_NS	(10 * NSEC_PER_MSEC)
+#define KTF_BENCH_SAMPLES	16
+
+typedef void (*ktf_bench_loop)(struct ktf_test *, struct ktf_context *, u32, u64);
+
+/* Statistics of a benchmark, times per operation are in ps */
+struct ktf_bench_stats {
+	u64 iters;	/* Operations per sample */
+	u32 samples;
+	u64 mean;
+	u64 median;
+	u64 stddev;
+	u64 min;
+	u64 cycles;	/* Mean CPU cycles per 1000 operations, if available */
+};
+
+/* Run a benchmark loop - called by the tests defined with BENCH() */
+void ktf_bench_run(struct ktf_test *self, struct ktf_context *ctx, u32 value,
+		   ktf_bench_loop loop);
+
+/* Report a named numeric result of the test, such as a throughput, a latency or
+ * a byte count, with the unit it is in (eg. "ns", "MB/s" or ""). Metrics are returned
+ * with the test results, and show up as gtest properties. Reporting a metric with
+ * the same name again replaces the value:
+ */
+#define KTF_METRIC(self, name, value, unit) ktf_metric(self, name, (s64)(value), unit)
+
+void ktf_metric(struct ktf_test *self, const char *name, s64 value, const char *unit);
+
+/* Failed assertions are recorded, and reported to user space at the end of each
+ * test iteration. Use KTF_FLUSH(self) to report them earlier, from a context that
+ * can sleep, eg. before waiting for something that may never happen, or in a loop
+ * that may fail many times:
+ */
+#define KTF_FLUSH(self) ktf_flush(self)
+
+void ktf_flush(struct ktf_test *self);
+
+/* Passed assertions of all runs, for ktf_get_assertion_count() */
+DECLARE_PER_CPU(unsigned long, ktf_assert_total);
+
+/* Count a passed assertion. This is the common case, so it is kept inline,
+ * and the call to _ktf_assert() with the formatting of the report is only
+ * made upon failure:
+ */
+static inline void ktf_assert_passed(struct ktf_test *self)
+{
+	this_cpu_inc(*self->assert_cnt);
+	this_cpu_inc(ktf_assert_total);
+}
+
 /* Fail the test case unless expr is true */
 /* The space before the comma sign before ## is essential to be compatible
    with gcc 2.95.3 and earlier.
 */
 #define ktf_assert_msg(expr, format, ...)			\
-	_ktf_assert(self, expr, __FILE__, __LINE__,		\
-        format , ## __VA_ARGS__, NULL)
+	({ int __ktf_result = (expr);				\
+	   if (likely(__ktf_result))				\
+		ktf_assert_passed(self);			\
+	   else							\
+		_ktf_assert(self, 0, __FILE__, __LINE__,	\
+			    format , ## __VA_ARGS__, NULL);	\
+	   __ktf_result; })
 
 #define ktf_assert(expr, ...)\
-	_ktf_assert(self, expr, __FILE__, __LINE__,		\
-        "Failure '"#expr"' occurred " , ## __VA_ARGS__, NULL)
+	ktf_assert_msg(expr, "Failure '"#expr"' occurred " , ## __VA_ARGS__)
 
 /* Always fail */
 #define ktf_fail(...) _ktf_assert(self, 0, __FILE__, __LINE__, "Failed" , ## __VA_ARGS__, NULL)
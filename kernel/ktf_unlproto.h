@@ -8,6 +8,7 @@
  */
 #ifndef _KTF_UNLPROTO_H
 #define _KTF_UNLPROTO_H
+#include <linux/ioctl.h>
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -19,6 +20,7 @@ enum ktf_cmd {
 	KTF_C_RUN,	/* Run a test */
 	KTF_C_COV,	/* Enable/disable coverage support */
 	KTF_C_CTX_CFG,	/* Configure a context */
+	KTF_C_EVENT,	/* Event about test execution (kernel to user only) */
 	KTF_C_MAX,
 };
 
@@ -55,26 +57,142 @@ enum ktf_cmd {
  * <testset_data>    ::= STR TEST <test_data>+
  * <test_data>       ::= HID STR
  *
+ * Alternatively a QUERY request can be sent as a dump request (NLM_F_DUMP),
+ * in which case the response is a multipart message, where each part is
+ * a QUERY response with a subset of the handles or test sets, in the same order
+ * as for the single message response. All handles are sent before any test sets, and
+ * the tests of a large test set may be split over several parts, each starting with
+ * the name of the set:
+ *
+ * <QUERY_dump_part> ::= VERSION [ <handle_list> ] [ NUM <testset_list> ]
+ *
+ * QUERY responses also contain the current generation (GEN) of the kernel's catalog of
+ * tests and contexts, which is increased by each addition or removal of a test or context.
+ * If the QUERY request contains a GEN, only the changes since that generation are
+ * returned, as a list of changes (CLIST) each identified by a ktf_change in NUM.
+ * If the changes are no longer available, or some changes require a full QUERY,
+ * the response contains STAT = ESTALE instead:
+ *
+ * <QUERY_request>   ::= VERSION [ GEN ]
+ * <QUERY_delta_rsp> ::= VERSION GEN ( CLIST <change>+ | STAT )
+ * <change>          ::= LIST NUM [ HID ] [ SNAM ] STR
+ *
+ * A full QUERY (single or dump) can contain a FILTER on the names of the tests as seen by
+ * user space (set.test, or set.test_context for each context of a test), in the syntax of
+ * --gtest_filter: ':' separated glob patterns with '*' and '?', optionally followed by
+ * '-' and patterns to exclude. Only test sets with matching tests, and only the tests that
+ * match in at least one context, are then returned. The handles are returned in full:
+ *
+ * <QUERY_request>   ::= VERSION [ FILTER ]
+ *
+ * If the VERSION of a QUERY request is at least KTF_VERSION_GEN, a request with NUM = 0
+ * returns only the current generation, for instance for user space to check if
+ * a catalog of tests it has saved is still valid. Older kernels ignore NUM and send
+ * a full QUERY response, which also contains the generation:
+ *
+ * <QUERY_request>   ::= VERSION NUM
+ * <QUERY_gen_rsp>   ::= VERSION GEN
+ *
+ * If the VERSION of the QUERY request is at least KTF_VERSION_IDS, each test is followed by
+ * its numeric ID (TID) and each context by its ID (CID). An ID is unique among the tests,
+ * respectively contexts, for as long as the test or context exists, and changes to the
+ * catalog also contain the ID of an added test or context:
+ *
+ * <test_data>       ::= [ HID ] STR TID
+ * <context_data>    ::= STR [ MOD ] STAT CID
+ * <change>          ::= LIST NUM [ HID ] [ SNAM ] STR [ TID | CID ]
+ *
  *
  * RUN:
  * ----
- * A RUN request currently specifies a run of a single named test. A test is identified
+ * A RUN request specifies a run of a single named test. A test is identified
  * by a test SNAME (set/suite name) a TNAM (test name) and an optional context (STR attribute)
  * to run it in. In addition tests can be arbitrarily parameterized, so tests optionally
  * allow out-of-band data via a DATA binary attribute.
- * The kernel response is a global status (in STAT) pluss an optional set of test results
- * eg. it supports running multiple tests, but this is not currently used.
+ * The kernel response is a global status (in STAT) pluss an optional set of test results.
  *
  * Each test result contains an optional list of individual error reports and
  * which each contains file name (FILE), line number (NUM) and a formatted error report string.
  * In addition each test result reports the number of assertions that were executed in the STAT
  * attribute:
  *
- * <RUN_request>     ::= VERSION SNAM TNAM [ STR ][ DATA ]
+ * <RUN_request>     ::= VERSION SNAM TNAM [ STR ][ DATA | <shm_data> ]
+ *
+ * Instead of by name, the test and context can be identified by the IDs from the QUERY,
+ * which saves the kernel the lookups by name. This also applies to the entries of a batch:
+ *
+ * <RUN_request>     ::= VERSION TID [ CID ][ DATA | <shm_data> ]
+ *
  * <RUN_response>    ::= STAT LIST <test_result>
  * <test_run_result> ::= STAT [ LIST <error_report>+ ]
  * <error_report>    ::= STAT FILE NUM STR
  *
+ * Data too large for a DATA attribute can be passed in a shared memory region
+ * set up by user space by mmap of the ktf device (KTF_SHM_DEV_NAME). The region is
+ * identified by the id obtained with the KTF_IOC_SHM_ID ioctl (SHM), and the data
+ * by its offset (SOFF) and length (SLEN) within the region. The test then
+ * sees the data in place:
+ *
+ * <shm_data>        ::= SHM SOFF SLEN
+ *
+ * Alternatively a RUN request can specify a batch of tests to run (BLIST) instead
+ * of a single test, to save the round trips of one request per test.
+ * The kernel responds to a batch with a multipart message with one RUN response
+ * per test, each with the index of the test within the batch in NUM,
+ * terminated by NLMSG_DONE. Batch requests are sent without requesting an ack:
+ *
+ * <RUN_request>     ::= VERSION BLIST <batch_entry>+
+ * <batch_entry>     ::= TEST ( SNAM TNAM [ STR ] | TID [ CID ] ) [ NUM ]
+ * <RUN_response>    ::= NUM STAT LIST <test_result>
+ *
+ * If the VERSION of the request is at least KTF_VERSION_STREAM, the results of a test are
+ * streamed as they are produced: The RUN response is then preceded by any number of partial
+ * responses without a global STAT, and the response to a single test is a multipart
+ * message terminated by NLMSG_DONE. Error reports that are lost due to a user space receive
+ * buffer overrun are reported as an additional error in a later part:
+ *
+ * <RUN_partial>     ::= [ NUM ] LIST <test_result>
+ *
+ * A RUN request (single or batch) can specify a timeout in ms (TMO) for each test.
+ * The kernel then runs the test in a separate thread, and if it does not complete in time,
+ * abandons it (interrupting any killable waits), and responds with STAT = -ETIMEDOUT.
+ *
+ * The final part of the RUN response for a test that completed also contains the time
+ * in ns the kernel spent running it (DURATION), and for a test that loops over a range
+ * of values, the time spent in each iteration, as far as they fit in the response:
+ *
+ * <RUN_response>    ::= [ NUM ] LIST <test_result> STAT [ DURATION [ ILIST DURATION+ ] ]
+ *
+ * A benchmark test (see BENCH() in ktf_test.h) in addition returns the statistics of
+ * the time per operation in a BENCH nest, with attributes from enum ktf_bench_attr:
+ *
+ * <RUN_response>    ::= [ NUM ] LIST <test_result> STAT [ DURATION ] [ BENCH <bench_stats> ]
+ *
+ * Metrics reported by the test with KTF_METRIC() are returned in an MLIST of METRIC nests,
+ * with attributes from enum ktf_metric_attr:
+ *
+ * <RUN_response>    ::= [ NUM ] LIST <test_result> STAT [ DURATION ] [ MLIST <metric>+ ]
+ * <metric>          ::= METRIC NAME VALUE UNIT
+ *
+ * A RUN request (single or batch) can ask for each test to be run repeatedly in the kernel,
+ * a number of times (REPEAT) and/or for a time in ms (RUNFOR), whichever ends first.
+ * A timeout then applies to all the runs of the test together. Only the results of
+ * the first run are reported in full, along with an error report with the log of the first
+ * run that failed, if another. DURATION is the time spent in all the runs, and RSTATS
+ * summarizes them, with attributes from enum ktf_repeat_attr:
+ *
+ * <RUN_request>     ::= VERSION SNAM TNAM [ STR ] [ NUM ] [ REPEAT ] [ RUNFOR ]
+ * <RUN_response>    ::= [ NUM ] LIST <test_result> STAT [ DURATION ] [ RSTATS <repeat_stats> ]
+ *
+ * Instead of naming the tests, a RUN request can contain a FILTER as for QUERY, to run every
+ * test that matches, in each matching context, in catalog order. The response is a multipart
+ * message as for a batch, but each part identifies the test by name, since user space does
+ * not know the tests in advance:
+ *
+ * <RUN_request>     ::= VERSION FILTER [ TMO ] [ REPEAT ] [ RUNFOR ]
+ * <RUN_partial>     ::= NUM SNAM TNAM [ STR ] LIST <test_result>
+ * <RUN_response>    ::= NUM SNAM TNAM [ STR ] LIST <test_result> STAT [ DURATION ... ]
+ *
  * COV:
  * ----
  * A COV request is currently used to either enable or disable (NUM = 1/0)
@@ -97,6 +215,19 @@ enum ktf_cmd {
  *
  * <CTX_CFG_request> ::= VERSION STR HID DATA [ FILE ]
  *
+ * EVENT:
+ * ------
+ * The kernel publishes events about all test execution, regardless of how the test was
+ * started, to the KTF_MCGRP_EVENTS multicast group. Each event identifies its type
+ * (a ktf_event in EVENT), a timestamp in ns since the epoch (TIME) and the test.
+ * Start and end of a test contain the context (STR) if any, an assertion event contains an
+ * error report as in the RUN response, and the end of a test contains the number of
+ * assertions (NUM) and failures (STAT) of the run:
+ *
+ * <EVENT_start>     ::= VERSION EVENT TIME SNAM TNAM [ STR ]
+ * <EVENT_assert>    ::= VERSION EVENT TIME SNAM TNAM STAT FILE NUM STR
+ * <EVENT_end>       ::= VERSION EVENT TIME SNAM TNAM [ STR ] NUM STAT
+ *
  */
 
 /* supported attributes */
@@ -116,9 +247,82 @@ enum ktf_attr {
 	KTF_A_MOD,    /* module for coverage analysis, also used for context type */
 	KTF_A_COVOPT, /* options for coverage analysis */
 	KTF_A_DATA,   /* Binary data used by a.o. hybrid tests */
+	KTF_A_BLIST,  /* List of tests to run as a batch */
+	KTF_A_GEN,    /* Generation of the catalog of tests and contexts */
+	KTF_A_CLIST,  /* List of changes to the catalog */
+	KTF_A_SHM,    /* ID of a shared memory region with data for the test */
+	KTF_A_SOFF,   /* Offset of the data within the shared memory region */
+	KTF_A_SLEN,   /* Length of the data within the shared memory region */
+	KTF_A_EVENT,  /* Type of event */
+	KTF_A_TIME,   /* Time of event */
+	KTF_A_TMO,    /* Timeout in ms for running a test */
+	KTF_A_DURATION, /* Time in ns spent running a test */
+	KTF_A_ILIST,  /* List of times spent in each iteration of a test */
+	KTF_A_BENCH,  /* Statistics from a benchmark */
+	KTF_A_MLIST,  /* List of metrics reported by a test */
+	KTF_A_METRIC, /* A named metric, see enum ktf_metric_attr */
+	KTF_A_REPEAT, /* Number of times to run a test */
+	KTF_A_RUNFOR, /* Time in ms to keep running a test */
+	KTF_A_RSTATS, /* Summary of the repeated runs of a test */
+	KTF_A_FILTER, /* Filter on test names, in the syntax of --gtest_filter */
+	KTF_A_TID,    /* Numeric ID of a test */
+	KTF_A_CID,    /* Numeric ID of a context */
 	KTF_A_MAX
 };
 
+/* Types of changes to the catalog of tests and contexts */
+enum ktf_change {
+	KTF_CHANGE_TEST_ADD,	/* Test STR added to set SNAM (with contexts from HID) */
+	KTF_CHANGE_TEST_DEL,	/* Test STR removed from set SNAM */
+	KTF_CHANGE_CTX_ADD,	/* Context STR added to handle HID */
+	KTF_CHANGE_CTX_DEL,	/* Context STR removed from handle HID */
+	KTF_CHANGE_RESYNC,	/* A change that requires a full QUERY */
+};
+
+/* Events published to the KTF_MCGRP_EVENTS multicast group */
+enum ktf_event {
+	KTF_EVENT_TEST_START,
+	KTF_EVENT_ASSERT,	/* A failed assertion */
+	KTF_EVENT_TEST_END,
+};
+
+#define	KTF_MCGRP_EVENTS	"events"
+
+/* Attributes within a KTF_A_BENCH nest. Times are per operation in ps */
+enum ktf_bench_attr {
+	KTF_BENCH_A_UNSPEC,
+	KTF_BENCH_A_ITERS,	/* Operations per sample (u64) */
+	KTF_BENCH_A_SAMPLES,	/* Number of samples (u32) */
+	KTF_BENCH_A_MEAN,	/* (u64) */
+	KTF_BENCH_A_MEDIAN,	/* (u64) */
+	KTF_BENCH_A_STDDEV,	/* (u64) */
+	KTF_BENCH_A_MIN,	/* (u64) */
+	KTF_BENCH_A_CYCLES,	/* Mean CPU cycles per 1000 operations, if available (u64) */
+	KTF_BENCH_A_MAX
+};
+
+/* Attributes within a KTF_A_METRIC nest */
+enum ktf_metric_attr {
+	KTF_METRIC_A_UNSPEC,
+	KTF_METRIC_A_NAME,	/* (string) */
+	KTF_METRIC_A_VALUE,	/* (s64, sent as u64) */
+	KTF_METRIC_A_UNIT,	/* (string, may be empty) */
+	KTF_METRIC_A_MAX
+};
+
+/* Attributes within a KTF_A_RSTATS nest. Times are in ns */
+enum ktf_repeat_attr {
+	KTF_REPEAT_A_UNSPEC,
+	KTF_REPEAT_A_RUNS,	/* Number of runs (u32) */
+	KTF_REPEAT_A_FAILED,	/* Number of runs with failures (u32) */
+	KTF_REPEAT_A_ASSERTS,	/* Assertions in all runs (u64) */
+	KTF_REPEAT_A_FAILURES,	/* Failed assertions in all runs (u64) */
+	KTF_REPEAT_A_FASTEST,	/* Duration of the fastest run (u64) */
+	KTF_REPEAT_A_MEAN,	/* Mean duration of a run (u64) */
+	KTF_REPEAT_A_SLOWEST,	/* Duration of the slowest run (u64) */
+	KTF_REPEAT_A_MAX
+};
+
 /* attribute policy */
 #ifdef NL_INTERNAL
 static struct nla_policy ktf_gnl_policy[KTF_A_MAX] = {
@@ -136,6 +340,26 @@ static struct nla_policy ktf_gnl_policy[KTF_A_MAX] = {
 	[KTF_A_MOD]   = { .type = NLA_STRING },
 	[KTF_A_COVOPT] = { .type = NLA_U32 },
 	[KTF_A_DATA] = { .type = NLA_BINARY },
+	[KTF_A_BLIST] = { .type = NLA_NESTED },
+	[KTF_A_GEN] = { .type = NLA_U64 },
+	[KTF_A_CLIST] = { .type = NLA_NESTED },
+	[KTF_A_SHM] = { .type = NLA_U32 },
+	[KTF_A_SOFF] = { .type = NLA_U64 },
+	[KTF_A_SLEN] = { .type = NLA_U64 },
+	[KTF_A_EVENT] = { .type = NLA_U32 },
+	[KTF_A_TIME] = { .type = NLA_U64 },
+	[KTF_A_TMO] = { .type = NLA_U32 },
+	[KTF_A_DURATION] = { .type = NLA_U64 },
+	[KTF_A_ILIST] = { .type = NLA_NESTED },
+	[KTF_A_BENCH] = { .type = NLA_NESTED },
+	[KTF_A_MLIST] = { .type = NLA_NESTED },
+	[KTF_A_METRIC] = { .type = NLA_NESTED },
+	[KTF_A_REPEAT] = { .type = NLA_U32 },
+	[KTF_A_RUNFOR] = { .type = NLA_U32 },
+	[KTF_A_RSTATS] = { .type = NLA_NESTED },
+	[KTF_A_FILTER] = { .type = NLA_STRING },
+	[KTF_A_TID] = { .type = NLA_U32 },
+	[KTF_A_CID] = { .type = NLA_U32 },
 };
 #endif
 
@@ -154,11 +378,45 @@ enum ktf_vshift {
 	((__v & 0xffffULL) << KTF_VSHIFT_##__field)
 
 #define	KTF_VERSION_LATEST	\
-	(KTF_VERSION_SET(MAJOR, 0ULL) | KTF_VERSION_SET(MINOR, 2ULL) | KTF_VERSION_SET(MICRO, 1ULL))
+	(KTF_VERSION_SET(MAJOR, 0ULL) | KTF_VERSION_SET(MINOR, 2ULL) | KTF_VERSION_SET(MICRO, 15ULL))
+
+/* Versions where optional protocol features were introduced -
+ * user space should only use these if the kernel version is at least as new:
+ */
+#define	KTF_VERSION_BATCH	\
+	(KTF_VERSION_SET(MAJOR, 0ULL) | KTF_VERSION_SET(MINOR, 2ULL) | KTF_VERSION_SET(MICRO, 2ULL))
+#define	KTF_VERSION_CHANGES	\
+	(KTF_VERSION_SET(MAJOR, 0ULL) | KTF_VERSION_SET(MINOR, 2ULL) | KTF_VERSION_SET(MICRO, 4ULL))
+#define	KTF_VERSION_SHM	\
+	(KTF_VERSION_SET(MAJOR, 0ULL) | KTF_VERSION_SET(MINOR, 2ULL) | KTF_VERSION_SET(MICRO, 5ULL))
+#define	KTF_VERSION_STREAM	\
+	(KTF_VERSION_SET(MAJOR, 0ULL) | KTF_VERSION_SET(MINOR, 2ULL) | KTF_VERSION_SET(MICRO, 6ULL))
+#define	KTF_VERSION_EVENTS	\
+	(KTF_VERSION_SET(MAJOR, 0ULL) | KTF_VERSION_SET(MINOR, 2ULL) | KTF_VERSION_SET(MICRO, 7ULL))
+#define	KTF_VERSION_TIMEOUT	\
+	(KTF_VERSION_SET(MAJOR, 0ULL) | KTF_VERSION_SET(MINOR, 2ULL) | KTF_VERSION_SET(MICRO, 8ULL))
+#define	KTF_VERSION_DURATION	\
+	(KTF_VERSION_SET(MAJOR, 0ULL) | KTF_VERSION_SET(MINOR, 2ULL) | KTF_VERSION_SET(MICRO, 9ULL))
+#define	KTF_VERSION_BENCH	\
+	(KTF_VERSION_SET(MAJOR, 0ULL) | KTF_VERSION_SET(MINOR, 2ULL) | KTF_VERSION_SET(MICRO, 10ULL))
+#define	KTF_VERSION_METRIC	\
+	(KTF_VERSION_SET(MAJOR, 0ULL) | KTF_VERSION_SET(MINOR, 2ULL) | KTF_VERSION_SET(MICRO, 11ULL))
+#define	KTF_VERSION_REPEAT	\
+	(KTF_VERSION_SET(MAJOR, 0ULL) | KTF_VERSION_SET(MINOR, 2ULL) | KTF_VERSION_SET(MICRO, 12ULL))
+#define	KTF_VERSION_FILTER	\
+	(KTF_VERSION_SET(MAJOR, 0ULL) | KTF_VERSION_SET(MINOR, 2ULL) | KTF_VERSION_SET(MICRO, 13ULL))
+#define	KTF_VERSION_IDS	\
+	(KTF_VERSION_SET(MAJOR, 0ULL) | KTF_VERSION_SET(MINOR, 2ULL) | KTF_VERSION_SET(MICRO, 14ULL))
+#define	KTF_VERSION_GEN	\
+	(KTF_VERSION_SET(MAJOR, 0ULL) | KTF_VERSION_SET(MINOR, 2ULL) | KTF_VERSION_SET(MICRO, 15ULL))
 
 /* Coverage options */
 #define	KTF_COV_OPT_MEM		0x1
 
+/* Device for shared memory regions (/dev/ktf) and its ioctl to get the ID of a region */
+#define	KTF_SHM_DEV_NAME	"ktf"
+#define	KTF_IOC_SHM_ID		_IOR('K', 1, unsigned int)
+
 struct nla_policy *ktf_get_gnl_policy(void);
 
 #ifdef __cplusplus
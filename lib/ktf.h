@@ -27,6 +27,47 @@ namespace ktf
   /* Function for enabling/disabling coverage for module */
   int set_coverage(std::string module, unsigned int opts, bool enabled);
 
+  /* Run up to batch_size pure kernel tests in a single request to the kernel.
+   * The default is 1 (no batching), unless set in the environment
+   * variable KTF_BATCH_SIZE:
+   */
+  void set_batch_size(size_t batch_size);
+  size_t get_batch_size();
+
+  /* Run independent test sets on up to workers threads in parallel, each with its own
+   * connection to the kernel. Tests within the same set are still run in order.
+   * The default is 1 (no parallel execution), unless set in the environment
+   * variable KTF_WORKERS:
+   */
+  void set_workers(size_t workers);
+  size_t get_workers();
+
+  /* Let the kernel abandon a test that has not completed within timeout_ms milliseconds,
+   * and report it as failed. The default is 0 (no timeout), unless set in the environment
+   * variable KTF_TIMEOUT:
+   */
+  void set_timeout(unsigned int timeout_ms);
+  unsigned int get_timeout();
+
+  /* Let the kernel run each test repeat times and/or for run_for_ms milliseconds,
+   * whichever ends first, for soak and flakiness testing without a round trip per run.
+   * A timeout applies to all the runs of a test together. The default is 0 (a single run),
+   * unless set in the environment variables KTF_REPEAT and KTF_RUN_FOR:
+   */
+  void set_repeat(unsigned int repeat);
+  unsigned int get_repeat();
+  void set_run_for(unsigned int run_for_ms);
+  unsigned int get_run_for();
+
+  /* Let the kernel select the tests by their expanded names (set.test[_ctx]),
+   * using the syntax of --gtest_filter: ':'-separated glob patterns, optionally
+   * followed by '-' and patterns to exclude. Only matching tests are returned by
+   * queries, and unless gtest is given its own filter, it is used as the gtest filter too.
+   * The default is all tests, unless set in the environment variable KTF_FILTER:
+   */
+  void set_kernel_filter(const std::string& filter);
+  const std::string& get_kernel_filter();
+
   typedef void (*configurator)(void);
 
   // Initialize KTF:
@@ -63,6 +104,15 @@ namespace ktf
   ASSERT_TRUE(__priv_data); \
   ASSERT_EQ(get_priv_sz(__kt_ptr), sizeof(struct __priv_datatype))
 
+/* Alternative to KTF_USERDATA for large out-of-band data: allocate/get a reference to
+ * a buffer of __size bytes in memory shared with the kernel, which the kernel test
+ * accesses in place, without copying, via self->data and self->data_sz:
+ */
+#define KTF_SHARED_DATA(__kt_ptr, __size, __data) \
+  void *__data = get_shared_priv(__kt_ptr, __size); \
+  ASSERT_TRUE(__data); \
+  ASSERT_EQ(get_priv_sz(__kt_ptr), (size_t)(__size))
+
 /* KTF support for configurable contexts:
  * Send a configuation data structure to the given context name.
  */
@@ -98,12 +148,20 @@ namespace ktf {
   void add_wrapper(const std::string setname, const std::string testname,
 		   test_cb* tcb);
 
-  /* get a priv pointer of the given size, allocate if necessary */
+  /* get a priv pointer of the given size, allocate if necessary.
+   * Returns NULL if the data is too large to send with a request:
+   */
   void* get_priv(KernelTest* kt, size_t priv_sz);
 
   /* Get the size of the existing priv data */
   size_t get_priv_sz(KernelTest *kt);
 
+  /* As get_priv, but allocate the priv data in memory shared with the kernel, if possible.
+   * Returns NULL if shared memory is unavailable and the data is too large to send
+   * with a request instead:
+   */
+  void* get_shared_priv(KernelTest* kt, size_t priv_sz);
+
   // Configure ktf context - to be used via KTF_CONTEXT_CFG*():
   void configure_context(const std::string context, const std::string type_name,
 			 void *data, size_t data_sz);
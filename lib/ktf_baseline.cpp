@@ -0,0 +1,135 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktf_baseline.cpp: Baselines of kernel test measurements and regression checks
+ */
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/utsname.h>
+#include "ktf_baseline.h"
+#include "ktf_file.h"
+#include "ktf_debug.h"
+
+namespace ktf
+{
+
+Baseline::Baseline(const char* p, bool u)
+  : threshold(10), sigmas(3), path(p), update(u)
+{
+  struct utsname un;
+
+  /* Measurements are only comparable on the same kernel */
+  release = uname(&un) == 0 ? un.release : "unknown";
+}
+
+std::string Baseline::key(const std::string& name, const char* metric)
+{
+  return release + " " + name + " " + metric;
+}
+
+int Baseline::read(const std::string& path, entrymap& e)
+{
+  char line[1024], rel[256], name[512], metric[64];
+  unsigned long long value, stddev;
+  unsigned int samples;
+  FILE* f = fopen(path.c_str(), "r");
+
+  if (!f)
+    return -errno;
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "%255s %511s %63s %llu %llu %u", rel, name, metric,
+	       &value, &stddev, &samples) != 6)
+      continue;
+    entry& en = e[std::string(rel) + " " + name + " " + metric];
+    en.value = value;
+    en.stddev = stddev;
+    en.samples = samples;
+  }
+  fclose(f);
+  return 0;
+}
+
+void Baseline::load()
+{
+  if (read(path, baseline) == 0)
+    log(KTF_INFO, "Using %lu baselines from %s\n", baseline.size(), path.c_str());
+}
+
+std::string Baseline::check(const std::string& name, const char* metric, uint64_t value,
+			    uint64_t stddev, uint32_t samples, uint64_t min_delta)
+{
+  entrymap::iterator it = baseline.find(key(name, metric));
+  char msg[512];
+
+  if (it == baseline.end() || value <= it->second.value)
+    return "";
+
+  const entry& b = it->second;
+  uint64_t delta = value - b.value;
+  double pct = b.value ? 100.0 * delta / b.value : 100.0;
+
+  if (delta < min_delta || pct <= threshold)
+    return "";
+
+  /* For benchmarks, also require the difference to be significant
+   * compared to the standard error of the difference of the means:
+   */
+  if (b.samples > 1 && samples > 1) {
+    double se = sqrt((double)b.stddev * b.stddev / b.samples +
+		     (double)stddev * stddev / samples);
+    if (delta <= sigmas * se)
+      return "";
+  }
+
+  snprintf(msg, sizeof(msg),
+	   "Performance regression in %s: %llu vs baseline %llu (+%llu, +%.1f%%, threshold %.1f%%)"
+	   " on kernel %s", metric, (unsigned long long)value, (unsigned long long)b.value,
+	   (unsigned long long)delta, pct, threshold, release.c_str());
+  return msg;
+}
+
+void Baseline::record(const std::string& name, const char* metric, uint64_t value,
+		      uint64_t stddev, uint32_t samples)
+{
+  entry& e = measured[key(name, metric)];
+  e.value = value;
+  e.stddev = stddev;
+  e.samples = samples;
+}
+
+int Baseline::save()
+{
+  entrymap e;
+  entrymap::iterator it;
+  std::string buf;
+  char line[96];
+  int err;
+
+  if (measured.empty())
+    return 0;
+
+  /* Keep the baselines of other tests and kernel releases */
+  read(path, e);
+  for (it = measured.begin(); it != measured.end(); ++it)
+    e[it->first] = it->second;
+
+  for (it = e.begin(); it != e.end(); ++it) {
+    snprintf(line, sizeof(line), " %llu %llu %u\n", (unsigned long long)it->second.value,
+	     (unsigned long long)it->second.stddev, it->second.samples);
+    buf.append(it->first);
+    buf.append(line);
+  }
+  err = atomic_write_file(path, buf);
+  if (err)
+    log(KTF_WARN, "Failed to save baselines to %s (status %d)\n", path.c_str(), err);
+  else
+    log(KTF_INFO, "Saved %lu baselines to %s (%lu updated)\n", e.size(), path.c_str(),
+	measured.size());
+  return err;
+}
+
+} // end namespace ktf
@@ -0,0 +1,79 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktf_baseline.h: Baselines of the kernel's measurements of tests and benchmarks,
+ *   to catch performance regressions.
+ *
+ * Enabled by setting the environment variable KTF_BASELINE to the path of the baseline file.
+ * If KTF_BASELINE_UPDATE is set, the measurements of this run are saved as the new baseline,
+ * otherwise a test fails if it is slower than its baseline by more than KTF_BASELINE_THRESHOLD
+ * percent (default 10), and, for benchmarks, by more than KTF_BASELINE_SIGMAS (default 3)
+ * standard errors of the difference.
+ */
+
+#ifndef _KTF_BASELINE_H
+#define _KTF_BASELINE_H
+#include <map>
+#include <string>
+#include <stdint.h>
+
+namespace ktf
+{
+
+/* The baseline file has a line per kernel release, test and metric, with the value,
+ * its standard deviation and the number of samples (0 and 1 if not a benchmark),
+ * separated by spaces:
+ */
+class Baseline
+{
+public:
+  Baseline(const char* path, bool update);
+
+  /* Read the baseline file, if it exists */
+  void load();
+
+  bool updating() const
+  {
+    return update;
+  }
+
+  /* Compare a measurement of a metric of a test with the baseline for this kernel release.
+   * Differences smaller than min_delta are ignored.
+   * Returns a description of the regression, or an empty string if there is none:
+   */
+  std::string check(const std::string& name, const char* metric, uint64_t value,
+		    uint64_t stddev, uint32_t samples, uint64_t min_delta);
+
+  /* Record a measurement as the new baseline */
+  void record(const std::string& name, const char* metric, uint64_t value,
+	      uint64_t stddev, uint32_t samples);
+
+  /* Merge the new baselines into the baseline file - returns 0 or -errno */
+  int save();
+
+  double threshold;  /* Percent */
+  double sigmas;
+
+private:
+  struct entry
+  {
+    uint64_t value;
+    uint64_t stddev;
+    uint32_t samples;
+  };
+  typedef std::map<std::string, entry> entrymap;
+
+  std::string key(const std::string& name, const char* metric);
+  static int read(const std::string& path, entrymap& e);
+
+  std::string path;
+  std::string release;  /* Kernel release we are running on */
+  bool update;
+  entrymap baseline;
+  entrymap measured;    /* Measured during this run, in update mode */
+};
+
+} // end namespace ktf
+
+#endif
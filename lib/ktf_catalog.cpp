@@ -0,0 +1,241 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktf_catalog.cpp: On-disk cache of the parsed catalog of tests and contexts in the kernel
+ */
+#include "kernel/ktf_unlproto.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <set>
+#include "ktf_catalog.h"
+#include "ktf_file.h"
+#include "ktf_debug.h"
+
+namespace ktf
+{
+
+#define KTF_CATALOG_MAGIC "KTFCAT3"
+#define KTF_SYSFS_MODULE "/sys/module/"
+
+struct catalog_header
+{
+  char magic[8];
+  uint64_t version;   /* KTF_VERSION_LATEST of the library that wrote the catalog */
+  uint64_t kernel_version;
+  uint32_t key_len;
+  uint32_t data_len;  /* Total length of the entries following the key */
+};
+
+#define KTF_CATALOG_ALIGN(len) (((len) + 7) & ~(size_t)7)
+
+Catalog::Catalog(const char* p)
+  : path(p),
+    map(NULL),
+    map_sz(0),
+    pos(0),
+    end(0),
+    last(0)
+{}
+
+Catalog::~Catalog()
+{
+  if (map)
+    munmap(map, map_sz);
+}
+
+/* Append the contents of the (small) file fn to s */
+static bool read_file(const std::string& fn, std::string& s)
+{
+  char buf[256];
+  ssize_t n;
+  int fd = ::open(fn.c_str(), O_RDONLY);
+
+  if (fd < 0)
+    return false;
+  while ((n = read(fd, buf, sizeof(buf))) > 0)
+    s.append(buf, n);
+  close(fd);
+  return n == 0;
+}
+
+/* The key is the catalog generation, followed by the names and
+ * build IDs of the ktf module and its holders, in name order:
+ */
+bool Catalog::compute_key(uint64_t gen)
+{
+  std::set<std::string> modules;
+  struct dirent* de;
+  DIR* d;
+
+  key.clear();
+  if (!gen) {
+    log(KTF_INFO, "No catalog generation available from the kernel - not using catalog\n");
+    return false;
+  }
+  key.append((const char*)&gen, sizeof(gen));
+  modules.insert("ktf");
+  d = opendir(KTF_SYSFS_MODULE "ktf/holders");
+  if (!d)
+    return false;
+  while ((de = readdir(d)) != NULL)
+    if (de->d_name[0] != '.')
+      modules.insert(de->d_name);
+  closedir(d);
+
+  for (std::set<std::string>::iterator it = modules.begin(); it != modules.end(); ++it) {
+    key.append(*it);
+    key.push_back('\0');
+    if (!read_file(KTF_SYSFS_MODULE + *it + "/notes/.note.gnu.build-id", key)) {
+      log(KTF_INFO, "No build ID available for module %s - not using catalog\n", it->c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+bool Catalog::open(uint64_t gen)
+{
+  struct catalog_header* h;
+  struct stat st;
+  int fd;
+
+  if (!compute_key(gen))
+    return false;
+
+  fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  if (fstat(fd, &st) || (size_t)st.st_size < sizeof(*h)) {
+    close(fd);
+    return false;
+  }
+  map_sz = st.st_size;
+  map = mmap(NULL, map_sz, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    map = NULL;
+    return false;
+  }
+
+  h = (struct catalog_header*)map;
+  pos = KTF_CATALOG_ALIGN(sizeof(*h) + h->key_len);
+  end = pos + h->data_len;
+  if (memcmp(h->magic, KTF_CATALOG_MAGIC, sizeof(h->magic)) ||
+      h->version != KTF_VERSION_LATEST ||
+      end > map_sz || h->key_len != key.size() ||
+      memcmp((char*)map + sizeof(*h), key.data(), key.size())) {
+    log(KTF_INFO, "Catalog %s is stale\n", path.c_str());
+    munmap(map, map_sz);
+    map = NULL;
+    return false;
+  }
+  log(KTF_INFO, "Using catalog %s\n", path.c_str());
+  return true;
+}
+
+uint64_t Catalog::kernel_version()
+{
+  return map ? ((struct catalog_header*)map)->kernel_version : 0;
+}
+
+const catalog_entry* Catalog::next()
+{
+  const catalog_entry* e;
+
+  if (!map || pos + sizeof(*e) > end)
+    return NULL;
+
+  e = (const catalog_entry*)((char*)map + pos);
+  if (e->len < sizeof(*e) || e->len > end - pos || (e->len & 7) ||
+      (e->nstr && ((const char*)e)[e->len - 1] != '\0'))
+    return NULL;
+  pos += e->len;
+  return e;
+}
+
+void Catalog::start_entry(catalog_entry_type type, uint32_t hid, uint32_t id, int32_t stat)
+{
+  catalog_entry e;
+
+  memset(&e, 0, sizeof(e));
+  e.type = type;
+  e.hid = hid;
+  e.id = id;
+  e.stat = stat;
+  last = entries.size();
+  entries.append((const char*)&e, sizeof(e));
+}
+
+void Catalog::add_string(const char* str)
+{
+  entries.append(str ? str : "");
+  entries.push_back('\0');
+  ((catalog_entry*)&entries[last])->nstr++;
+}
+
+void Catalog::end_entry()
+{
+  entries.resize(KTF_CATALOG_ALIGN(entries.size()));
+  ((catalog_entry*)&entries[last])->len = entries.size() - last;
+}
+
+void Catalog::add(catalog_entry_type type, uint32_t hid, uint32_t id, int32_t stat,
+		  std::initializer_list<const char*> strs)
+{
+  start_entry(type, hid, id, stat);
+  for (std::initializer_list<const char*>::iterator it = strs.begin(); it != strs.end(); ++it)
+    add_string(*it);
+  end_entry();
+}
+
+void Catalog::add(catalog_entry_type type, uint32_t hid, const std::vector<std::string>& strs)
+{
+  start_entry(type, hid, 0, 0);
+  for (size_t i = 0; i < strs.size(); i++)
+    add_string(strs[i].c_str());
+  end_entry();
+}
+
+void Catalog::set_last_id(uint32_t id)
+{
+  if (last < entries.size())
+    ((catalog_entry*)&entries[last])->id = id;
+}
+
+int Catalog::save(uint64_t gen, uint64_t kver)
+{
+  struct catalog_header h;
+  std::string buf;
+  int err;
+
+  if (!compute_key(gen))
+    return -ENOENT;
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, KTF_CATALOG_MAGIC, sizeof(h.magic));
+  h.version = KTF_VERSION_LATEST;
+  h.kernel_version = kver;
+  h.key_len = key.size();
+  h.data_len = entries.size();
+
+  buf.append((char*)&h, sizeof(h));
+  buf.append(key);
+  buf.resize(KTF_CATALOG_ALIGN(buf.size()));
+  buf.append(entries);
+
+  err = atomic_write_file(path, buf);
+  if (err)
+    log(KTF_WARN, "Failed to save catalog %s (status %d)\n", path.c_str(), err);
+  else
+    log(KTF_INFO, "Saved catalog %s\n", path.c_str());
+  return err;
+}
+
+} // end namespace ktf
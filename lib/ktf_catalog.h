@@ -0,0 +1,108 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktf_catalog.h: On-disk cache of the parsed catalog of tests and contexts in the kernel,
+ *   to avoid a full query of the kernel at startup when nothing has changed.
+ *
+ * Enabled by setting the environment variable KTF_CATALOG to the path of the cache file.
+ */
+
+#ifndef _KTF_CATALOG_H
+#define _KTF_CATALOG_H
+#include <string>
+#include <initializer_list>
+#include <vector>
+#include <stdint.h>
+
+namespace ktf
+{
+
+/* The kinds of entries in a catalog. Each entry is the information from the
+ * QUERY response for one of the calls that build up the tests and contexts,
+ * so that the calls can be made in the same order when the catalog is used:
+ */
+enum catalog_entry_type
+{
+  KTF_CAT_CTYPE,    /* A context type of handle hid: type name */
+  KTF_CAT_CFG_CTX,  /* A configurable context of handle hid with status stat: name, type name */
+  KTF_CAT_CTX_ID,   /* The ID of a context of handle hid: name */
+  KTF_CAT_CSET,     /* The contexts of handle hid: the names */
+  KTF_CAT_CONFIGURE, /* Point at which the contexts are configured */
+  KTF_CAT_SET,      /* A test set: name */
+  KTF_CAT_TEST,     /* A test with ID id of handle hid in the last test set: name */
+};
+
+/* An entry, followed by nstr '\0' terminated strings */
+struct catalog_entry
+{
+  uint16_t type;
+  uint16_t nstr;
+  uint32_t len;     /* Of the entry with the strings, padded to a multiple of 8 */
+  uint32_t hid;
+  uint32_t id;
+  int32_t stat;
+  uint32_t reserved;
+
+  const char* str() const { return (const char*)(this + 1); }
+};
+
+/* The catalog is keyed by the build IDs of the ktf module and all modules
+ * that depend on it, the kernel's catalog generation and the KTF version of
+ * the library. The generation changes with every test or context added or
+ * removed, and each time ktf is loaded, so a catalog is only used as long as
+ * nothing has changed in the kernel since it was saved. IDs of tests and contexts
+ * thus remain valid too. The file is a header, followed by the key and the entries:
+ */
+class Catalog
+{
+public:
+  Catalog(const char* path);
+  ~Catalog();
+
+  /* Map the catalog file for the kernel's current catalog generation gen
+   * - returns false if it does not exist or is stale:
+   */
+  bool open(uint64_t gen);
+
+  /* The version of the kernel that the open catalog was saved from */
+  uint64_t kernel_version();
+
+  /* Iterate over the entries of an open catalog: returns NULL when done */
+  const catalog_entry* next();
+
+  /* Add an entry to the catalog to be saved */
+  void add(catalog_entry_type type, uint32_t hid, uint32_t id, int32_t stat,
+	   std::initializer_list<const char*> strs);
+  void add(catalog_entry_type type, uint32_t hid, const std::vector<std::string>& strs);
+
+  /* Set the ID of the last entry added, when it comes after the name */
+  void set_last_id(uint32_t id);
+
+  /* Discard the added entries */
+  void clear() { entries.clear(); }
+
+  /* Save the catalog with the added entries, which were received at catalog
+   * generation gen from a kernel of version kver - returns 0 or -errno:
+   */
+  int save(uint64_t gen, uint64_t kver);
+
+private:
+  bool compute_key(uint64_t gen);
+  void start_entry(catalog_entry_type type, uint32_t hid, uint32_t id, int32_t stat);
+  void add_string(const char* str);
+  void end_entry();
+
+  std::string path;
+  std::string key;
+  std::string entries;  /* Entries added for saving */
+  void* map;            /* Mapping of the catalog file if open */
+  size_t map_sz;
+  size_t pos;           /* Offset of the next entry in map */
+  size_t end;
+  size_t last;          /* Offset of the last entry added */
+};
+
+} // end namespace ktf
+
+#endif
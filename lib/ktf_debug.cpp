@@ -13,6 +13,9 @@ unsigned long ktf_debug_mask = 0;
 void ktf_debug_init()
 {
   ktf_debug_mask = 0;
+  char* trace_path = getenv("KTF_TRACE");
+  if (trace_path)
+    ktf_trace_init(trace_path);
   char* dbg_mask_str = getenv("KTF_DEBUG_MASK");
   if (dbg_mask_str) {
     ktf_debug_mask = strtol(dbg_mask_str, NULL, 0);
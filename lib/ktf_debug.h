@@ -7,6 +7,8 @@
  * - intended for test debugging.
  *
  * Enabled by setting bits in the environment variable KTF_DEBUG_MASK
+ * If KTF_TRACE is also set, enabled messages are recorded in binary form
+ * instead, see ktf_trace.h
  */
 
 #ifndef _KTF_DEBUG_H
@@ -17,6 +19,7 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <sys/syscall.h>
+#include "ktf_trace.h"
 
 extern unsigned long ktf_debug_mask;
 
@@ -33,13 +36,17 @@ extern unsigned long ktf_debug_mask;
 #define KTF_DUMP      0x2000000
 
 /* Call this to initialize the debug logic from
- * environment KTF_DEBUG_MASK
+ * environment KTF_DEBUG_MASK and KTF_TRACE
  */
 void ktf_debug_init();
 
 #define log(level, format, arg...)		\
 do {\
-  if (level & ktf_debug_mask) {\
+  if (!(level & ktf_debug_mask))\
+    break;\
+  if (ktf_trace_enabled)\
+    ktf_trace(__func__, format, ## arg);\
+  else {\
     char _tm[30]; \
     time_t _tv = time(NULL);\
     ctime_r(&_tv,_tm);\
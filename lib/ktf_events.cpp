@@ -0,0 +1,148 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktf_events.cpp: Subscription to the events the kernel publishes
+ *   about all test execution on the host.
+ */
+#include <netlink/netlink.h>
+#include <netlink/genl/genl.h>
+#include <netlink/genl/ctrl.h>
+#include "kernel/ktf_unlproto.h"
+#include <errno.h>
+#include "ktf_int.h"
+#include "ktf_debug.h"
+
+#ifndef HAVE_LIBNL3
+#define nl_socket_alloc nl_handle_alloc
+#define nl_socket_free nl_handle_destroy
+#define nl_sock nl_handle
+#define nl_socket_disable_seq_check nl_disable_sequence_check
+#endif
+
+namespace ktf
+{
+
+struct event_subscription
+{
+  struct nl_sock* sock;
+  event_handler handler;
+  void* arg;
+};
+
+static event_subscription events = { NULL, NULL, NULL };
+
+static int event_cb(struct nl_msg *msg, void *arg)
+{
+  struct nlmsghdr *nlh = nlmsg_hdr(msg);
+  struct genlmsghdr *ghdr = (genlmsghdr*)nlmsg_data(nlh);
+  struct nlattr *attrs[KTF_A_MAX+1];
+  test_event ev;
+
+  int err = genlmsg_parse(nlh, 0, attrs, KTF_A_MAX, ktf_get_gnl_policy());
+  if (err < 0)
+    return err;
+  if (ghdr->cmd != KTF_C_EVENT || !attrs[KTF_A_EVENT])
+    return NL_SKIP;
+
+  ev.type = nla_get_u32(attrs[KTF_A_EVENT]);
+  ev.time = attrs[KTF_A_TIME] ? nla_get_u64(attrs[KTF_A_TIME]) : 0;
+  if (attrs[KTF_A_SNAM])
+    ev.setname = nla_get_string(attrs[KTF_A_SNAM]);
+  if (attrs[KTF_A_TNAM])
+    ev.testname = nla_get_string(attrs[KTF_A_TNAM]);
+
+  switch (ev.type) {
+  case KTF_EVENT_ASSERT:
+    if (attrs[KTF_A_FILE])
+      ev.file = nla_get_string(attrs[KTF_A_FILE]);
+    if (attrs[KTF_A_NUM])
+      ev.line = nla_get_u32(attrs[KTF_A_NUM]);
+    if (attrs[KTF_A_STR])
+      ev.report = nla_get_string(attrs[KTF_A_STR]);
+    break;
+  case KTF_EVENT_TEST_END:
+    if (attrs[KTF_A_NUM])
+      ev.asserts = nla_get_u32(attrs[KTF_A_NUM]);
+    if (attrs[KTF_A_STAT])
+      ev.failures = nla_get_u32(attrs[KTF_A_STAT]);
+    /* fall through */
+  case KTF_EVENT_TEST_START:
+    if (attrs[KTF_A_STR])
+      ev.ctx = nla_get_string(attrs[KTF_A_STR]);
+    break;
+  }
+
+  log(KTF_EVENT, "event %d for %s.%s\n", ev.type, ev.setname.c_str(), ev.testname.c_str());
+  events.handler(ev, events.arg);
+  return NL_OK;
+}
+
+int event_subscribe(event_handler handler, void* arg)
+{
+#ifdef HAVE_LIBNL3
+  int grp, err;
+
+  if (events.sock)
+    return -EBUSY;
+
+  events.sock = nl_socket_alloc();
+  if (!events.sock)
+    return -ENOMEM;
+
+  err = genl_connect(events.sock);
+  if (err)
+    goto fail;
+
+  grp = genl_ctrl_resolve_grp(events.sock, "ktf", KTF_MCGRP_EVENTS);
+  if (grp < 0) {
+    err = grp;
+    goto fail;
+  }
+
+  /* Events are not responses to anything we sent */
+  nl_socket_disable_seq_check(events.sock);
+  nl_socket_modify_cb(events.sock, NL_CB_VALID, NL_CB_CUSTOM, event_cb, NULL);
+  err = nl_socket_add_membership(events.sock, grp);
+  if (err)
+    goto fail;
+
+  events.handler = handler;
+  events.arg = arg;
+  return nl_socket_get_fd(events.sock);
+fail:
+  log(KTF_WARN, "Failed to subscribe to ktf events (status %d)\n", err);
+  nl_socket_free(events.sock);
+  events.sock = NULL;
+  return err;
+#else
+  /* Multicast group lookup requires libnl-3 */
+  return -EOPNOTSUPP;
+#endif
+}
+
+int event_poll()
+{
+  int err;
+
+  if (!events.sock)
+    return -ENOTCONN;
+
+  err = nl_recvmsgs_default(events.sock);
+  if (nl_rcvbuf_overrun(err)) {
+    /* Events are dropped rather than holding back the tests */
+    log(KTF_WARN, "Receive buffer overrun - some ktf events were lost\n");
+    err = 0;
+  }
+  return err < 0 ? err : 0;
+}
+
+void event_unsubscribe()
+{
+  if (events.sock) {
+    nl_socket_free(events.sock);
+    events.sock = NULL;
+  }
+}
+
+} // end namespace ktf
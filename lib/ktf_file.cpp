@@ -0,0 +1,38 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktf_file.cpp: Helpers for the files libktf keeps between runs
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "ktf_file.h"
+
+namespace ktf
+{
+
+int atomic_write_file(const std::string& path, const std::string& data)
+{
+  char tmp_suffix[32];
+  std::string tmp;
+  int fd, err = 0;
+
+  snprintf(tmp_suffix, sizeof(tmp_suffix), ".%d", getpid());
+  tmp = path + tmp_suffix;
+  fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return -errno;
+  if (write(fd, data.data(), data.size()) != (ssize_t)data.size())
+    err = errno ? -errno : -EIO;
+  if (close(fd) && !err)
+    err = -errno;
+  if (!err && rename(tmp.c_str(), path.c_str()))
+    err = -errno;
+  if (err)
+    unlink(tmp.c_str());
+  return err;
+}
+
+} // end namespace ktf
@@ -0,0 +1,23 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktf_file.h: Helpers for the files libktf keeps between runs
+ */
+
+#ifndef _KTF_FILE_H
+#define _KTF_FILE_H
+#include <string>
+
+namespace ktf
+{
+
+/* Replace the contents of the file path with data. The data is written to a
+ * temporary file which is then renamed, to not disturb concurrent readers,
+ * which see either the old or the new contents. Returns 0 or -errno:
+ */
+int atomic_write_file(const std::string& path, const std::string& data);
+
+} // end namespace ktf
+
+#endif
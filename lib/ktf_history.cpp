@@ -0,0 +1,237 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktf_history.cpp: History of kernel test durations and duration based sharding
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include "ktf_history.h"
+#include "ktf_file.h"
+#include "ktf_debug.h"
+
+namespace ktf
+{
+
+/* Duration assumed for tests without history, if there is no history at all */
+#define KTF_DEFAULT_DURATION 1000000000ULL
+
+History::History(const char* p)
+  : path(p)
+{
+  pthread_mutex_init(&lock, NULL);
+}
+
+History::~History()
+{
+  pthread_mutex_destroy(&lock);
+}
+
+int History::read(const std::string& path, std::map<std::string, uint64_t>& d)
+{
+  char line[1024];
+  FILE* f = fopen(path.c_str(), "r");
+
+  if (!f)
+    return -errno;
+  while (fgets(line, sizeof(line), f)) {
+    char* name;
+    uint64_t ns = strtoull(line, &name, 10);
+
+    if (*name != ' ')
+      continue;
+    name++;
+    name[strcspn(name, "\n")] = '\0';
+    if (*name)
+      d[name] = ns;
+  }
+  fclose(f);
+  return 0;
+}
+
+void History::load()
+{
+  if (read(path, durations) == 0)
+    log(KTF_INFO, "Using %lu test durations from %s\n", durations.size(), path.c_str());
+}
+
+void History::record(const std::string& name, uint64_t ns)
+{
+  pthread_mutex_lock(&lock);
+  measured[name] = ns;
+  pthread_mutex_unlock(&lock);
+}
+
+/* The files saved by shards that are not yet merged into the history file */
+std::vector<std::string> History::shard_files()
+{
+  std::string::size_type slash = path.rfind('/');
+  std::string dir = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+  std::string prefix = path.substr(dir.size()) + ".shard";
+  std::vector<std::string> files;
+  struct dirent* de;
+  DIR* d = opendir(dir.empty() ? "." : dir.c_str());
+
+  if (!d)
+    return files;
+  while ((de = readdir(d))) {
+    const char* index = de->d_name + prefix.size();
+
+    /* Skip anything else, such as the temporary file of a shard saving */
+    if (strncmp(de->d_name, prefix.c_str(), prefix.size()) || !*index ||
+	index[strspn(index, "0123456789")])
+      continue;
+    files.push_back(dir + de->d_name);
+  }
+  closedir(d);
+  return files;
+}
+
+/* Smooth out the noise in the measurements by averaging with the history */
+static void merge(std::map<std::string, uint64_t>& d, const std::map<std::string, uint64_t>& m)
+{
+  std::map<std::string, uint64_t>::const_iterator it;
+
+  for (it = m.begin(); it != m.end(); ++it) {
+    std::map<std::string, uint64_t>::iterator dit = d.find(it->first);
+    if (dit == d.end())
+      d[it->first] = it->second;
+    else
+      dit->second = (dit->second + it->second) / 2;
+  }
+}
+
+int History::save()
+{
+  std::map<std::string, uint64_t> d;
+  std::map<std::string, uint64_t>::iterator it;
+  std::vector<std::string> shards;
+  std::string out, buf;
+  char line[64];
+  size_t i;
+  int err;
+
+  pthread_mutex_lock(&lock);
+  /* Shards leave the history file alone, as the other shards may not have read it yet */
+  out = shard_path.empty() ? path : shard_path;
+  if (shard_path.empty())
+    shards = shard_files();
+  if (measured.empty() && shards.empty()) {
+    pthread_mutex_unlock(&lock);
+    return 0;
+  }
+
+  /* Other runs may have updated the file since we read it, so merge with the current
+   * file, then with the measurements of shards since, in turn, and finally our own:
+   */
+  read(out, d);
+  for (i = 0; i < shards.size(); i++) {
+    std::map<std::string, uint64_t> sd;
+    if (read(shards[i], sd) == 0)
+      merge(d, sd);
+  }
+  merge(d, measured);
+  pthread_mutex_unlock(&lock);
+
+  for (it = d.begin(); it != d.end(); ++it) {
+    snprintf(line, sizeof(line), "%llu ", (unsigned long long)it->second);
+    buf.append(line);
+    buf.append(it->first);
+    buf.push_back('\n');
+  }
+  err = atomic_write_file(out, buf);
+  if (err) {
+    log(KTF_WARN, "Failed to save test durations to %s (status %d)\n", out.c_str(), err);
+    return err;
+  }
+  log(KTF_INFO, "Saved %lu test durations to %s\n", d.size(), out.c_str());
+  for (i = 0; i < shards.size(); i++)
+    unlink(shards[i].c_str());
+  return 0;
+}
+
+static bool by_cost(const std::pair<uint64_t, std::string>& a,
+		    const std::pair<uint64_t, std::string>& b)
+{
+  return a.first > b.first || (a.first == b.first && a.second < b.second);
+}
+
+/* Greedy bin packing: Assign the longest running remaining test to the shard
+ * with the least total duration so far. Every shard computes the same assignment
+ * as long as they use the same history and see the same tests, so from here on
+ * the history file is left alone (see save):
+ */
+std::set<std::string> History::shard(const std::vector<std::string>& names,
+				     size_t shards, size_t index)
+{
+  std::vector<std::pair<uint64_t, std::string> > cost;
+  std::vector<uint64_t> load(shards, 0);
+  std::set<std::string> mine;
+  uint64_t known = 0, sum = 0, unknown;
+  char suffix[32];
+  size_t i;
+
+  snprintf(suffix, sizeof(suffix), ".shard%lu", index);
+  pthread_mutex_lock(&lock);
+  shard_path = path + suffix;
+  pthread_mutex_unlock(&lock);
+
+  for (i = 0; i < names.size(); i++) {
+    std::map<std::string, uint64_t>::iterator it = durations.find(names[i]);
+    if (it != durations.end()) {
+      sum += it->second;
+      known++;
+    }
+  }
+  /* Tests without history are assumed to be average */
+  unknown = known ? sum / known : KTF_DEFAULT_DURATION;
+
+  for (i = 0; i < names.size(); i++) {
+    std::map<std::string, uint64_t>::iterator it = durations.find(names[i]);
+    cost.push_back(std::make_pair(it != durations.end() ? it->second : unknown, names[i]));
+  }
+  std::sort(cost.begin(), cost.end(), by_cost);
+
+  for (i = 0; i < cost.size(); i++) {
+    size_t s = std::min_element(load.begin(), load.end()) - load.begin();
+    load[s] += cost[i].first;
+    if (s == index)
+      mine.insert(cost[i].second);
+  }
+  log(KTF_INFO, "Shard %lu of %lu: %lu of %lu tests, estimated %llu ms\n",
+      index, shards, mine.size(), names.size(),
+      (unsigned long long)(load[index] / 1000000));
+  return mine;
+}
+
+/* FNV-1a, which unlike std::hash is the same for all builds */
+static uint64_t name_hash(const std::string& name)
+{
+  uint64_t h = 14695981039346656037ULL;
+
+  for (size_t i = 0; i < name.size(); i++) {
+    h ^= (unsigned char)name[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+std::set<std::string> shard_by_name(const std::vector<std::string>& names,
+				    size_t shards, size_t index)
+{
+  std::set<std::string> mine;
+
+  for (size_t i = 0; i < names.size(); i++)
+    if (name_hash(names[i]) % shards == index)
+      mine.insert(names[i]);
+  log(KTF_INFO, "Shard %lu of %lu: %lu of %lu tests, by name\n",
+      index, shards, mine.size(), names.size());
+  return mine;
+}
+
+} // end namespace ktf
@@ -0,0 +1,71 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktf_history.h: History of kernel test durations, used to balance shards of
+ *   the kernel tests by running time instead of by number of tests.
+ *
+ * Enabled by setting the environment variable KTF_DURATIONS to the path of the history file.
+ * The tests are then divided into KTF_TOTAL_SHARDS shards, if set, and only the tests
+ * of shard KTF_SHARD_INDEX are run. Shards only read the history file, so that they all
+ * divide the tests the same way, and each save their measurements to a file of their own,
+ * which the next run that is not sharded merges into the history file.
+ * Without a history file, the tests are divided by a hash of their names.
+ */
+
+#ifndef _KTF_HISTORY_H
+#define _KTF_HISTORY_H
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <stdint.h>
+
+namespace ktf
+{
+
+/* The history file has a line per test, with the duration in ns and the test name
+ * as seen by gtest (with any context), separated by a space:
+ */
+class History
+{
+public:
+  History(const char* path);
+  ~History();
+
+  /* Read the history file, if it exists */
+  void load();
+
+  /* Record a new measurement of the duration of a test */
+  void record(const std::string& name, uint64_t ns);
+
+  /* Merge the new measurements, and those saved by shards since, into the history file.
+   * Once sharded, save the new measurements to the file of the shard instead, which is the
+   * history file with the suffix .shard<index>. Returns 0 or -errno:
+   */
+  int save();
+
+  /* Assign the tests in names to shards, and return the names of the tests in shard index */
+  std::set<std::string> shard(const std::vector<std::string>& names, size_t shards, size_t index);
+
+private:
+  static int read(const std::string& path, std::map<std::string, uint64_t>& d);
+  std::vector<std::string> shard_files();
+
+  std::string path;
+  std::string shard_path;                     /* The file of this shard, if sharded */
+  std::map<std::string, uint64_t> durations;  /* Known durations, in ns */
+  std::map<std::string, uint64_t> measured;   /* Measured during this run */
+  pthread_mutex_t lock;                       /* Tests may be run by parallel workers */
+};
+
+/* Assign the tests in names to shards by a hash of their names, for when there is
+ * no history, and return the names of the tests in shard index:
+ */
+std::set<std::string> shard_by_name(const std::vector<std::string>& names,
+				    size_t shards, size_t index);
+
+} // end namespace ktf
+
+#endif
@@ -14,10 +14,20 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <algorithm>
 #include <map>
 #include <set>
 #include <string>
+#include <unordered_map>
 #include "ktf_int.h"
+#include "ktf_catalog.h"
+#include "ktf_history.h"
+#include "ktf_baseline.h"
 #include "ktf_debug.h"
 
 #ifdef HAVE_LIBNL3
@@ -26,8 +36,25 @@
 #define nl_socket_alloc nl_handle_alloc
 #define nl_socket_free nl_handle_destroy
 #define nl_sock nl_handle
+#define nl_socket_get_cb nl_handle_get_cb
+#define nl_socket_disable_auto_ack nl_disable_auto_ack
+#define nl_socket_enable_auto_ack nl_enable_auto_ack
+#define nl_socket_set_buffer_size nl_set_buffer_size
 #endif
 
+/* libnl3 reports a receive buffer overrun (ENOBUFS) with the same error as out of memory */
+#ifdef HAVE_LIBNL3
+#define KTF_NLE_NOBUFS NLE_NOMEM
+#else
+#define KTF_NLE_NOBUFS ENOBUFS
+#endif
+
+/* Give up receiving a response after this many receive buffer overruns */
+#define KTF_MAX_OVERRUNS 16
+
+/* Socket receive buffer size, to not lose streamed test results */
+#define KTF_RCVBUF_SIZE (1 << 20)
+
 int devcnt = 0;
 
 namespace ktf
@@ -36,11 +63,70 @@ namespace ktf
 struct nl_sock* sock = NULL;
 int family = -1;
 
+/* Version 0.1.0.0 did not report version back from the kernel */
+uint64_t kernel_version = (KTF_VERSION_SET(MAJOR, 0ULL) | KTF_VERSION_SET(MINOR, 1ULL));
+
+/* Generation of the kernel's catalog of tests and contexts we are in sync with (0 if unknown) */
+uint64_t catalog_gen = 0;
+
+size_t batch_size = 1;
+Catalog* catalog = NULL;
+size_t workers = 1;
+unsigned int timeout_ms = 0;
+unsigned int repeat = 0;
+unsigned int run_for_ms = 0;
+
+/* Filter on the kernel's catalog of tests, in --gtest_filter syntax */
+std::string kernel_filter;
+
+/* Duration based sharding of the kernel tests */
+History* history = NULL;
+size_t total_shards = 0;
+size_t shard_index = 0;
+
+/* Performance regression checks against stored baselines */
+Baseline* baseline = NULL;
+
+/* Ignore changes in the duration of tests below this, as they are dominated by noise */
+#define KTF_BASELINE_MIN_DELTA_NS 100000ULL
+
 int printed_header = 0;
 
 typedef std::map<std::string, KernelTest*> testmap;
 typedef std::map<std::string, test_cb*> wrappermap;
 
+/* A kernel test with the (interned) name of the context to run it in */
+struct test_ref
+{
+  KernelTest* kt;
+  const std::string* ctx;
+};
+
+/* Hash and compare C strings by contents, so that names can be looked up
+ * as passed by gtest, without creating temporary strings:
+ */
+struct cstr_hash
+{
+  size_t operator()(const char* s) const
+  {
+    size_t h = 5381;
+    while (*s)
+      h = h * 33 + (unsigned char)*s++;
+    return h;
+  }
+};
+
+struct cstr_eq
+{
+  bool operator()(const char* a, const char* b) const
+  {
+    return strcmp(a, b) == 0;
+  }
+};
+
+/* Index from (interned) test names as seen by gtest, expanded with context names, to tests */
+typedef std::unordered_map<const char*, test_ref, cstr_hash, cstr_eq> testindex;
+
 class testset
 {
 public:
@@ -55,6 +141,7 @@ public:
 
   testmap tests;
   stringvec test_names;
+  testindex index;
   wrappermap wrapper;
   int setnum;
 };
@@ -89,6 +176,7 @@ public:
 };
 
 typedef std::map<std::string, testset> setmap;
+typedef std::unordered_map<const char*, testset*, cstr_hash, cstr_eq> setindex;
 typedef std::set<std::string> stringset;
 typedef std::vector<ConfigurableContext*> context_vector;
 
@@ -122,15 +210,16 @@ public:
 class KernelTestMgr
 {
 public:
-  KernelTestMgr() : next_set(0), cur(NULL)
+  KernelTestMgr() : next_set(0), cur(NULL), sharded(false)
   { }
 
   ~KernelTestMgr();
 
   testset& find_add_set(std::string& setname);
   testset& find_add_test(std::string& setname, std::string& testname);
-  void add_test(const std::string& setname, const char* tname, unsigned int handle_id);
-  KernelTest* find_test(const std::string&setname, const std::string& testname, std::string* ctx);
+  KernelTest* add_test(const std::string& setname, const char* tname, unsigned int handle_id);
+  void remove_test(const std::string& setname, const std::string& tname);
+  KernelTest* find_test(const char* setname, const char* testname, const std::string** ctx);
   void add_wrapper(const std::string setname, const std::string testname, test_cb* tcb);
 
   stringvec& get_set_names() { return set_names; }
@@ -166,18 +255,52 @@ public:
 
   /* Update the list of contexts returned from the kernel with a newly created one */
   void add_context(unsigned int hid, const std::string& ctx);
+
+  /* The kernel's ID for context ctx of handle hid, or 0 if unknown */
+  void set_context_id(unsigned int hid, const std::string& ctx, unsigned int id);
+  unsigned int get_context_id(unsigned int hid, const std::string& ctx);
+
+  /* Apply a context added to or removed from the kernel after the tests have been listed */
+  void add_context_tests(unsigned int hid, const std::string& ctx);
+  void remove_context_tests(unsigned int hid, const std::string& ctx);
+
+  /* Make kt available to find_test() under the name expanded with ctx, or remove it */
+  void index_test(testset& ts, KernelTest* kt, const std::string& ctx);
+  void unindex_test(testset& ts, KernelTest* kt, const std::string& ctx);
+
+  /* The expanded names (set.test[_ctx]) of the tests with a user side (hybrid tests) */
+  stringvec get_hybrid_names();
+
+  /* Discard the results kept with each test */
+  void clear_results();
+
+  /* The kernel has contexts that can be configured or created from user space */
+  bool has_configurable()
+  {
+    return !cfg_contexts.empty() || !ctx_types.empty();
+  }
 private:
+  const std::string& intern(const std::string& s);
+
+  /* The test set setname, added if not there */
+  testset& get_set(const std::string& setname);
+
   setmap sets;
+  setindex set_index;  /* Index from interned set names to sets, for lookups by name */
   stringvec test_names;
   stringvec set_names;
   stringset kernelsets;
+  stringset names;  /* Interned names referenced from the indices */
   std::map<unsigned int, stringvec> handle_to_ctxvec;
+  std::map<std::pair<unsigned int, std::string>, unsigned int> ctx_ids;
   std::map<std::string, context_vector> cfg_contexts;
 
   // Context types that allows dynamically created contexts:
   std::map<std::string, std::vector<ContextType*> > ctx_types;
   int next_set;
   name_iter* cur;
+  bool sharded;
+  stringset shard_tests;  /* The tests assigned to this shard, if sharded */
 };
 
 KernelTestMgr::~KernelTestMgr()
@@ -222,6 +345,97 @@ context_vector KernelTestMgr::maybe_create_context(const std::string& ctx, const
 void KernelTestMgr::add_context(unsigned int hid, const std::string& ctx)
 {
   handle_to_ctxvec[hid].push_back(ctx);
+
+  for (setmap::iterator sit = sets.begin(); sit != sets.end(); ++sit)
+    for (testmap::iterator it = sit->second.tests.begin(); it != sit->second.tests.end(); ++it)
+      if (it->second && it->second->handle_id == hid)
+	index_test(sit->second, it->second, ctx);
+}
+
+const std::string& KernelTestMgr::intern(const std::string& s)
+{
+  return *names.insert(s).first;
+}
+
+/* gtest sees a test expanded with a context as test_context, which is the same name as
+ * that of a test named test_context without a context, so such names are ambiguous.
+ * Then the first test indexed is kept, and the ambiguity reported:
+ */
+void KernelTestMgr::index_test(testset& ts, KernelTest* kt, const std::string& ctx)
+{
+  const std::string& name = intern(ctx.empty() ? kt->testname : kt->testname + "_" + ctx);
+  test_ref ref = { kt, &intern(ctx) };
+
+  std::pair<testindex::iterator, bool> res = ts.index.insert(std::make_pair(name.c_str(), ref));
+  test_ref& cur = res.first->second;
+  if (!res.second && (cur.kt != kt || cur.ctx != ref.ctx))
+    fprintf(stderr, "Warning: Test name %s.%s is ambiguous - using test %s%s%s,"
+	    " not test %s%s%s\n", kt->setname.c_str(), name.c_str(),
+	    cur.kt->testname.c_str(), cur.ctx->empty() ? "" : " in context ", cur.ctx->c_str(),
+	    kt->testname.c_str(), ctx.empty() ? "" : " in context ", ctx.c_str());
+}
+
+void KernelTestMgr::unindex_test(testset& ts, KernelTest* kt, const std::string& ctx)
+{
+  std::string name = ctx.empty() ? kt->testname : kt->testname + "_" + ctx;
+  testindex::iterator it = ts.index.find(name.c_str());
+
+  /* Leave the entry of another test with the same name alone */
+  if (it != ts.index.end() && it->second.kt == kt && *it->second.ctx == ctx)
+    ts.index.erase(it);
+}
+
+static void erase_name(stringvec& v, const std::string& name)
+{
+  stringvec::iterator it = std::find(v.begin(), v.end(), name);
+  if (it != v.end())
+    v.erase(it);
+}
+
+void KernelTestMgr::add_context_tests(unsigned int hid, const std::string& ctx)
+{
+  stringvec& ctxv = handle_to_ctxvec[hid];
+  if (std::find(ctxv.begin(), ctxv.end(), ctx) != ctxv.end())
+    return;
+  log(KTF_INFO, "hid %d: added context %s\n", hid, ctx.c_str());
+  ctxv.push_back(ctx);
+
+  for (setmap::iterator sit = sets.begin(); sit != sets.end(); ++sit)
+    for (testmap::iterator it = sit->second.tests.begin(); it != sit->second.tests.end(); ++it)
+      if (it->second && it->second->handle_id == hid) {
+	sit->second.test_names.push_back(it->first + "_" + ctx);
+	index_test(sit->second, it->second, ctx);
+      }
+}
+
+void KernelTestMgr::remove_context_tests(unsigned int hid, const std::string& ctx)
+{
+  log(KTF_INFO, "hid %d: removed context %s\n", hid, ctx.c_str());
+  erase_name(handle_to_ctxvec[hid], ctx);
+  ctx_ids.erase(std::make_pair(hid, ctx));
+
+  for (setmap::iterator sit = sets.begin(); sit != sets.end(); ++sit)
+    for (testmap::iterator it = sit->second.tests.begin(); it != sit->second.tests.end(); ++it)
+      if (it->second && it->second->handle_id == hid) {
+	erase_name(sit->second.test_names, it->first + "_" + ctx);
+	unindex_test(sit->second, it->second, ctx);
+      }
+}
+
+void KernelTestMgr::set_context_id(unsigned int hid, const std::string& ctx, unsigned int id)
+{
+  if (id)
+    ctx_ids[std::make_pair(hid, ctx)] = id;
+  else
+    ctx_ids.erase(std::make_pair(hid, ctx));
+}
+
+unsigned int KernelTestMgr::get_context_id(unsigned int hid, const std::string& ctx)
+{
+  std::map<std::pair<unsigned int, std::string>, unsigned int>::iterator it;
+
+  it = ctx_ids.find(std::make_pair(hid, ctx));
+  return it != ctx_ids.end() ? it->second : 0;
 }
 
 
@@ -238,6 +452,17 @@ testset& KernelTestMgr::find_add_test(std::string& setname, std::string& testnam
   return ts;
 }
 
+testset& KernelTestMgr::get_set(const std::string& setname)
+{
+  setmap::iterator it = sets.find(setname);
+
+  if (it == sets.end()) {
+    it = sets.insert(std::make_pair(setname, testset())).first;
+    set_index[intern(setname).c_str()] = &it->second;
+  }
+  return it->second;
+}
+
 testset& KernelTestMgr::find_add_set(std::string& setname)
 {
   bool new_set = false;
@@ -251,8 +476,7 @@ testset& KernelTestMgr::find_add_set(std::string& setname)
     new_set = true;
   }
 
-  /* This implicitly adds a new testset to sets, if it's not there: */
-  testset& ts = sets[setname];
+  testset& ts = get_set(setname);
   if (new_set)
   {
     ts.setnum = next_set++;
@@ -262,8 +486,8 @@ testset& KernelTestMgr::find_add_set(std::string& setname)
 }
 
 
-void KernelTestMgr::add_test(const std::string& setname, const char* tname,
-			     unsigned int handle_id)
+KernelTest* KernelTestMgr::add_test(const std::string& setname, const char* tname,
+				    unsigned int handle_id)
 {
   log(KTF_INFO_V, "add_test: %s.%s", setname.c_str(),tname);
   logs(KTF_INFO_V,
@@ -272,41 +496,93 @@ void KernelTestMgr::add_test(const std::string& setname, const char* tname,
        else
 	 fprintf(stderr, "\n"));
   std::string name(tname);
-  new KernelTest(setname, tname, handle_id);
-}
 
+  /* Changes from the kernel may be applied on top of an already listed test: */
+  setmap::iterator sit = sets.find(setname);
+  if (sit != sets.end()) {
+    testmap::iterator it = sit->second.tests.find(name);
+    if (it != sit->second.tests.end() && it->second)
+      return it->second;
+  }
+  return new KernelTest(setname, tname, handle_id);
+}
 
-/* Here we might get called with test names expanded with context names */
-KernelTest* KernelTestMgr::find_test(const std::string&setname,
-				     const std::string& testname,
-				     std::string* pctx)
+void KernelTestMgr::remove_test(const std::string& setname, const std::string& tname)
 {
-  off_t pos;
-  log(KTF_DEBUG, "find test %s.%s\n", setname.c_str(), testname.c_str());
+  setmap::iterator sit = sets.find(setname);
+  if (sit == sets.end())
+    return;
+  testset& ts = sit->second;
+  testmap::iterator it = ts.tests.find(tname);
+  if (it == ts.tests.end() || !it->second)
+    return;
 
-  /* Try direct lookup first: */
-  KernelTest* kt = sets[setname].tests[testname];
-  if (kt) {
-    *pctx = std::string();
-    return kt;
+  KernelTest* kt = it->second;
+  log(KTF_INFO_V, "remove_test: %s.%s\n", setname.c_str(), tname.c_str());
+  if (!kt->handle_id)
+    erase_name(ts.test_names, tname);
+  else {
+    stringvec& ctxv = handle_to_ctxvec[kt->handle_id];
+    for (stringvec::iterator cit = ctxv.begin(); cit != ctxv.end(); ++cit) {
+      erase_name(ts.test_names, tname + "_" + *cit);
+      unindex_test(ts, kt, *cit);
+    }
+  }
+  unindex_test(ts, kt, std::string());
+
+  /* Keep the user level part of a hybrid test in case the kernel test returns */
+  if (kt->user_test)
+    ts.wrapper[tname] = kt->user_test;
+  ts.tests.erase(it);
+  delete kt;
+
+  if (ts.tests.empty() && ts.wrapper.empty()) {
+    erase_name(set_names, setname);
+    kernelsets.erase(setname);
+    set_index.erase(setname.c_str());
+    sets.erase(sit);
   }
+}
+
+
+/* Here we might get called with test names expanded with context names,
+ * which are all in the index of the test set:
+ */
+KernelTest* KernelTestMgr::find_test(const char* setname, const char* testname,
+				     const std::string** pctx)
+{
+  log(KTF_DEBUG, "find test %s.%s\n", setname, testname);
 
-  /* If we don't have any contexts set, no need to parse name: */
-  if (handle_to_ctxvec.empty())
+  setindex::iterator sit = set_index.find(setname);
+  if (sit == set_index.end())
     return NULL;
 
-  pos = testname.find_last_of('_');
-  while (pos >= 0) {
-    std::string tname = testname.substr(0,pos);
-    std::string ctx = testname.substr(pos + 1, testname.npos);
-    *pctx = ctx;
-    kt = sets[setname].tests[tname];
-    if (kt)
-      return kt;
-    /* context name might contain an '_' , iterate on: */
-    pos = tname.find_last_of('_');
-  }
-  return NULL;
+  testindex::iterator it = sit->second->index.find(testname);
+  if (it == sit->second->index.end())
+    return NULL;
+  *pctx = it->second.ctx;
+  return it->second.kt;
+}
+
+
+void KernelTestMgr::clear_results()
+{
+  for (setmap::iterator it = sets.begin(); it != sets.end(); ++it)
+    for (testmap::iterator tit = it->second.tests.begin(); tit != it->second.tests.end(); ++tit) {
+      tit->second->pending.clear();
+      tit->second->timing.clear();
+    }
+}
+
+stringvec KernelTestMgr::get_hybrid_names()
+{
+  stringvec names;
+
+  for (setmap::iterator sit = sets.begin(); sit != sets.end(); ++sit)
+    for (testindex::iterator it = sit->second.index.begin(); it != sit->second.index.end(); ++it)
+      if (it->second.kt->user_test)
+	names.push_back(sit->first + "." + it->first);
+  return names;
 }
 
 
@@ -338,14 +614,15 @@ void KernelTestMgr::add_wrapper(const std::string setname, const std::string tes
 				test_cb* tcb)
 {
   log(KTF_DEBUG, "add_wrapper: %s.%s\n", setname.c_str(),testname.c_str());
-  testset& ts = sets[setname];
+  testset& ts = get_set(setname);
 
   /* Depending on C++ initialization order which vary between compiler version
    * (sigh!) either the kernel tests have already been processed or we have to store
    * this object in wrapper for later insertion:
    */
-  KernelTest *kt = ts.tests[testname];
-  if (kt) {
+  testmap::iterator it = ts.tests.find(testname);
+  if (it != ts.tests.end() && it->second) {
+    KernelTest *kt = it->second;
     log(KTF_DEBUG_V, "Assigning user_test for %s.%s\n",
 	setname.c_str(), testname.c_str());
     kt->user_test = tcb;
@@ -376,6 +653,20 @@ stringvec KernelTestMgr::get_test_names()
   if (!cur) {
     cur = new name_iter();
     cur->it = sets.begin();
+
+    /* Select the tests of this shard among all the tests: */
+    if (total_shards > 1) {
+      stringvec all;
+      for (setmap::iterator sit = sets.begin(); sit != sets.end(); ++sit)
+	for (stringvec::iterator it = sit->second.test_names.begin();
+	     it != sit->second.test_names.end(); ++it)
+	  all.push_back(sit->first + "." + *it);
+      if (history)
+	shard_tests = history->shard(all, total_shards, shard_index);
+      else
+	shard_tests = shard_by_name(all, total_shards, shard_index);
+      sharded = true;
+    }
   }
 
   /* Filter out any combined tests that do not have a kernel counterpart loaded */
@@ -396,7 +687,14 @@ stringvec KernelTestMgr::get_test_names()
   cur->setname = cur->it->first;
 
   ++(cur->it);
-  return v;
+  if (!sharded)
+    return v;
+
+  stringvec sv;
+  for (stringvec::iterator it = v.begin(); it != v.end(); ++it)
+    if (shard_tests.count(cur->setname + "." + *it))
+      sv.push_back(*it);
+  return sv;
 }
 
 ConfigurableContext::ConfigurableContext(const std::string& name_, const std::string& type_name_,
@@ -474,6 +772,69 @@ size_t get_priv_sz(KernelTest *kt)
   return kt->user_priv_sz;
 }
 
+/* Shared memory regions for out-of-band data, each a mapping of the ktf device.
+ * Data is allocated from the latest region, and kept until the program exits:
+ */
+struct shm_region
+{
+  unsigned int id;
+  char* map;
+  size_t size;
+  size_t used;
+};
+
+#define KTF_SHM_DEV "/dev/" KTF_SHM_DEV_NAME
+#define KTF_SHM_CHUNK (4UL << 20)
+#define KTF_SHM_ALIGN 64
+
+static std::vector<shm_region> shm_regions;
+
+static void* shm_alloc(size_t sz, unsigned int* id, size_t* off)
+{
+  shm_region r;
+  long pgsz = sysconf(_SC_PAGESIZE);
+  int fd;
+
+  sz = (sz + KTF_SHM_ALIGN - 1) & ~(size_t)(KTF_SHM_ALIGN - 1);
+  if (shm_regions.empty() || shm_regions.back().size - shm_regions.back().used < sz) {
+    r.size = std::max(sz, (size_t)KTF_SHM_CHUNK);
+    r.size = (r.size + pgsz - 1) & ~(size_t)(pgsz - 1);
+    r.used = 0;
+    fd = open(KTF_SHM_DEV, O_RDWR);
+    if (fd < 0)
+      return NULL;
+    r.map = (char*)mmap(NULL, r.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (r.map == MAP_FAILED || ioctl(fd, KTF_IOC_SHM_ID, &r.id)) {
+      log(KTF_WARN, "Failed to set up shared memory (errno %d)\n", errno);
+      if (r.map != MAP_FAILED)
+	munmap(r.map, r.size);
+      close(fd);
+      return NULL;
+    }
+    /* The mapping keeps the region alive */
+    close(fd);
+    log(KTF_DEBUG, "Mapped shared memory region %u of %lu bytes\n", r.id, r.size);
+    shm_regions.push_back(r);
+  }
+
+  shm_region& cur = shm_regions.back();
+  *id = cur.id;
+  *off = cur.used;
+  cur.used += sz;
+  return cur.map + *off;
+}
+
+void* get_shared_priv(KernelTest* kt, size_t sz)
+{
+  if (!kt->user_priv && kernel_version >= KTF_VERSION_SHM) {
+    kt->user_priv = shm_alloc(sz, &kt->shm_id, &kt->shm_off);
+    if (kt->user_priv)
+      kt->user_priv_sz = sz;
+  }
+  /* Fall back to sending the data with the request */
+  return kt->get_priv(sz);
+}
+
 int set_coverage(std::string module, unsigned int opts, bool enabled)
 {
   struct nl_msg *msg;
@@ -505,13 +866,17 @@ int set_coverage(std::string module, unsigned int opts, bool enabled)
   return err;
 }
 
-  KernelTest::KernelTest(const std::string& sn, const char* tn, unsigned int handle_id)
+  KernelTest::KernelTest(const std::string& sn, const char* tn, unsigned int hid)
   : setname(sn),
     testname(tn),
+    handle_id(hid),
+    id(0),
     setnum(0),
     testnum(0),
     user_priv(NULL),
     user_priv_sz(0),
+    shm_id(0),
+    shm_off(0),
     user_test(NULL),
     file(NULL),
     line(-1)
@@ -525,12 +890,16 @@ int set_coverage(std::string module, unsigned int opts, bool enabled)
   setnum = ts.setnum;
   ts.tests[testname] = this;
 
+  /* The plain test name is also indexed, for lookups without a context: */
+  kmgr().index_test(ts, this, std::string());
   if (!handle_id)
     ts.test_names.push_back(testname);
   else {
     stringvec& ctxv = kmgr().get_contexts(handle_id);
-    for (stringvec::iterator it = ctxv.begin(); it != ctxv.end(); ++it)
+    for (stringvec::iterator it = ctxv.begin(); it != ctxv.end(); ++it) {
       ts.test_names.push_back(testname + "_" + *it);
+      kmgr().index_test(ts, this, *it);
+    }
   }
   testnum = ts.tests.size();
 
@@ -549,13 +918,21 @@ int set_coverage(std::string module, unsigned int opts, bool enabled)
 
 KernelTest::~KernelTest()
 {
-  if (user_priv)
+  if (user_priv && !shm_id)
     free(user_priv);
 }
 
+/* Out-of-band data not in shared memory is sent as a single netlink attribute */
+#define KTF_MAX_DATA_ATTR (0xffff - NLA_HDRLEN)
+
 void* KernelTest::get_priv(size_t p_sz)
 {
   if (!user_priv) {
+    if (p_sz > KTF_MAX_DATA_ATTR) {
+      fprintf(stderr, "%s: %zu bytes of out-of-band data exceeds the limit of %d bytes"
+	      " for data not shared with the kernel\n", name.c_str(), p_sz, KTF_MAX_DATA_ATTR);
+      return NULL;
+    }
     user_priv = malloc(p_sz);
     if (user_priv)
       user_priv_sz = p_sz;
@@ -567,6 +944,230 @@ static int parse_cb(struct nl_msg *msg, void *arg);
 static int debug_cb(struct nl_msg *msg, void *arg);
 static int error_cb(struct nl_msg *msg, void *arg);
 
+/* A result_sink keeps results received from the kernel
+ * for later reporting, instead of reporting them immediately:
+ */
+class result_sink
+{
+public:
+  virtual ~result_sink() {}
+
+  /* Return the list to keep the results of this RUN response in, or NULL if unknown */
+  virtual result_vec* results(struct nl_msg *msg, struct nlattr** attrs) = 0;
+
+  /* Return where to keep the timing of the test of this RUN response, or NULL if unknown */
+  virtual test_timing* timing(struct nl_msg *msg, struct nlattr** attrs) = 0;
+};
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Keep the duration of a test that started at start for the history, if enabled */
+static void record_duration(KernelTest* kt, const std::string& ctx, uint64_t start)
+{
+  if (history)
+    history->record(kt->name + (ctx.empty() ? "" : "_" + ctx), now_ns() - start);
+}
+
+/* Responses to a batch are identified by the index of the test within the batch.
+ * The tests run one after the other, so each test took the time since the
+ * previous test completed:
+ */
+class batch_sink : public result_sink
+{
+public:
+  batch_sink(run_list& t) : tests(t), last(now_ns())
+  { }
+
+  virtual result_vec* results(struct nl_msg *msg, struct nlattr** attrs)
+  {
+    if (!attrs[KTF_A_NUM])
+      return NULL;
+    size_t index = nla_get_u32(attrs[KTF_A_NUM]);
+    if (index >= tests.size())
+      return NULL;
+    /* The last part of the response has the status of the run: */
+    if (attrs[KTF_A_STAT]) {
+      record_duration(tests[index].kt, tests[index].ctx, last);
+      last = now_ns();
+    }
+    return &tests[index].kt->pending[tests[index].ctx];
+  }
+
+  virtual test_timing* timing(struct nl_msg *msg, struct nlattr** attrs)
+  {
+    size_t index = nla_get_u32(attrs[KTF_A_NUM]);
+    return &tests[index].kt->timing[tests[index].ctx];
+  }
+
+  run_list& tests;
+  uint64_t last;
+};
+
+/* Responses to a RUN with a filter identify each test by name */
+class match_sink : public result_sink
+{
+public:
+  match_sink() : count(0), last(now_ns())
+  { }
+
+  virtual result_vec* results(struct nl_msg *msg, struct nlattr** attrs)
+  {
+    KernelTest* kt = find(attrs);
+    if (!kt) {
+      /* A test that is not in our catalog, for instance added since the query */
+      discard.clear();
+      return &discard;
+    }
+    if (attrs[KTF_A_STAT]) {
+      record_duration(kt, *ctx, last);
+      last = now_ns();
+      count++;
+    }
+    return &kt->pending[*ctx];
+  }
+
+  virtual test_timing* timing(struct nl_msg *msg, struct nlattr** attrs)
+  {
+    KernelTest* kt = find(attrs);
+    return kt ? &kt->timing[*ctx] : &discard_timing;
+  }
+
+  size_t count;
+
+private:
+  KernelTest* find(struct nlattr** attrs)
+  {
+    if (!attrs[KTF_A_SNAM] || !attrs[KTF_A_TNAM])
+      return NULL;
+    std::string name = nla_get_string(attrs[KTF_A_TNAM]);
+    if (attrs[KTF_A_STR])
+      name += std::string("_") + nla_get_string(attrs[KTF_A_STR]);
+    return kmgr().find_test(nla_get_string(attrs[KTF_A_SNAM]), name.c_str(), &ctx);
+  }
+
+  const std::string* ctx;
+  result_vec discard;
+  test_timing discard_timing;
+  uint64_t last;
+};
+
+/* An asynchronously submitted test run */
+struct async_run
+{
+  KernelTest* kt;
+  std::string ctx;
+  run_done done;
+  void* arg;
+  uint64_t start;
+};
+
+typedef std::map<uint32_t, async_run> async_map;
+
+/* Responses to asynchronously submitted tests are identified by netlink sequence number */
+class async_sink : public result_sink
+{
+public:
+  async_sink() : cb(NULL), last(0)
+  { }
+
+  ~async_sink()
+  {
+    if (cb)
+      nl_cb_put(cb);
+  }
+
+  virtual result_vec* results(struct nl_msg *msg, struct nlattr** attrs)
+  {
+    async_map::iterator it = inflight.find(nlmsg_hdr(msg)->nlmsg_seq);
+    if (it == inflight.end())
+      return NULL;
+    return &it->second.kt->pending[it->second.ctx];
+  }
+
+  virtual test_timing* timing(struct nl_msg *msg, struct nlattr** attrs)
+  {
+    async_map::iterator it = inflight.find(nlmsg_hdr(msg)->nlmsg_seq);
+    return &it->second.kt->timing[it->second.ctx];
+  }
+
+  void complete(uint32_t seq, int status);
+
+  async_map inflight;
+  struct nl_cb *cb;
+  uint64_t last;  /* Completion time of the previous run */
+};
+
+async_sink async_runs;
+
+/* Max number of asynchronously submitted tests in flight, to avoid
+ * overflowing the socket receive buffer with responses:
+ */
+#define KTF_MAX_INFLIGHT 32
+
+/* Parallel execution: Each worker thread has its own connection to the kernel
+ * and runs a whole test set at a time, to keep the tests within a set serialized:
+ */
+class Worker : public result_sink
+{
+public:
+  Worker() : wsock(NULL), wfamily(-1), rv(NULL), tm(NULL)
+  { }
+
+  ~Worker()
+  {
+    if (wsock)
+      nl_socket_free(wsock);
+  }
+
+  int connect();
+  int run(KernelTest* kt, const std::string& ctx, result_vec& results, test_timing& timing);
+
+  /* A worker only has a single test running at a time */
+  virtual result_vec* results(struct nl_msg *msg, struct nlattr** attrs)
+  {
+    return rv;
+  }
+
+  virtual test_timing* timing(struct nl_msg *msg, struct nlattr** attrs)
+  {
+    return tm;
+  }
+
+  static void* main(void* arg);
+
+  pthread_t thread;
+  struct nl_sock* wsock;
+  int wfamily;
+  result_vec* rv;
+  test_timing* tm;
+};
+
+typedef std::pair<KernelTest*, std::string> test_id;
+
+class ParallelRun
+{
+public:
+  ParallelRun() : next(0)
+  {
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+  }
+
+  std::vector<run_list> sets;
+  size_t next;                  /* Next set to be picked up by a worker */
+  std::set<test_id> queued;     /* Tests not yet completed by a worker */
+  std::vector<Worker*> workers;
+  pthread_mutex_t lock;         /* Protects the above and the pending results of queued tests */
+  pthread_cond_t cond;          /* Signalled each time a test completes */
+};
+
+ParallelRun prun;
+
 int nl_connect(void)
 {
   /* Allocate a new netlink socket */
@@ -590,6 +1191,9 @@ int nl_connect(void)
     exit(1);
   }
 
+  /* Make room for test results streamed from the kernel */
+  nl_socket_set_buffer_size(sock, KTF_RCVBUF_SIZE, 0);
+
   /* Specify the generic callback functions for messages */
   nl_socket_modify_cb(sock, NL_CB_VALID, NL_CB_CUSTOM, parse_cb, NULL);
   nl_socket_modify_cb(sock, NL_CB_INVALID, NL_CB_CUSTOM, error_cb, NULL);
@@ -607,42 +1211,355 @@ void default_test_handler(int result,  const char* file, int line, const char* r
 }
 
 test_handler handle_test = default_test_handler;
+timing_handler handle_timing = NULL;
 
 bool setup(test_handler ht)
 {
   ktf_debug_init();
   handle_test = ht;
+
+  char* bs = getenv("KTF_BATCH_SIZE");
+  if (bs)
+    set_batch_size(strtoul(bs, NULL, 10));
+  char* nw = getenv("KTF_WORKERS");
+  if (nw)
+    set_workers(strtoul(nw, NULL, 10));
+  char* tmo = getenv("KTF_TIMEOUT");
+  if (tmo)
+    set_timeout(strtoul(tmo, NULL, 10));
+  char* rep = getenv("KTF_REPEAT");
+  if (rep)
+    set_repeat(strtoul(rep, NULL, 10));
+  char* rf = getenv("KTF_RUN_FOR");
+  if (rf)
+    set_run_for(strtoul(rf, NULL, 10));
+  char* flt = getenv("KTF_FILTER");
+  if (flt)
+    set_kernel_filter(flt);
+  char* cat = getenv("KTF_CATALOG");
+  if (cat && !catalog)
+    catalog = new Catalog(cat);
+  char* dur = getenv("KTF_DURATIONS");
+  if (dur && !history) {
+    history = new History(dur);
+    history->load();
+  }
+  char* bl = getenv("KTF_BASELINE");
+  if (bl && !baseline) {
+    baseline = new Baseline(bl, getenv("KTF_BASELINE_UPDATE") != NULL);
+    char* th = getenv("KTF_BASELINE_THRESHOLD");
+    if (th)
+      baseline->threshold = strtod(th, NULL);
+    char* sg = getenv("KTF_BASELINE_SIGMAS");
+    if (sg)
+      baseline->sigmas = strtod(sg, NULL);
+    if (!baseline->updating())
+      baseline->load();
+  }
+  char* ts = getenv("KTF_TOTAL_SHARDS");
+  char* si = getenv("KTF_SHARD_INDEX");
+  if (ts && si) {
+    total_shards = strtoul(ts, NULL, 10);
+    shard_index = strtoul(si, NULL, 10);
+    if (shard_index >= total_shards) {
+      fprintf(stderr, "KTF_SHARD_INDEX must be less than KTF_TOTAL_SHARDS - not sharding\n");
+      total_shards = 0;
+    }
+  }
   return nl_connect() == 0;
 }
 
+void set_timing_handler(timing_handler th)
+{
+  handle_timing = th;
+}
 
-configurator do_context_configure = NULL;
+void set_batch_size(size_t bs)
+{
+  batch_size = bs ? bs : 1;
+}
 
-void set_configurator(configurator c)
+size_t get_batch_size()
 {
-  do_context_configure = c;
+  return batch_size;
 }
 
-/* Query kernel for available tests in index order */
-stringvec& query_testsets()
+void set_workers(size_t n)
 {
-  struct nl_msg *msg;
-  int err;
+  workers = n ? n : 1;
+}
 
-  msg = nlmsg_alloc();
-  genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, family, 0, NLM_F_REQUEST,
-	      KTF_C_QUERY, 1);
-  nla_put_u64(msg, KTF_A_VERSION, KTF_VERSION_LATEST);
+size_t get_workers()
+{
+  return workers;
+}
 
-  // Send message over netlink socket
-  nl_send_auto_complete(sock, msg);
+void set_timeout(unsigned int tmo)
+{
+  timeout_ms = tmo;
+}
 
-  // Free message
-  nlmsg_free(msg);
+unsigned int get_timeout()
+{
+  return timeout_ms;
+}
 
-  // Wait for acknowledgement:
-  // This function also returns error status if the message
-  // was not deemed ok by the kernel.
+void set_repeat(unsigned int r)
+{
+  repeat = r;
+}
+
+unsigned int get_repeat()
+{
+  return repeat;
+}
+
+void set_run_for(unsigned int ms)
+{
+  run_for_ms = ms;
+}
+
+unsigned int get_run_for()
+{
+  return run_for_ms;
+}
+
+void set_kernel_filter(const std::string& filter)
+{
+  kernel_filter = filter;
+}
+
+const std::string& get_kernel_filter()
+{
+  return kernel_filter;
+}
+
+/* Older kernels do not know about timeouts, and would just ignore it */
+static void put_timeout(struct nl_msg* msg)
+{
+  if (timeout_ms && kernel_version >= KTF_VERSION_TIMEOUT)
+    nla_put_u32(msg, KTF_A_TMO, timeout_ms);
+}
+
+/* Older kernels would just run the test once */
+static void put_repeat(struct nl_msg* msg)
+{
+  if (kernel_version < KTF_VERSION_REPEAT)
+    return;
+  if (repeat)
+    nla_put_u32(msg, KTF_A_REPEAT, repeat);
+  if (run_for_ms)
+    nla_put_u32(msg, KTF_A_RUNFOR, run_for_ms);
+}
+
+/* Identify the test and context to run by the kernel's IDs if we have them,
+ * which saves the kernel the lookups by name:
+ */
+static void put_test(struct nl_msg* msg, KernelTest* kt, const std::string& context)
+{
+  unsigned int cid = context.empty() ? 0 : kmgr().get_context_id(kt->handle_id, context);
+
+  if (kt->id)
+    nla_put_u32(msg, KTF_A_TID, kt->id);
+  else {
+    nla_put_string(msg, KTF_A_SNAM, kt->setname.c_str());
+    nla_put_string(msg, KTF_A_TNAM, kt->testname.c_str());
+  }
+  if (cid)
+    nla_put_u32(msg, KTF_A_CID, cid);
+  else if (!context.empty())
+    nla_put_string(msg, KTF_A_STR, context.c_str());
+}
+
+
+configurator do_context_configure = NULL;
+
+void set_configurator(configurator c)
+{
+  do_context_configure = c;
+}
+
+/* State of a QUERY, which may span multiple responses */
+struct query_state
+{
+  int parts;        /* Number of QUERY responses received */
+  bool configured;  /* Contexts have been configured */
+  bool changes;     /* Response is to a query for changes only */
+  bool stale;       /* The changes are not available - a full query is needed */
+};
+
+query_state qstate;
+
+static int gen_cb(struct nl_msg *msg, void *arg)
+{
+  struct nlattr *attrs[KTF_A_MAX+1];
+
+  if (genlmsg_parse(nlmsg_hdr(msg), 0, attrs, KTF_A_MAX, ktf_get_gnl_policy()) >= 0 &&
+      attrs[KTF_A_GEN])
+    *(uint64_t*)arg = nla_get_u64(attrs[KTF_A_GEN]);
+  return NL_OK;
+}
+
+/* The kernel's current catalog generation, or 0 if not available.
+ * A QUERY with NUM = 0 gets just the generation back:
+ */
+static uint64_t kernel_catalog_gen()
+{
+  struct nl_msg *msg;
+  struct nl_cb *cb;
+  uint64_t gen = 0;
+  int err;
+
+  cb = nl_cb_alloc(NL_CB_DEFAULT);
+  if (!cb)
+    return 0;
+  nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, gen_cb, &gen);
+
+  msg = nlmsg_alloc();
+  genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, family, 0, NLM_F_REQUEST,
+	      KTF_C_QUERY, 1);
+  nla_put_u64(msg, KTF_A_VERSION, KTF_VERSION_LATEST);
+  nla_put_u32(msg, KTF_A_NUM, 0);
+
+  nl_socket_disable_auto_ack(sock);
+  err = nl_send_auto_complete(sock, msg);
+  nl_socket_enable_auto_ack(sock);
+  nlmsg_free(msg);
+  if (err >= 0)
+    nl_recvmsgs(sock, cb);
+  nl_cb_put(cb);
+  return gen;
+}
+
+/* Build the tests and contexts from the catalog, if it is up to date,
+ * with the same calls as when parsing a QUERY response:
+ */
+static bool load_catalog()
+{
+  const catalog_entry* e;
+  std::string setname;
+  stringvec contexts;
+  bool configured = false;
+  uint64_t gen = kernel_catalog_gen();
+  KernelTest* kt;
+
+  if (!catalog->open(gen))
+    return false;
+
+  kernel_version = catalog->kernel_version();
+  while ((e = catalog->next()) != NULL) {
+    const char* str = e->str();
+
+    switch (e->type) {
+    case KTF_CAT_CTYPE:
+      kmgr().add_ctype(e->hid, str);
+      break;
+    case KTF_CAT_CFG_CTX:
+      kmgr().add_configurable_context(str, str + strlen(str) + 1, e->hid, e->stat);
+      break;
+    case KTF_CAT_CTX_ID:
+      kmgr().set_context_id(e->hid, str, e->id);
+      break;
+    case KTF_CAT_CSET:
+      contexts.clear();
+      for (int i = 0; i < e->nstr; i++, str += strlen(str) + 1)
+	contexts.push_back(str);
+      kmgr().add_cset(e->hid, contexts);
+      break;
+    case KTF_CAT_CONFIGURE:
+      configured = true;
+      if (do_context_configure)
+	do_context_configure();
+      break;
+    case KTF_CAT_SET:
+      setname = str;
+      kmgr().find_add_set(setname);
+      break;
+    case KTF_CAT_TEST:
+      kt = kmgr().add_test(setname, str, e->hid);
+      if (kt)
+	kt->id = e->id;
+      break;
+    }
+  }
+  if (!configured && do_context_configure)
+    do_context_configure();
+  catalog_gen = gen;
+  return true;
+}
+
+/* Store the tests and contexts just received in the catalog for the next run */
+static void save_catalog()
+{
+  /* Contexts may be created or reconfigured from user space,
+   * which is not reflected by the catalog key:
+   */
+  if (kmgr().has_configurable()) {
+    log(KTF_INFO, "Not saving catalog as the kernel has configurable contexts\n");
+    return;
+  }
+  catalog->save(catalog_gen, kernel_version);
+}
+
+/* Query kernel for available tests in index order */
+stringvec& query_testsets()
+{
+  struct nl_msg *msg;
+  int err;
+
+  qstate.parts = 0;
+  qstate.configured = false;
+  catalog_gen = 0;
+  if (catalog)
+    catalog->clear();
+
+  /* The catalog holds the unfiltered responses */
+  if (catalog && kernel_filter.empty() && load_catalog())
+    return kmgr().get_set_names();
+
+  // Stream the tests as a dump, to not be limited by what fits in a single response:
+  msg = nlmsg_alloc();
+  genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, family, 0, NLM_F_REQUEST | NLM_F_DUMP,
+	      KTF_C_QUERY, 1);
+  nla_put_u64(msg, KTF_A_VERSION, KTF_VERSION_LATEST);
+  /* Older kernels ignore the filter and return all the tests */
+  if (!kernel_filter.empty())
+    nla_put_string(msg, KTF_A_FILTER, kernel_filter.c_str());
+
+  // The response is terminated by NLMSG_DONE, which also concludes the request:
+  nl_socket_disable_auto_ack(sock);
+  err = nl_send_auto_complete(sock, msg);
+  nl_socket_enable_auto_ack(sock);
+  nlmsg_free(msg);
+
+  if (err >= 0)
+    err = nl_recvmsgs_default(sock);
+  if (err >= 0 || qstate.parts) {
+    if (err < 0)
+      errno = -err;
+    else if (catalog && kernel_filter.empty())
+      save_catalog();
+    return kmgr().get_set_names();
+  }
+
+  // Older kernels do not support QUERY as a dump - fall back to a single response:
+  log(KTF_INFO, "QUERY dump failed with status %d - trying a single QUERY\n", err);
+  msg = nlmsg_alloc();
+  genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, family, 0, NLM_F_REQUEST,
+	      KTF_C_QUERY, 1);
+  nla_put_u64(msg, KTF_A_VERSION, KTF_VERSION_LATEST);
+  if (!kernel_filter.empty())
+    nla_put_string(msg, KTF_A_FILTER, kernel_filter.c_str());
+
+  // Send message over netlink socket
+  nl_send_auto_complete(sock, msg);
+
+  // Free message
+  nlmsg_free(msg);
+
+  // Wait for acknowledgement:
+  // This function also returns error status if the message
+  // was not deemed ok by the kernel.
   //
   err = nl_wait_for_ack(sock);
   if (err < 0) {
@@ -651,39 +1568,260 @@ stringvec& query_testsets()
   }
 
   // Then wait for the answer and receive it
-  nl_recvmsgs_default(sock);
+  err = nl_recvmsgs_default(sock);
+  if (err >= 0 && catalog && kernel_filter.empty())
+    save_catalog();
   return kmgr().get_set_names();
 }
 
+int update_testsets()
+{
+  struct nl_msg *msg;
+  int err;
+
+  /* Changes are not filtered, so use a new filtered query instead */
+  if (kernel_version < KTF_VERSION_CHANGES || !catalog_gen || !kernel_filter.empty())
+    return -EOPNOTSUPP;
+
+  /* Tests may be removed by the changes, so let runs in flight complete first: */
+  run_wait();
+  run_parallel_wait();
+
+  msg = nlmsg_alloc();
+  genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, family, 0, NLM_F_REQUEST,
+	      KTF_C_QUERY, 1);
+  nla_put_u64(msg, KTF_A_VERSION, KTF_VERSION_LATEST);
+  nla_put_u64(msg, KTF_A_GEN, catalog_gen);
+
+  qstate.changes = true;
+  qstate.stale = false;
+  nl_send_auto_complete(sock, msg);
+  nlmsg_free(msg);
+
+  err = nl_wait_for_ack(sock);
+  if (err >= 0)
+    err = nl_recvmsgs_default(sock);
+  qstate.changes = false;
+  if (err < 0)
+    return err;
+  return qstate.stale ? -ESTALE : 0;
+}
+
 stringvec get_test_names()
 {
   return kmgr().get_test_names();
 }
 
+void save_durations()
+{
+  if (history)
+    history->save();
+}
+
+std::string check_baseline(const std::string& name, const test_timing& timing, bool failed)
+{
+  const bench_stats& bs = timing.bench;
+  /* Compare the time of a single run, also when the kernel repeated the test */
+  uint64_t ns = timing.repeat.runs ? timing.repeat.mean : timing.ns;
+  std::string msg;
+
+  if (!baseline)
+    return msg;
+  if (baseline->updating()) {
+    /* A failed run is not a good baseline */
+    if (failed)
+      return msg;
+    baseline->record(name, "kernel_ns", ns, 0, 1);
+    if (bs.samples)
+      baseline->record(name, "bench_mean_ps", bs.mean, bs.stddev, bs.samples);
+    return msg;
+  }
+  /* A benchmark's own statistics are more precise than its total duration */
+  if (bs.samples)
+    return baseline->check(name, "bench_mean_ps", bs.mean, bs.stddev, bs.samples, 0);
+  return baseline->check(name, "kernel_ns", ns, 0, 1, KTF_BASELINE_MIN_DELTA_NS);
+}
+
+void save_baseline()
+{
+  if (baseline)
+    baseline->save();
+}
+
 std::string get_current_setname()
 {
   return kmgr().get_current_setname();
 }
 
-KernelTest* find_test(const std::string&setname, const std::string& testname, std::string* ctx)
+KernelTest* find_test(const char* setname, const char* testname, const std::string** ctx)
 {
   return kmgr().find_test(setname, testname, ctx);
 }
 
+KernelTest* find_test(const std::string&setname, const std::string& testname, std::string* ctx)
+{
+  const std::string* pctx;
+  KernelTest* kt = kmgr().find_test(setname.c_str(), testname.c_str(), &pctx);
+
+  if (kt)
+    *ctx = *pctx;
+  return kt;
+}
+
 void add_wrapper(const std::string setname, const std::string testname, test_cb* tcb)
 {
   kmgr().add_wrapper(setname, testname, tcb);
 }
 
+bool has_results(KernelTest* kt, const std::string& ctx)
+{
+  pthread_mutex_lock(&prun.lock);
+  bool found = kt->pending.find(ctx) != kt->pending.end() ||
+    prun.queued.find(test_id(kt, ctx)) != prun.queued.end();
+  pthread_mutex_unlock(&prun.lock);
+  return found;
+}
+
+void clear_results()
+{
+  pthread_mutex_lock(&prun.lock);
+  kmgr().clear_results();
+  pthread_mutex_unlock(&prun.lock);
+}
+
+/* Take the kept results of a test, if any,
+ * waiting for it to complete if queued for a worker:
+ */
+static bool take_results(KernelTest* kt, const std::string& ctx, result_vec& results,
+			 test_timing& timing)
+{
+  std::map<std::string, result_vec>::iterator it;
+  std::map<std::string, test_timing>::iterator tit;
+  bool found = false;
+
+  pthread_mutex_lock(&prun.lock);
+  while (prun.queued.find(test_id(kt, ctx)) != prun.queued.end())
+    pthread_cond_wait(&prun.cond, &prun.lock);
+
+  it = kt->pending.find(ctx);
+  if (it != kt->pending.end()) {
+    results.swap(it->second);
+    kt->pending.erase(it);
+    found = true;
+  }
+  tit = kt->timing.find(ctx);
+  if (tit != kt->timing.end()) {
+    timing = tit->second;
+    kt->timing.erase(tit);
+  }
+  pthread_mutex_unlock(&prun.lock);
+  return found;
+}
+
 void run_test(KernelTest* kt, std::string& ctx)
 {
+  result_vec results;
+  test_timing timing;
+
   if (kt->user_test)
     kt->user_test->fun(kt);
-  else
+  else if (take_results(kt, ctx, results, timing)) {
+    /* This test has already been run - just report the results: */
+    for (result_vec::iterator rit = results.begin(); rit != results.end(); ++rit)
+      handle_test(rit->result, rit->file.c_str(), rit->line, rit->report.c_str());
+    if (timing.ns && handle_timing)
+      handle_timing(timing);
+  } else
     run(kt, ctx);
 }
 
-/* Run the kernel test */
+/* Build a request to run a single kernel test */
+static struct nl_msg* run_msg(KernelTest* kt, const std::string& context, int family)
+{
+  struct nl_msg *msg = nlmsg_alloc();
+
+  if (!msg)
+    return NULL;
+  genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, family, 0, NLM_F_REQUEST,
+	      KTF_C_RUN, 1);
+  nla_put_u64(msg, KTF_A_VERSION, KTF_VERSION_LATEST);
+  put_test(msg, kt, context);
+  put_timeout(msg);
+  put_repeat(msg);
+
+  /* Send any test specific out-of-band data, or a reference to it if shared */
+  if (kt->shm_id) {
+    nla_put_u32(msg, KTF_A_SHM, kt->shm_id);
+    nla_put_u64(msg, KTF_A_SOFF, kt->shm_off);
+    nla_put_u64(msg, KTF_A_SLEN, kt->user_priv_sz);
+  } else if (kt->user_priv)
+    nla_put(msg, KTF_A_DATA, kt->user_priv_sz, kt->user_priv);
+  return msg;
+}
+
+/* If some parts of a streamed response are lost due to a receive buffer overrun,
+ * the kernel tells in a later part, so just keep receiving the rest.
+ * Returns true if err is such an overrun and receiving should continue:
+ */
+bool nl_rcvbuf_overrun(int err)
+{
+  /* Tell an overrun from running out of memory by errno from the failed recvmsg() */
+  return err == -KTF_NLE_NOBUFS && errno == ENOBUFS;
+}
+
+static bool rcvbuf_overrun(int err, int* overruns)
+{
+  if (!nl_rcvbuf_overrun(err))
+    return false;
+  if (++*overruns > KTF_MAX_OVERRUNS) {
+    log(KTF_ERR, "Giving up after %d receive buffer overruns\n", KTF_MAX_OVERRUNS);
+    return false;
+  }
+  log(KTF_WARN, "Receive buffer overrun while receiving test results\n");
+  return true;
+}
+
+/* The response to a RUN request is streamed as a multipart message if the kernel
+ * supports it, and the NLMSG_DONE that terminates it also concludes the request:
+ */
+static bool run_streamed()
+{
+  return kernel_version >= KTF_VERSION_STREAM;
+}
+
+/* Send a RUN request, only asking for an ack if the response is not streamed,
+ * as a request must be concluded by a single message for libnl's sequence checks:
+ */
+static int send_run_msg(struct nl_sock* s, struct nl_msg* msg)
+{
+  int err;
+
+  if (!run_streamed())
+    return nl_send_auto_complete(s, msg);
+  nl_socket_disable_auto_ack(s);
+  err = nl_send_auto_complete(s, msg);
+  nl_socket_enable_auto_ack(s);
+  return err;
+}
+
+/* Receive the response to a RUN request sent with send_run_msg() */
+static int recv_run_response(struct nl_sock* s)
+{
+  int err, overruns = 0;
+
+  if (run_streamed()) {
+    while (rcvbuf_overrun(err = nl_recvmsgs_default(s), &overruns))
+      ;
+    return err;
+  }
+
+  // The response arrives before the ack:
+  err = nl_wait_for_ack(s);
+  if (err >= 0)
+    err = nl_recvmsgs_default(s);
+  return err;
+}
+
 void run(KernelTest* kt, std::string context)
 {
   struct nl_msg *msg;
@@ -691,38 +1829,422 @@ void run(KernelTest* kt, std::string context)
   log(KTF_DEBUG_V, "START kernel test (%ld,%ld): %s\n", kt->setnum,
 		kt->testnum, kt->name.c_str());
 
-  msg = nlmsg_alloc();
-  genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, family, 0, NLM_F_REQUEST,
-	      KTF_C_RUN, 1);
-  nla_put_u64(msg, KTF_A_VERSION, KTF_VERSION_LATEST);
-  nla_put_string(msg, KTF_A_SNAM, kt->setname.c_str());
-  nla_put_string(msg, KTF_A_TNAM, kt->testname.c_str());
+  // Responses to asynchronously submitted tests must not be mistaken for ours:
+  run_wait();
 
-  if (!context.empty())
-    nla_put_string(msg, KTF_A_STR, context.c_str());
+  msg = run_msg(kt, context, family);
+  if (!msg) {
+    errno = ENOMEM;
+    return;
+  }
 
-  /* Send any test specific out-of-band data */
-  if (kt->user_priv)
-    nla_put(msg, KTF_A_DATA, kt->user_priv_sz, kt->user_priv);
+  uint64_t start = now_ns();
 
   // Send message over netlink socket
-  nl_send_auto_complete(sock, msg);
+  send_run_msg(sock, msg);
 
   // Free message
   nlmsg_free(msg);
 
-  // Wait for acknowledgement - otherwise
-  // nl_recvmsg_default will sometimes take the ack for the next message..
-  int err = nl_wait_for_ack(sock);
-  if (err < 0) {
+  int err = recv_run_response(sock);
+  if (err < 0)
     errno = -err;
+  else
+    record_duration(kt, context, start);
+
+  log(KTF_DEBUG_V, "END   ktf::run_kernel_test %s\n", kt->name.c_str());
+}
+
+void async_sink::complete(uint32_t seq, int status)
+{
+  async_map::iterator it = inflight.find(seq);
+  if (it == inflight.end())
     return;
+
+  async_run r = it->second;
+  inflight.erase(it);
+  log(KTF_DEBUG_V, "END   async kernel test %s (seq %u, status %d)\n",
+      r.kt->name.c_str(), seq, status);
+
+  /* The kernel runs the tests requested on a socket one at a time,
+   * so a queued test only started when the previous one completed:
+   */
+  if (!status)
+    record_duration(r.kt, r.ctx, std::max(r.start, last));
+  last = now_ns();
+
+  /* Make sure the test is known to have been run even if no results were reported,
+   * but leave failed runs to be retried synchronously by run_test:
+   */
+  if (status) {
+    r.kt->pending.erase(r.ctx);
+    r.kt->timing.erase(r.ctx);
+  } else
+    r.kt->pending[r.ctx];
+  if (r.done)
+    r.done(r.kt, r.ctx, status, r.arg);
+}
+
+/* Responses are matched to the submitted tests by sequence number
+ * instead of libnl's strict ordering:
+ */
+static int async_seq_cb(struct nl_msg *msg, void *arg)
+{
+  async_sink* as = (async_sink*)arg;
+  if (as->inflight.find(nlmsg_hdr(msg)->nlmsg_seq) == as->inflight.end()) {
+    log(KTF_WARN, "Skipping response with unknown sequence number %u\n",
+	nlmsg_hdr(msg)->nlmsg_seq);
+    return NL_SKIP;
   }
+  return NL_OK;
+}
 
-  // Wait for the answer and receive it
-  nl_recvmsgs_default(sock);
+/* The ack follows the response and completes the run,
+ * or for a streamed response, the NLMSG_DONE that terminates it:
+ */
+static int async_ack_cb(struct nl_msg *msg, void *arg)
+{
+  ((async_sink*)arg)->complete(nlmsg_hdr(msg)->nlmsg_seq, 0);
+  return NL_STOP;
+}
 
-  log(KTF_DEBUG_V, "END   ktf::run_kernel_test %s\n", kt->name.c_str());
+static int async_err_cb(struct sockaddr_nl *nla, struct nlmsgerr *err, void *arg)
+{
+  ((async_sink*)arg)->complete(err->msg.nlmsg_seq, err->error);
+  return NL_STOP;
+}
+
+int run_async(KernelTest* kt, std::string context, run_done done, void* arg)
+{
+  struct nl_msg *msg;
+  struct nl_cb *sock_cb;
+  int err;
+
+  if (!async_runs.cb) {
+    sock_cb = nl_socket_get_cb(sock);
+    async_runs.cb = nl_cb_clone(sock_cb);
+    nl_cb_put(sock_cb);
+    if (!async_runs.cb)
+      return -ENOMEM;
+    nl_cb_set(async_runs.cb, NL_CB_VALID, NL_CB_CUSTOM, parse_cb, &async_runs);
+    nl_cb_set(async_runs.cb, NL_CB_SEQ_CHECK, NL_CB_CUSTOM, async_seq_cb, &async_runs);
+    nl_cb_set(async_runs.cb, NL_CB_ACK, NL_CB_CUSTOM, async_ack_cb, &async_runs);
+    nl_cb_set(async_runs.cb, NL_CB_FINISH, NL_CB_CUSTOM, async_ack_cb, &async_runs);
+    nl_cb_err(async_runs.cb, NL_CB_CUSTOM, async_err_cb, &async_runs);
+  }
+
+  // Make room for the response:
+  while (async_runs.inflight.size() >= KTF_MAX_INFLIGHT) {
+    err = run_poll();
+    if (err < 0)
+      return err;
+  }
+
+  msg = run_msg(kt, context, family);
+  if (!msg)
+    return -ENOMEM;
+
+  err = send_run_msg(sock, msg);
+  if (err >= 0) {
+    uint32_t seq = nlmsg_hdr(msg)->nlmsg_seq;
+    async_run& r = async_runs.inflight[seq];
+    r.kt = kt;
+    r.ctx = context;
+    r.done = done;
+    r.arg = arg;
+    r.start = now_ns();
+    err = seq;
+    log(KTF_DEBUG_V, "START async kernel test %s (seq %u)\n", kt->name.c_str(), seq);
+  }
+  nlmsg_free(msg);
+  return err;
+}
+
+int run_poll()
+{
+  if (async_runs.inflight.empty())
+    return 0;
+
+  int err = nl_recvmsgs(sock, async_runs.cb);
+  if (err < 0) {
+    /* Can't tell which test(s) the failure was for, so fail all of them: */
+    while (!async_runs.inflight.empty())
+      async_runs.complete(async_runs.inflight.begin()->first, err);
+    return err;
+  }
+  return async_runs.inflight.size();
+}
+
+int run_wait()
+{
+  int err = 0;
+
+  while (!async_runs.inflight.empty() && err >= 0)
+    err = run_poll();
+  return err < 0 ? err : 0;
+}
+
+int Worker::connect()
+{
+  wsock = nl_socket_alloc();
+  if (!wsock)
+    return -ENOMEM;
+
+  int stat = genl_connect(wsock);
+  if (stat)
+    return stat;
+
+  wfamily = genl_ctrl_resolve(wsock, "ktf");
+  if (wfamily <= 0)
+    return -ENOENT;
+
+  nl_socket_set_buffer_size(wsock, KTF_RCVBUF_SIZE, 0);
+  nl_socket_modify_cb(wsock, NL_CB_VALID, NL_CB_CUSTOM, parse_cb, (result_sink*)this);
+  nl_socket_modify_cb(wsock, NL_CB_INVALID, NL_CB_CUSTOM, error_cb, NULL);
+  return 0;
+}
+
+int Worker::run(KernelTest* kt, const std::string& ctx, result_vec& results,
+		test_timing& timing)
+{
+  struct nl_msg *msg = run_msg(kt, ctx, wfamily);
+  uint64_t start = now_ns();
+  int err;
+
+  if (!msg)
+    return -ENOMEM;
+  err = send_run_msg(wsock, msg);
+  nlmsg_free(msg);
+  if (err < 0)
+    return err;
+
+  rv = &results;
+  tm = &timing;
+  err = recv_run_response(wsock);
+  rv = NULL;
+  tm = NULL;
+  if (err < 0)
+    return err;
+  record_duration(kt, ctx, start);
+  return 0;
+}
+
+void* Worker::main(void* arg)
+{
+  Worker* w = (Worker*)arg;
+
+  for (;;) {
+    pthread_mutex_lock(&prun.lock);
+    if (prun.next >= prun.sets.size()) {
+      pthread_mutex_unlock(&prun.lock);
+      break;
+    }
+    run_list& tests = prun.sets[prun.next++];
+    pthread_mutex_unlock(&prun.lock);
+
+    for (run_list::iterator it = tests.begin(); it != tests.end(); ++it) {
+      result_vec results;
+      test_timing timing;
+      int err = w->run(it->kt, it->ctx, results, timing);
+
+      log(KTF_DEBUG_V, "worker completed %s (status %d)\n", it->kt->name.c_str(), err);
+      pthread_mutex_lock(&prun.lock);
+      /* Failed runs are left to be retried synchronously by run_test: */
+      if (!err) {
+	it->kt->pending[it->ctx].swap(results);
+	if (timing.ns)
+	  it->kt->timing[it->ctx] = timing;
+      }
+      prun.queued.erase(test_id(it->kt, it->ctx));
+      pthread_cond_broadcast(&prun.cond);
+      pthread_mutex_unlock(&prun.lock);
+    }
+  }
+  return NULL;
+}
+
+int run_parallel(std::vector<run_list>& sets, size_t nworkers)
+{
+  int err = 0;
+
+  run_parallel_wait();
+  if (sets.empty())
+    return 0;
+
+  // Responses to asynchronously submitted tests must not be left behind:
+  err = run_wait();
+  if (err < 0)
+    return err;
+
+  prun.sets = sets;
+  prun.next = 0;
+  for (std::vector<run_list>::iterator it = prun.sets.begin(); it != prun.sets.end(); ++it)
+    for (run_list::iterator rit = it->begin(); rit != it->end(); ++rit)
+      prun.queued.insert(test_id(rit->kt, rit->ctx));
+
+  if (nworkers > sets.size())
+    nworkers = sets.size();
+
+  log(KTF_INFO, "Running %lu test sets on %lu workers\n", sets.size(), nworkers);
+  for (size_t i = 0; i < nworkers; i++) {
+    Worker* w = new Worker();
+    err = w->connect();
+    if (!err)
+      err = -pthread_create(&w->thread, NULL, Worker::main, w);
+    if (err) {
+      fprintf(stderr, "Failed to start parallel worker %lu (status %d)\n", i, err);
+      delete w;
+      break;
+    }
+    prun.workers.push_back(w);
+  }
+
+  if (prun.workers.empty()) {
+    /* No workers - leave it all to run_test: */
+    prun.queued.clear();
+    prun.sets.clear();
+    return err;
+  }
+  return 0;
+}
+
+void run_parallel_wait()
+{
+  for (std::vector<Worker*>::iterator it = prun.workers.begin(); it != prun.workers.end(); ++it) {
+    pthread_join((*it)->thread, NULL);
+    delete *it;
+  }
+  prun.workers.clear();
+  prun.sets.clear();
+  prun.queued.clear();
+}
+
+/* Run a list of kernel tests in a single request */
+int run_batch(run_list& tests)
+{
+  struct nl_msg *msg;
+  struct nlattr *blist, *entry;
+  struct nl_cb *cb, *sock_cb;
+  batch_sink sink(tests);
+  size_t sz = nla_total_size(sizeof(uint64_t));
+  int err, overruns = 0;
+
+  if (kernel_version < KTF_VERSION_BATCH)
+    return -EOPNOTSUPP;
+
+  // Responses to asynchronously submitted tests must not be mistaken for ours:
+  err = run_wait();
+  if (err < 0)
+    return err;
+
+  log(KTF_DEBUG_V, "START batch of %lu kernel tests\n", tests.size());
+
+  sz += 3 * nla_total_size(sizeof(uint32_t));
+  for (run_list::iterator it = tests.begin(); it != tests.end(); ++it)
+    sz += nla_total_size(nla_total_size(it->kt->setname.size() + 1) +
+			 nla_total_size(it->kt->testname.size() + 1) +
+			 nla_total_size(it->ctx.size() + 1));
+
+  msg = nlmsg_alloc_size(NLMSG_HDRLEN + GENL_HDRLEN + nla_total_size(sz));
+  if (!msg)
+    return -ENOMEM;
+  genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, family, 0, NLM_F_REQUEST,
+	      KTF_C_RUN, 1);
+  nla_put_u64(msg, KTF_A_VERSION, KTF_VERSION_LATEST);
+  put_timeout(msg);
+  put_repeat(msg);
+
+  blist = nla_nest_start(msg, KTF_A_BLIST);
+  for (run_list::iterator it = tests.begin(); it != tests.end(); ++it) {
+    entry = nla_nest_start(msg, KTF_A_TEST);
+    put_test(msg, it->kt, it->ctx);
+    nla_nest_end(msg, entry);
+  }
+  nla_nest_end(msg, blist);
+
+  // The kernel responds with a multipart message terminated by NLMSG_DONE,
+  // which also concludes the request, so don't ask for an ack:
+  nl_socket_disable_auto_ack(sock);
+  err = nl_send_auto_complete(sock, msg);
+  nl_socket_enable_auto_ack(sock);
+
+  // Free message
+  nlmsg_free(msg);
+  if (err < 0)
+    return err;
+
+  // Receive the results for all the tests into the pending lists:
+  sock_cb = nl_socket_get_cb(sock);
+  cb = nl_cb_clone(sock_cb);
+  nl_cb_put(sock_cb);
+  if (!cb)
+    return -ENOMEM;
+  nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, parse_cb, &sink);
+  while (rcvbuf_overrun(err = nl_recvmsgs(sock, cb), &overruns))
+    ;
+  nl_cb_put(cb);
+
+  log(KTF_DEBUG_V, "END   batch of %lu kernel tests (status %d)\n", tests.size(), err);
+  return err < 0 ? err : 0;
+}
+
+
+int run_matching(const std::string& filter)
+{
+  struct nl_msg *msg;
+  struct nl_cb *cb, *sock_cb;
+  match_sink sink;
+  std::string f = filter;
+  int err, overruns = 0;
+
+  if (kernel_version < KTF_VERSION_FILTER)
+    return -EOPNOTSUPP;
+
+  /* Hybrid tests need their user side, so leave them to run_test */
+  stringvec hybrid = kmgr().get_hybrid_names();
+  for (stringvec::iterator it = hybrid.begin(); it != hybrid.end(); ++it) {
+    f += f.find('-') == std::string::npos ? "-" : ":";
+    f += *it;
+  }
+
+  // Responses to asynchronously submitted tests must not be mistaken for ours:
+  err = run_wait();
+  if (err < 0)
+    return err;
+
+  log(KTF_DEBUG_V, "START run of kernel tests matching %s\n", f.c_str());
+
+  msg = nlmsg_alloc_size(NLMSG_HDRLEN + GENL_HDRLEN + nla_total_size(sizeof(uint64_t)) +
+			 3 * nla_total_size(sizeof(uint32_t)) + nla_total_size(f.size() + 1));
+  if (!msg)
+    return -ENOMEM;
+  genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, family, 0, NLM_F_REQUEST,
+	      KTF_C_RUN, 1);
+  nla_put_u64(msg, KTF_A_VERSION, KTF_VERSION_LATEST);
+  put_timeout(msg);
+  put_repeat(msg);
+  nla_put_string(msg, KTF_A_FILTER, f.c_str());
+
+  // As for a batch, the kernel responds with a multipart message terminated by NLMSG_DONE:
+  nl_socket_disable_auto_ack(sock);
+  err = nl_send_auto_complete(sock, msg);
+  nl_socket_enable_auto_ack(sock);
+  nlmsg_free(msg);
+  if (err < 0)
+    return err;
+
+  sock_cb = nl_socket_get_cb(sock);
+  cb = nl_cb_clone(sock_cb);
+  nl_cb_put(sock_cb);
+  if (!cb)
+    return -ENOMEM;
+  nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, parse_cb, &sink);
+  while (rcvbuf_overrun(err = nl_recvmsgs(sock, cb), &overruns))
+    ;
+  nl_cb_put(cb);
+
+  log(KTF_DEBUG_V, "END   run of %lu matching kernel tests (status %d)\n", sink.count, err);
+  return err < 0 ? err : 0;
 }
 
 
@@ -736,10 +2258,10 @@ void configure_context(const std::string context, const std::string type_name, v
 void configure_context_for_test(const std::string& setname, const std::string& testname,
 				const std::string& type_name, void *data, size_t data_sz)
 {
-  std::string context;
-  KernelTest *kt = kmgr().find_test(setname, testname, &context);
-  context_vector ct = kmgr().find_contexts(context, type_name);
+  const std::string* context;
+  KernelTest *kt = kmgr().find_test(setname.c_str(), testname.c_str(), &context);
   ASSERT_TRUE(kt) << " Could not find test " << setname << "." << testname;
+  context_vector ct = kmgr().find_contexts(*context, type_name);
   int handle_id = kt->handle_id;
   ASSERT_NE(handle_id, 0) << " test " << setname << "." << testname << " does not have a context";
 
@@ -761,6 +2283,7 @@ static nl_cb_action parse_one_set(std::string& setname,
   struct nlattr *nla;
   const char* msg;
   unsigned int handle_id = 0;
+  KernelTest* kt = NULL;
 
   nla_for_each_nested(nla, attr, rem) {
     switch (nla_type(nla)) {
@@ -769,9 +2292,18 @@ static nl_cb_action parse_one_set(std::string& setname,
       break;
     case KTF_A_STR:
       msg = nla_get_string(nla);
-      kmgr().add_test(setname, msg, handle_id);
+      kt = kmgr().add_test(setname, msg, handle_id);
+      if (catalog)
+	catalog->add(KTF_CAT_TEST, handle_id, 0, 0, { msg });
       handle_id = 0;
       break;
+    case KTF_A_TID:
+      if (kt) {
+	kt->id = nla_get_u32(nla);
+	if (catalog)
+	  catalog->set_last_id(kt->id);
+      }
+      break;
     default:
       fprintf(stderr,"parse_result: Unexpected attribute type %d\n", nla_type(nla));
       return NL_SKIP;
@@ -782,18 +2314,89 @@ static nl_cb_action parse_one_set(std::string& setname,
 
 
 
+/* Apply the changes to the kernel's catalog since our last QUERY */
+static nl_cb_action parse_changes(struct nlattr** attrs)
+{
+  struct nlattr *nla, *nla2;
+  int rem = 0, rem2 = 0;
+
+  if (attrs[KTF_A_STAT] || !attrs[KTF_A_GEN]) {
+    log(KTF_INFO, "Changes not available - a full query is needed\n");
+    qstate.stale = true;
+    return NL_OK;
+  }
+
+  if (attrs[KTF_A_CLIST]) {
+    nla_for_each_nested(nla, attrs[KTF_A_CLIST], rem) {
+      std::string setname, name;
+      unsigned int type = 0, handle_id = 0, id = 0;
+
+      nla_for_each_nested(nla2, nla, rem2) {
+	switch (nla_type(nla2)) {
+	case KTF_A_NUM:
+	  type = nla_get_u32(nla2);
+	  break;
+	case KTF_A_HID:
+	  handle_id = nla_get_u32(nla2);
+	  break;
+	case KTF_A_SNAM:
+	  setname = nla_get_string(nla2);
+	  break;
+	case KTF_A_STR:
+	  name = nla_get_string(nla2);
+	  break;
+	case KTF_A_TID:
+	case KTF_A_CID:
+	  id = nla_get_u32(nla2);
+	  break;
+	}
+      }
+
+      switch (type) {
+      case KTF_CHANGE_TEST_ADD:
+	kmgr().add_test(setname, name.c_str(), handle_id)->id = id;
+	break;
+      case KTF_CHANGE_TEST_DEL:
+	kmgr().remove_test(setname, name);
+	break;
+      case KTF_CHANGE_CTX_ADD:
+	kmgr().add_context_tests(handle_id, name);
+	kmgr().set_context_id(handle_id, name, id);
+	break;
+      case KTF_CHANGE_CTX_DEL:
+	kmgr().remove_context_tests(handle_id, name);
+	break;
+      default:
+	fprintf(stderr,"parse_changes: Unexpected change type %d\n", type);
+	qstate.stale = true;
+	return NL_SKIP;
+      }
+    }
+  }
+  catalog_gen = nla_get_u64(attrs[KTF_A_GEN]);
+  return NL_OK;
+}
+
 static int parse_query(struct nl_msg *msg, struct nlattr** attrs)
 {
   int alloc = 0, rem = 0, rem2 = 0, cfg_stat;
   nl_cb_action stat;
   std::string setname,testname,ctx;
+  bool multi = nlmsg_hdr(msg)->nlmsg_flags & NLM_F_MULTI;
+  bool first;
+
+  if (qstate.changes)
+    return parse_changes(attrs);
 
-  /* Version 0.1.0.0 did not report version back from the kernel */
-  uint64_t kernel_version = (KTF_VERSION_SET(MAJOR, 0ULL) | KTF_VERSION_SET(MINOR, 1ULL));
+  first = !qstate.parts++;
 
   if (attrs[KTF_A_VERSION])
     kernel_version = nla_get_u64(attrs[KTF_A_VERSION]);
 
+  /* With a dump, changes after the first part are also picked up by update_testsets */
+  if (first && attrs[KTF_A_GEN])
+    catalog_gen = nla_get_u64(attrs[KTF_A_GEN]);
+
   /* We only got here if we were compatible enough, log that we had differences */
   if (kernel_version != KTF_VERSION_LATEST)
   {
@@ -804,17 +2407,18 @@ static int parse_query(struct nl_msg *msg, struct nlattr** attrs)
     if (!is_compatible)
       note = "Error";
 
-    fprintf(stderr,
-	    "%s: KTF version difference - user lib %llu.%llu.%llu.%llu, kernel has %llu.%llu.%llu.%llu\n",
-	    note,
-	    KTF_VERSION(MAJOR, KTF_VERSION_LATEST),
-	    KTF_VERSION(MINOR, KTF_VERSION_LATEST),
-	    KTF_VERSION(MICRO, KTF_VERSION_LATEST),
-	    KTF_VERSION(BUILD, KTF_VERSION_LATEST),
-	    KTF_VERSION(MAJOR, kernel_version),
-	    KTF_VERSION(MINOR, kernel_version),
-	    KTF_VERSION(MICRO, kernel_version),
-	    KTF_VERSION(BUILD, kernel_version));
+    if (first)
+      fprintf(stderr,
+	      "%s: KTF version difference - user lib %llu.%llu.%llu.%llu, kernel has %llu.%llu.%llu.%llu\n",
+	      note,
+	      KTF_VERSION(MAJOR, KTF_VERSION_LATEST),
+	      KTF_VERSION(MINOR, KTF_VERSION_LATEST),
+	      KTF_VERSION(MICRO, KTF_VERSION_LATEST),
+	      KTF_VERSION(BUILD, KTF_VERSION_LATEST),
+	      KTF_VERSION(MAJOR, kernel_version),
+	      KTF_VERSION(MINOR, kernel_version),
+	      KTF_VERSION(MICRO, kernel_version),
+	      KTF_VERSION(BUILD, kernel_version));
     if (!is_compatible)
       return NL_SKIP;
   }
@@ -840,6 +2444,8 @@ static int parse_query(struct nl_msg *msg, struct nlattr** attrs)
 	  case KTF_A_FILE:
 	    type_name = nla_get_string(nla2);
 	    kmgr().add_ctype(handle_id, type_name);
+	    if (catalog)
+	      catalog->add(KTF_CAT_CTYPE, handle_id, 0, 0, { type_name });
 	    break;
 	  case KTF_A_STR:
 	    ctx = nla_get_string(nla2);
@@ -851,10 +2457,19 @@ static int parse_query(struct nl_msg *msg, struct nlattr** attrs)
 	  case KTF_A_STAT:
 	    cfg_stat = nla_get_u32(nla2);
 	    kmgr().add_configurable_context(ctx, type_name, handle_id, cfg_stat);
+	    if (catalog)
+	      catalog->add(KTF_CAT_CFG_CTX, handle_id, 0, cfg_stat, { ctx.c_str(), type_name });
+	    break;
+	  case KTF_A_CID:
+	    kmgr().set_context_id(handle_id, ctx, nla_get_u32(nla2));
+	    if (catalog)
+	      catalog->add(KTF_CAT_CTX_ID, handle_id, nla_get_u32(nla2), 0, { ctx.c_str() });
 	    break;
 	  }
 	}
 	/* Add this set of contexts for the handle_id */
+	if (catalog)
+	  catalog->add(KTF_CAT_CSET, handle_id, contexts);
 	kmgr().add_cset(handle_id, contexts);
 	handle_id = 0;
 	contexts.clear();
@@ -869,14 +2484,23 @@ static int parse_query(struct nl_msg *msg, struct nlattr** attrs)
   // Now we know enough about contexts and type_ids to actually configure
   // any contexts that needs to be configured, and this must be
   // done before the list of tests gets spanned out because addition
-  // of new contexts can lead to more tests being "generated":
+  // of new contexts can lead to more tests being "generated".
+  // With a dump, all handles are sent before the first part with test sets:
   //
-  if (do_context_configure)
-    do_context_configure();
+  if (!qstate.configured && (attrs[KTF_A_NUM] || !multi)) {
+    qstate.configured = true;
+    if (catalog)
+      catalog->add(KTF_CAT_CONFIGURE, 0, 0, 0, {});
+    if (do_context_configure)
+      do_context_configure();
+  }
 
   if (attrs[KTF_A_NUM]) {
     alloc = nla_get_u32(attrs[KTF_A_NUM]);
     log(KTF_DEBUG, "Kernel offers %d test sets:\n", alloc);
+  } else if (multi) {
+    /* A part of a dump with handles only */
+    return NL_OK;
   } else {
     fprintf(stderr,"No test set count in kernel response??\n");
     return -1;
@@ -890,6 +2514,8 @@ static int parse_query(struct nl_msg *msg, struct nlattr** attrs)
       switch (nla_type(nla)) {
       case KTF_A_STR:
 	setname = nla_get_string(nla);
+	if (catalog)
+	  catalog->add(KTF_CAT_SET, 0, 0, 0, { setname.c_str() });
 	break;
       case KTF_A_TEST:
 	stat = parse_one_set(setname, testname, nla);
@@ -908,11 +2534,123 @@ static int parse_query(struct nl_msg *msg, struct nlattr** attrs)
 }
 
 
-static enum nl_cb_action parse_result(struct nl_msg *msg, struct nlattr** attrs)
+/* Report a result immediately, or keep it in rv for later reporting */
+static void report_result(result_vec* rv, int result, const char* file, int line, const char* report)
+{
+  if (!rv)
+    handle_test(result, file, line, report);
+  else if (result >= 0)
+    rv->push_back(test_result(result, file, line, report));
+}
+
+static void parse_bench(struct nlattr* nest, bench_stats& bs)
+{
+  struct nlattr *nla;
+  int rem;
+
+  nla_for_each_nested(nla, nest, rem) {
+    switch (nla_type(nla)) {
+    case KTF_BENCH_A_ITERS:
+      bs.iters = nla_get_u64(nla);
+      break;
+    case KTF_BENCH_A_SAMPLES:
+      bs.samples = nla_get_u32(nla);
+      break;
+    case KTF_BENCH_A_MEAN:
+      bs.mean = nla_get_u64(nla);
+      break;
+    case KTF_BENCH_A_MEDIAN:
+      bs.median = nla_get_u64(nla);
+      break;
+    case KTF_BENCH_A_STDDEV:
+      bs.stddev = nla_get_u64(nla);
+      break;
+    case KTF_BENCH_A_MIN:
+      bs.min = nla_get_u64(nla);
+      break;
+    case KTF_BENCH_A_CYCLES:
+      bs.cycles = nla_get_u64(nla);
+      break;
+    }
+  }
+}
+
+static void parse_repeat(struct nlattr* nest, repeat_stats& rs)
+{
+  struct nlattr *nla;
+  int rem;
+
+  nla_for_each_nested(nla, nest, rem) {
+    switch (nla_type(nla)) {
+    case KTF_REPEAT_A_RUNS:
+      rs.runs = nla_get_u32(nla);
+      break;
+    case KTF_REPEAT_A_FAILED:
+      rs.failed_runs = nla_get_u32(nla);
+      break;
+    case KTF_REPEAT_A_ASSERTS:
+      rs.asserts = nla_get_u64(nla);
+      break;
+    case KTF_REPEAT_A_FAILURES:
+      rs.failures = nla_get_u64(nla);
+      break;
+    case KTF_REPEAT_A_FASTEST:
+      rs.fastest = nla_get_u64(nla);
+      break;
+    case KTF_REPEAT_A_MEAN:
+      rs.mean = nla_get_u64(nla);
+      break;
+    case KTF_REPEAT_A_SLOWEST:
+      rs.slowest = nla_get_u64(nla);
+      break;
+    }
+  }
+}
+
+static void parse_metrics(struct nlattr* mlist, std::vector<test_metric>& metrics)
+{
+  struct nlattr *nest, *nla;
+  int rem, mrem;
+
+  nla_for_each_nested(nest, mlist, rem) {
+    const char* name = NULL;
+    const char* unit = "";
+    int64_t value = 0;
+
+    if (nla_type(nest) != KTF_A_METRIC)
+      continue;
+    nla_for_each_nested(nla, nest, mrem) {
+      switch (nla_type(nla)) {
+      case KTF_METRIC_A_NAME:
+	name = nla_get_string(nla);
+	break;
+      case KTF_METRIC_A_VALUE:
+	value = (int64_t)nla_get_u64(nla);
+	break;
+      case KTF_METRIC_A_UNIT:
+	unit = nla_get_string(nla);
+	break;
+      }
+    }
+    if (name)
+      metrics.push_back(test_metric(name, value, unit));
+  }
+}
+
+static enum nl_cb_action parse_result(struct nl_msg *msg, struct nlattr** attrs, result_sink* sink)
 {
   int assert_cnt = 0, fail_cnt = 0;
-  int rem = 0, stat;
+  int rem = 0, stat = 0;
   const char *file = "no_file",*report = "no_report";
+  result_vec* rv = NULL;
+
+  if (sink) {
+    rv = sink->results(msg, attrs);
+    if (!rv) {
+      fprintf(stderr,"parse_result: Response for an unknown test\n");
+      return NL_SKIP;
+    }
+  }
 
   if (attrs[KTF_A_STAT]) {
     stat = nla_get_u32(attrs[KTF_A_STAT]);
@@ -929,7 +2667,7 @@ static enum nl_cb_action parse_result(struct nl_msg *msg, struct nlattr** attrs)
       switch (nla_type(nla)) {
       case KTF_A_STAT:
 	/* Flush previous test, if any */
-	handle_test(result,file,line,report);
+	report_result(rv,result,file,line,report);
 	result = nla_get_u32(nla);
 	/* Our own count and report since check does such a lousy
 	 * job in counting individual checks */
@@ -959,9 +2697,44 @@ static enum nl_cb_action parse_result(struct nl_msg *msg, struct nlattr** attrs)
       }
     }
     /* Handle last test */
-    handle_test(result,file,line,report);
+    report_result(rv,result,file,line,report);
+  }
+
+  /* The measurements of the test come with the final part of the response,
+   * and each of them may be present without the others:
+   */
+  if (attrs[KTF_A_DURATION] || attrs[KTF_A_BENCH] || attrs[KTF_A_MLIST] ||
+      attrs[KTF_A_RSTATS]) {
+    test_timing tm;
+    if (attrs[KTF_A_DURATION]) {
+      tm.ns = nla_get_u64(attrs[KTF_A_DURATION]);
+      log(KTF_DEBUG, "kernel test time %llu ns\n", (unsigned long long)tm.ns);
+    }
+    if (attrs[KTF_A_ILIST]) {
+      struct nlattr *nla;
+      nla_for_each_nested(nla, attrs[KTF_A_ILIST], rem)
+	if (nla_type(nla) == KTF_A_DURATION)
+	  tm.iter_ns.push_back(nla_get_u64(nla));
+    }
+    if (attrs[KTF_A_BENCH])
+      parse_bench(attrs[KTF_A_BENCH], tm.bench);
+    if (attrs[KTF_A_MLIST])
+      parse_metrics(attrs[KTF_A_MLIST], tm.metrics);
+    if (attrs[KTF_A_RSTATS])
+      parse_repeat(attrs[KTF_A_RSTATS], tm.repeat);
+    if (!sink) {
+      if (handle_timing)
+	handle_timing(tm);
+    } else {
+      test_timing* tp = sink->timing(msg, attrs);
+      if (tp)
+	*tp = tm;
+    }
   }
 
+  /* A test that did not complete in time has been abandoned by the kernel */
+  if (stat == -ETIMEDOUT)
+    report_result(rv, 0, "ktf", 0, "Test timed out and was abandoned by the kernel");
   return NL_OK;
 }
 
@@ -993,7 +2766,7 @@ static int parse_cb(struct nl_msg *msg, void *arg)
   case KTF_C_QUERY:
     return parse_query(msg, attrs);
   case KTF_C_RUN:
-    return parse_result(msg, attrs);
+    return parse_result(msg, attrs, (result_sink*)arg);
   case KTF_C_COV:
     return parse_cov_endis(msg, attrs);
   default:
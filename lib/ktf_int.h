@@ -13,6 +13,8 @@
 
 #ifndef KTF_INT_H
 #define KTF_INT_H
+#include <map>
+#include <stdint.h>
 #include <string>
 #include <vector>
 #include "ktf.h"
@@ -25,6 +27,84 @@ namespace ktf
   /* A callback handler to be called for each assertion result */
   typedef void (*test_handler)(int result,  const char* file, int line, const char* report);
 
+  /* An assertion result kept for later reporting via the test_handler */
+  struct test_result
+  {
+    test_result(int r, const char* f, int l, const char* rep)
+      : result(r), file(f), line(l), report(rep)
+    { }
+
+    int result;
+    std::string file;
+    int line;
+    std::string report;
+  };
+
+  typedef std::vector<test_result> result_vec;
+
+  /* Statistics of a benchmark test (see BENCH() in the kernel), times per operation in ps */
+  struct bench_stats
+  {
+    bench_stats() : iters(0), samples(0), mean(0), median(0), stddev(0), min(0), cycles(0)
+    { }
+
+    uint64_t iters;   /* Operations per sample */
+    uint32_t samples; /* Number of samples, 0 if not a benchmark */
+    uint64_t mean;
+    uint64_t median;
+    uint64_t stddev;
+    uint64_t min;
+    uint64_t cycles;  /* CPU cycles per 1000 operations, 0 if not available */
+  };
+
+  /* Summary of a test repeated in the kernel (see set_repeat), times in ns */
+  struct repeat_stats
+  {
+    repeat_stats() : runs(0), failed_runs(0), asserts(0), failures(0),
+		     fastest(0), mean(0), slowest(0)
+    { }
+
+    uint32_t runs;        /* 0 if not repeated */
+    uint32_t failed_runs;
+    uint64_t asserts;
+    uint64_t failures;
+    uint64_t fastest;
+    uint64_t mean;
+    uint64_t slowest;
+  };
+
+  /* A named metric reported by a kernel test with KTF_METRIC() */
+  struct test_metric
+  {
+    test_metric(const std::string& n, int64_t v, const std::string& u)
+      : name(n), value(v), unit(u)
+    { }
+
+    std::string name;
+    int64_t value;
+    std::string unit;
+  };
+
+  /* Time spent by the kernel running a test, in ns, in total and
+   * for each iteration of a test that loops over a range of values,
+   * along with any benchmark statistics, metrics reported by the test,
+   * and the summary of repeated runs:
+   */
+  struct test_timing
+  {
+    test_timing() : ns(0)
+    { }
+
+    uint64_t ns;
+    std::vector<uint64_t> iter_ns;
+    bench_stats bench;
+    std::vector<test_metric> metrics;
+    repeat_stats repeat;
+  };
+
+  /* A callback handler to be called with the kernel's timing of each test run */
+  typedef void (*timing_handler)(const test_timing& timing);
+
   class KernelTest
   {
   public:
@@ -35,22 +115,43 @@ namespace ktf
     std::string setname;
     std::string testname;
     unsigned int handle_id;
+    unsigned int id;  /* The kernel's ID for the test, or 0 if unknown */
     std::string name;
     size_t setnum;  /* This test belongs to this set in the kernel */
     size_t testnum; /* This test's index (test number) in the kernel */
     void* user_priv;  /* Optional private data for the test */
     size_t user_priv_sz; /* Size of the user_priv data if used */
+    unsigned int shm_id; /* ID of the shared memory region with user_priv, or 0 */
+    size_t shm_off;      /* Offset of user_priv within the shared memory region */
     test_cb* user_test;  /* Optional user level wrapper function for the kernel test */
     char* file;
     int line;
+    std::map<std::string, result_vec> pending; /* Results of batched runs, per context */
+    std::map<std::string, test_timing> timing; /* Kernel timing of batched runs, per context */
+  };
+
+  /* A kernel test with the context to run it in */
+  struct run_entry
+  {
+    run_entry(KernelTest* t, const std::string& c)
+      : kt(t), ctx(c)
+    { }
+
+    KernelTest* kt;
+    std::string ctx;
   };
 
+  typedef std::vector<run_entry> run_list;
+
   void *get_priv(KernelTest *kt, size_t priv_sz);
 
   // Set up connection to the kernel test driver:
   // @handle_test contains the test framework's handling code for test assertions */
   bool setup(test_handler handle_test);
 
+  /* Get the kernel's timing of each test run, if the kernel supports it */
+  void set_timing_handler(timing_handler handle_timing);
+
   void set_configurator(configurator c);
 
   // Parse command line args (call after gtest arg parsing)
@@ -59,10 +160,123 @@ namespace ktf
   /* Query kernel for available tests in index order */
   stringvec& query_testsets();
 
+  /* Update the tests and contexts from a previous query_testsets with only
+   * the changes in the kernel since then. Returns 0 on success, -ESTALE if
+   * the changes are no longer available and a full query is needed, or
+   * -EOPNOTSUPP if the kernel does not support queries for changes.
+   * Waits for any asynchronous or parallel runs in flight to complete first:
+   */
+  int update_testsets();
+
   stringvec get_testsets();
   std::string get_current_setname();
   stringvec get_test_names();
 
+  /* As find_test in ktf.h, but without copying the name of the context,
+   * which is kept for as long as the test exists:
+   */
+  KernelTest* find_test(const char* setname, const char* testname, const std::string** ctx);
+
+  /* Save the durations of the tests run to the history file, if enabled */
+  void save_durations();
+
+  /* Compare the kernel's timing of a run of test name with its baseline, if enabled,
+   * or record it as the new baseline if updating. Returns a description of any
+   * performance regression, or an empty string:
+   */
+  std::string check_baseline(const std::string& name, const test_timing& timing, bool failed);
+
+  /* Save new baselines to the baseline file, if updating */
+  void save_baseline();
+
+  /* Run a list of pure kernel tests in a single request to the kernel.
+   * Results are kept with each test until reported via run_test.
+   * Returns 0 on success or a negative error code if batching is not
+   * possible, in which case each test will instead be run individually:
+   */
+  int run_batch(run_list& tests);
+
+  /* Run all the pure kernel tests that match filter (see set_kernel_filter)
+   * in a single request, without the need to name each test.
+   * Results are kept with each test until reported via run_test.
+   * Returns 0 on success or a negative error code, such as -EOPNOTSUPP
+   * if the kernel does not support filters:
+   */
+  int run_matching(const std::string& filter);
+
+  /* Asynchronous execution: Submit a kernel test to run without waiting for it to complete.
+   * Any number of tests can be in flight at the same time. The results are kept with
+   * the test until reported via run_test, and done (if set) gets called upon completion
+   * with the status of the run, from within run_poll or run_wait.
+   * Returns a positive id of the run (the netlink sequence number) or a negative error code:
+   */
+  typedef void (*run_done)(KernelTest* kt, const std::string& ctx, int status, void* arg);
+  int run_async(KernelTest* kt, std::string ctx = "", run_done done = NULL, void* arg = NULL);
+
+  /* Receive the next response(s) to asynchronously submitted tests.
+   * Returns the number of runs still in flight or a negative error code:
+   */
+  int run_poll();
+
+  /* Wait for all asynchronously submitted tests to complete */
+  int run_wait();
+
+  /* Parallel execution: Run a list of test sets on up to nworkers threads in the background,
+   * each with its own connection to the kernel. The tests within a set are run in order
+   * by the same worker. The results are kept with each test until reported via run_test,
+   * which waits for the test to complete if it has not yet been run:
+   */
+  int run_parallel(std::vector<run_list>& sets, size_t nworkers);
+
+  /* Wait for all workers from run_parallel to finish */
+  void run_parallel_wait();
+
+  /* Results from a batched, asynchronous or parallel run are
+   * available for this test and context, or will be:
+   */
+  bool has_results(KernelTest* kt, const std::string& ctx);
+
+  /* Discard results kept for tests that gtest never got to,
+   * for instance because a test iteration ended early:
+   */
+  void clear_results();
+
+  /* An event about test execution published by the kernel */
+  struct test_event
+  {
+    test_event() : type(0), time(0), line(0), asserts(0), failures(0)
+    { }
+
+    int type;         /* enum ktf_event */
+    uint64_t time;    /* ns since the epoch */
+    std::string setname;
+    std::string testname;
+    std::string ctx;  /* Start and end of test: The context, if any */
+    std::string file; /* Failed assertion: Location and report */
+    int line;
+    std::string report;
+    unsigned int asserts;  /* End of test: Number of assertions */
+    unsigned int failures; /* End of test: Number of failed assertions */
+  };
+
+  typedef void (*event_handler)(const test_event& ev, void* arg);
+
+  /* Subscribe to events about all test execution on the host, also tests
+   * run by other programs or via debugfs. Returns a file descriptor to wait on
+   * for events, or a negative error code:
+   */
+  int event_subscribe(event_handler handler, void* arg);
+
+  /* Receive events and call the handler for each of them - blocks if none are available */
+  int event_poll();
+
+  void event_unsubscribe();
+
+  /* Whether err from receiving netlink messages is a receive buffer overrun,
+   * as opposed to running out of memory, which libnl3 reports the same way:
+   */
+  bool nl_rcvbuf_overrun(int err);
+
   /* "private" - only run from gtest framework */
   void run_test(KernelTest* test, std::string& ctx);
 } // end namespace ktf
@@ -55,6 +55,7 @@ public:
 
   virtual void TestBody();
 private:
+  void run_ahead();
   ktf::KernelTest* ukt;
   std::string ctx;
   friend void setup(configurator c);
@@ -99,21 +100,89 @@ public:
 testing::internal::ParamGenerator<Kernel::ParamType> gtest_query_tests(void);
 std::string gtest_name_from_info(const testing::TestParamInfo<Kernel::ParamType>&);
 void gtest_handle_test(int result,  const char* file, int line, const char* report);
+void gtest_handle_timing(const test_timing& timing);
 
 #ifndef INSTANTIATE_TEST_SUITE_P
 /* This rename happens in Googletest commit 3a460a26b7.
  * Make sure we compile both before and after it:
  */
 #define AddTestSuiteInstantiation AddTestCaseInstantiation
+#define current_test_suite current_test_case
+#define TestSuite TestCase
+#define GetTestSuite GetTestCase
+#define total_test_suite_count total_test_case_count
 #endif
 
+/* Results kept for tests gtest never got to, for instance due to --gtest_fail_fast,
+ * must not be reported for the same tests in a later iteration:
+ */
+class ResultsListener : public ::testing::EmptyTestEventListener
+{
+public:
+  virtual void OnTestIterationStart(const ::testing::UnitTest& ut, int iteration)
+  {
+    clear_results();
+  }
+
+  virtual void OnTestIterationEnd(const ::testing::UnitTest& ut, int iteration)
+  {
+    clear_results();
+  }
+};
+
+/* Start parallel execution of the selected kernel test sets
+ * once gtest has figured out which tests to run:
+ */
+class ParallelListener : public ::testing::EmptyTestEventListener
+{
+public:
+  virtual void OnTestIterationStart(const ::testing::UnitTest& ut, int iteration);
+  virtual void OnTestIterationEnd(const ::testing::UnitTest& ut, int iteration);
+};
+
+/* Run all the selected pure kernel tests in a single request,
+ * if they are exactly those matching the kernel filter:
+ */
+class MatchListener : public ::testing::EmptyTestEventListener
+{
+public:
+  virtual void OnTestIterationStart(const ::testing::UnitTest& ut, int iteration);
+};
+
+/* Keep the durations of this run for future sharding */
+class HistoryListener : public ::testing::EmptyTestEventListener
+{
+public:
+  virtual void OnTestProgramEnd(const ::testing::UnitTest& ut)
+  {
+    save_durations();
+  }
+};
+
+/* Save new baselines for performance regression checks */
+class BaselineListener : public ::testing::EmptyTestEventListener
+{
+public:
+  virtual void OnTestProgramEnd(const ::testing::UnitTest& ut)
+  {
+    save_baseline();
+  }
+};
+
 int Kernel::AddToRegistry()
 {
   if (!ktf::setup(ktf::gtest_handle_test)) return 1;
+  ktf::set_timing_handler(ktf::gtest_handle_timing);
 
   /* Run query against kernel to figure out which tests that exists: */
   stringvec& t = ktf::query_testsets();
 
+  /* Let the kernel filter also select the tests for gtest, unless overridden
+   * by --gtest_filter or GTEST_FILTER:
+   */
+  if (!get_kernel_filter().empty() && ::testing::GTEST_FLAG(filter) == "*")
+    ::testing::GTEST_FLAG(filter) = get_kernel_filter();
+
   ::testing::internal::ParameterizedTestCaseInfo<Kernel>* tci =
       ::testing::UnitTest::GetInstance()->parameterized_test_registry()
       .GetTestCasePatternHolder<Kernel>( "Kernel", ::testing::internal::CodeLocation("", 0));
@@ -129,6 +198,15 @@ int Kernel::AddToRegistry()
   }
 
   tci->AddTestSuiteInstantiation("", &gtest_query_tests, &gtest_name_from_info, NULL, 0);
+
+  /* Appended first, so that it clears the results before any other listener runs tests
+   * at the start of an iteration, and after the workers are done at the end of it:
+   */
+  ::testing::UnitTest::GetInstance()->listeners().Append(new ResultsListener());
+  ::testing::UnitTest::GetInstance()->listeners().Append(new ParallelListener());
+  ::testing::UnitTest::GetInstance()->listeners().Append(new MatchListener());
+  ::testing::UnitTest::GetInstance()->listeners().Append(new HistoryListener());
+  ::testing::UnitTest::GetInstance()->listeners().Append(new BaselineListener());
   return 0;
 }
 
@@ -141,10 +219,120 @@ void setup(configurator c)
 
 void Kernel::TestBody()
 {
+  if (get_batch_size() > 1 && !ukt->user_test && !has_results(ukt, ctx))
+    run_ahead();
   run_test(ukt, ctx);
 }
 
 
+/* Run this test along with the following pure kernel tests in the
+ * same test suite as a single batch, or pipelined if the kernel does not
+ * support batches. The results are kept with each test until gtest gets to it:
+ */
+void Kernel::run_ahead()
+{
+  const ::testing::TestSuite* ts = ::testing::UnitTest::GetInstance()->current_test_suite();
+  const ::testing::TestInfo* cur = ::testing::UnitTest::GetInstance()->current_test_info();
+  run_list tests;
+  int i = 0;
+
+  if (!ts || !cur)
+    return;
+
+  /* Find the current test's position within the test suite: */
+  for (; i < ts->total_test_count(); i++)
+    if (ts->GetTestInfo(i) == cur)
+      break;
+
+  for (; i < ts->total_test_count() && tests.size() < get_batch_size(); i++) {
+    const ::testing::TestInfo* ti = ts->GetTestInfo(i);
+    const std::string* tctx;
+    if (!ti->should_run())
+      continue;
+    KernelTest* kt = find_test(ts->name(), ti->name(), &tctx);
+    if (!kt || kt->user_test)
+      break;
+    tests.push_back(run_entry(kt, *tctx));
+  }
+
+  if (tests.size() > 1 && run_batch(tests) == -EOPNOTSUPP) {
+    /* The kernel does not support batches - pipeline the requests instead: */
+    for (run_list::iterator it = tests.begin(); it != tests.end(); ++it)
+      if (run_async(it->kt, it->ctx) < 0)
+	break;
+    run_wait();
+  }
+}
+
+
+void ParallelListener::OnTestIterationStart(const ::testing::UnitTest& ut, int iteration)
+{
+  std::vector<run_list> sets;
+
+  if (get_workers() <= 1)
+    return;
+
+  for (int i = 0; i < ut.total_test_suite_count(); i++) {
+    const ::testing::TestSuite* ts = ut.GetTestSuite(i);
+    run_list tests;
+    bool hybrid = false;
+
+    if (!ts->should_run())
+      continue;
+    for (int j = 0; j < ts->total_test_count(); j++) {
+      const ::testing::TestInfo* ti = ts->GetTestInfo(j);
+      const std::string* ctx;
+      if (!ti->should_run())
+	continue;
+      KernelTest* kt = find_test(ts->name(), ti->name(), &ctx);
+      if (!kt)
+	continue;
+      /* Hybrid tests run from gtest, so leave their sets to gtest entirely: */
+      if (kt->user_test) {
+	hybrid = true;
+	break;
+      }
+      tests.push_back(run_entry(kt, *ctx));
+    }
+    if (!hybrid && !tests.empty())
+      sets.push_back(tests);
+  }
+
+  run_parallel(sets, get_workers());
+}
+
+void ParallelListener::OnTestIterationEnd(const ::testing::UnitTest& ut, int iteration)
+{
+  run_parallel_wait();
+}
+
+
+void MatchListener::OnTestIterationStart(const ::testing::UnitTest& ut, int iteration)
+{
+  if (get_kernel_filter().empty() || get_workers() > 1)
+    return;
+
+  /* Tests gtest has excluded, for instance by a different filter or by sharding,
+   * must not run, so then leave it to gtest to run the tests one by one:
+   */
+  for (int i = 0; i < ut.total_test_suite_count(); i++) {
+    const ::testing::TestSuite* ts = ut.GetTestSuite(i);
+    for (int j = 0; j < ts->total_test_count(); j++) {
+      const ::testing::TestInfo* ti = ts->GetTestInfo(j);
+      const std::string* ctx;
+      KernelTest* kt = find_test(ts->name(), ti->name(), &ctx);
+      if (kt && !kt->user_test && !ti->should_run())
+	return;
+    }
+  }
+
+  int err = run_matching(get_kernel_filter());
+  if (err)
+    log(KTF_INFO, "Running the matching tests in one request failed (status %d)"
+	" - running them one by one\n", err);
+}
+
+
 void gtest_handle_test(int result,  const char* file, int line, const char* report)
 {
   if (result >= 0) {
@@ -167,6 +355,63 @@ void gtest_handle_test(int result,  const char* file, int line, const char* repo
   }
 }
 
+/* Record the kernel's own measurement of the time spent in the test,
+ * and any benchmark statistics, metrics and summary of repeated runs,
+ * to be part of the XML/JSON output:
+ */
+void gtest_handle_timing(const test_timing& timing)
+{
+  ::testing::Test::RecordProperty("kernel_ns", std::to_string(timing.ns));
+  if (!timing.iter_ns.empty()) {
+    std::string iter_ns;
+    for (size_t i = 0; i < timing.iter_ns.size(); i++) {
+      if (i)
+	iter_ns += ",";
+      iter_ns += std::to_string(timing.iter_ns[i]);
+    }
+    ::testing::Test::RecordProperty("kernel_iter_ns", iter_ns);
+  }
+
+  const bench_stats& bs = timing.bench;
+  if (bs.samples) {
+    ::testing::Test::RecordProperty("bench_iterations", std::to_string(bs.iters));
+    ::testing::Test::RecordProperty("bench_samples", std::to_string(bs.samples));
+    ::testing::Test::RecordProperty("bench_mean_ps", std::to_string(bs.mean));
+    ::testing::Test::RecordProperty("bench_median_ps", std::to_string(bs.median));
+    ::testing::Test::RecordProperty("bench_stddev_ps", std::to_string(bs.stddev));
+    ::testing::Test::RecordProperty("bench_min_ps", std::to_string(bs.min));
+    if (bs.cycles)
+      ::testing::Test::RecordProperty("bench_cycles_x1000", std::to_string(bs.cycles));
+  }
+
+  for (size_t i = 0; i < timing.metrics.size(); i++) {
+    const test_metric& m = timing.metrics[i];
+    ::testing::Test::RecordProperty("metric_" + m.name, std::to_string(m.value));
+    if (!m.unit.empty())
+      ::testing::Test::RecordProperty("metric_" + m.name + "_unit", m.unit);
+  }
+
+  const repeat_stats& rs = timing.repeat;
+  if (rs.runs) {
+    ::testing::Test::RecordProperty("repeat_runs", std::to_string(rs.runs));
+    ::testing::Test::RecordProperty("repeat_failed_runs", std::to_string(rs.failed_runs));
+    ::testing::Test::RecordProperty("repeat_asserts", std::to_string(rs.asserts));
+    ::testing::Test::RecordProperty("repeat_failures", std::to_string(rs.failures));
+    ::testing::Test::RecordProperty("repeat_fastest_ns", std::to_string(rs.fastest));
+    ::testing::Test::RecordProperty("repeat_mean_ns", std::to_string(rs.mean));
+    ::testing::Test::RecordProperty("repeat_slowest_ns", std::to_string(rs.slowest));
+  }
+
+  /* Fail the test if it has become slower than its baseline */
+  const ::testing::TestInfo* ti = ::testing::UnitTest::GetInstance()->current_test_info();
+  if (ti) {
+    std::string name = std::string(ti->test_case_name()) + "." + ti->name();
+    std::string regression = check_baseline(name, timing, ::testing::Test::HasFailure());
+    if (!regression.empty())
+      ADD_FAILURE() << name << ": " << regression;
+  }
+}
+
 testing::internal::ParamGenerator<Kernel::ParamType> gtest_query_tests()
 {
   return testing::ValuesIn(ktf::get_test_names());
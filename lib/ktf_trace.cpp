@@ -0,0 +1,167 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktf_trace.cpp: Per thread rings of binary log records, saved to a file at exit
+ */
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+#include "ktf_trace.h"
+
+bool ktf_trace_enabled = false;
+
+namespace
+{
+
+/* Each ring has a single writer, its thread, so the only synchronization
+ * needed is for the saving at exit to see complete records, and to not
+ * save a record while it is being written:
+ */
+struct trace_ring
+{
+  uint32_t tid;
+  std::atomic<uint64_t> head;
+  std::atomic<bool> busy;  /* The thread is writing a record */
+  struct ktf_trace_record rec[KTF_TRACE_RECORDS];
+};
+
+std::string trace_path;
+std::mutex rings_lock;
+
+/* Set when the trace is saved - no more records are written after that */
+std::atomic<bool> stopped(false);
+
+/* Rings are kept after their thread exits, to be part of the saved trace */
+std::vector<trace_ring*> rings;
+thread_local trace_ring* ring = NULL;
+
+trace_ring* ring_alloc()
+{
+  trace_ring* r = (trace_ring*)calloc(1, sizeof(trace_ring));
+
+  if (!r)
+    return NULL;
+  r->tid = syscall(SYS_gettid);
+  r->head.store(0, std::memory_order_relaxed);
+  r->busy.store(false, std::memory_order_relaxed);
+  std::lock_guard<std::mutex> lg(rings_lock);
+  rings.push_back(r);
+  return r;
+}
+
+bool put(FILE* f, const void* p, size_t sz)
+{
+  return fwrite(p, sz, 1, f) == 1;
+}
+
+int trace_save(const char* path)
+{
+  struct ktf_trace_header h;
+  std::set<uint64_t> strs;
+  bool ok;
+  FILE* f;
+
+  /* Other threads may still be logging, so stop them and wait
+   * for any records being written to be complete:
+   */
+  stopped.store(true);
+  std::lock_guard<std::mutex> lg(rings_lock);
+  for (std::vector<trace_ring*>::iterator it = rings.begin(); it != rings.end(); ++it)
+    while ((*it)->busy.load())
+      sched_yield();
+
+  f = fopen(path, "w");
+  if (!f)
+    return -errno;
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, KTF_TRACE_MAGIC, sizeof(h.magic));
+  h.record_size = sizeof(struct ktf_trace_record);
+  h.nrings = rings.size();
+  ok = put(f, &h, sizeof(h));
+
+  for (std::vector<trace_ring*>::iterator it = rings.begin(); ok && it != rings.end(); ++it) {
+    trace_ring* r = *it;
+    uint64_t head = r->head.load(std::memory_order_acquire);
+    uint64_t i = head > KTF_TRACE_RECORDS ? head - KTF_TRACE_RECORDS : 0;
+    uint32_t n = head - i;
+
+    ok = put(f, &r->tid, sizeof(r->tid)) && put(f, &n, sizeof(n));
+    for (; ok && i < head; i++) {
+      struct ktf_trace_record* rec = &r->rec[i % KTF_TRACE_RECORDS];
+      strs.insert(rec->fmt);
+      strs.insert(rec->func);
+      ok = put(f, rec, sizeof(*rec));
+    }
+  }
+
+  uint32_t nstrs = strs.size();
+  ok = ok && put(f, &nstrs, sizeof(nstrs));
+  for (std::set<uint64_t>::iterator it = strs.begin(); ok && it != strs.end(); ++it) {
+    const char* s = (const char*)(uintptr_t)*it;
+    uint32_t len = strlen(s);
+    ok = put(f, &*it, sizeof(*it)) && put(f, &len, sizeof(len)) && put(f, s, len);
+  }
+
+  if (fclose(f) || !ok)
+    return errno ? -errno : -EIO;
+  return 0;
+}
+
+void trace_exit()
+{
+  int err = trace_save(trace_path.c_str());
+
+  if (err)
+    fprintf(stderr, "Failed to save ktf trace to %s (status %d)\n", trace_path.c_str(), err);
+}
+
+} // end anonymous namespace
+
+void ktf_trace_init(const char* path)
+{
+  if (!trace_path.empty())
+    return;
+  trace_path = path;
+  atexit(trace_exit);
+  ktf_trace_enabled = true;
+}
+
+struct ktf_trace_record* ktf_trace_next()
+{
+  struct ktf_trace_record* r;
+  struct timespec ts;
+
+  if (!ring && !(ring = ring_alloc()))
+    return NULL;
+
+  /* Pairs with trace_save() setting stopped before checking busy */
+  ring->busy.store(true);
+  if (stopped.load()) {
+    ring->busy.store(false, std::memory_order_release);
+    return NULL;
+  }
+
+  r = &ring->rec[ring->head.load(std::memory_order_relaxed) % KTF_TRACE_RECORDS];
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  r->ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  r->nargs = 0;
+  r->slen = 0;
+  return r;
+}
+
+void ktf_trace_commit()
+{
+  ring->head.store(ring->head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  ring->busy.store(false, std::memory_order_release);
+}
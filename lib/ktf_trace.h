@@ -0,0 +1,166 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktf_trace.h: Low overhead binary tracing of the user mode debug log.
+ *
+ * Enabled by setting the environment variable KTF_TRACE to the path of a file.
+ * Instead of formatting log() messages as they happen, fixed size records are
+ * then written to a ring per thread, and the rings are saved to the file at exit.
+ * Use ktftrace to decode the file into text.
+ */
+
+#ifndef _KTF_TRACE_H
+#define _KTF_TRACE_H
+#if __cplusplus < 201103L
+#error "KTF requires C++11 (-std=c++11)"
+#endif
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+
+#define KTF_TRACE_MAGIC "KTFTRC1"
+#define KTF_TRACE_RECORDS 8192   /* Records in each thread's ring */
+#define KTF_TRACE_ARGS 8         /* Max number of arguments to a log() call */
+#define KTF_TRACE_STR 64         /* Space for copies of string arguments */
+#define KTF_TRACE_NULL (~0ULL)   /* A string argument that was NULL */
+
+/* A log() call. The format string and the function name are recorded by address,
+ * and resolved when the trace is saved. The address of the format string identifies
+ * the event. String arguments (for a %s conversion) are copied, possibly truncated,
+ * into str, and their argument is the offset of the copy:
+ */
+struct ktf_trace_record
+{
+  uint64_t ns;      /* CLOCK_MONOTONIC time */
+  uint64_t fmt;
+  uint64_t func;
+  uint32_t nargs;
+  uint32_t slen;    /* Bytes of str in use */
+  uint64_t args[KTF_TRACE_ARGS];
+  char str[KTF_TRACE_STR];
+};
+
+/* The trace file starts with this header, followed by for each thread, a tid and
+ * the number of records, and the records, oldest first. Then follows the number of
+ * strings and the strings, each an address, a length and the characters:
+ */
+struct ktf_trace_header
+{
+  char magic[8];
+  uint32_t record_size;
+  uint32_t nrings;
+};
+
+extern bool ktf_trace_enabled;
+
+/* Set up tracing to file path, to be saved at exit */
+void ktf_trace_init(const char* path);
+
+/* Get the next record in the calling thread's ring, with ns set, or NULL */
+struct ktf_trace_record* ktf_trace_next();
+
+/* Make the record returned by ktf_trace_next() part of the trace */
+void ktf_trace_commit();
+
+/* Return the conversion character for the next argument of the format at *fmt,
+ * and advance *fmt past it. Conversion specs are parsed as by ktftrace:
+ */
+static inline char ktf_trace_conv(const char** fmt)
+{
+  const char* p = *fmt;
+
+  while (*p) {
+    if (*p++ != '%')
+      continue;
+    if (*p == '%') {
+      p++;
+      continue;
+    }
+    while (*p && strchr("#- +'.0123456789hlLqjzt", *p))
+      p++;
+    if (*p) {
+      *fmt = p + 1;
+      return *p;
+    }
+  }
+  *fmt = p;
+  return '\0';
+}
+
+template <typename T>
+static inline void ktf_trace_arg(struct ktf_trace_record* r, char conv, T* p)
+{
+  r->args[r->nargs++] = (uint64_t)(uintptr_t)p;
+}
+
+/* Only copy a string for %s - for instance %p must not dereference the pointer */
+static inline void ktf_trace_arg(struct ktf_trace_record* r, char conv, const char* s)
+{
+  size_t len, room = KTF_TRACE_STR - r->slen;
+
+  if (conv != 's') {
+    ktf_trace_arg<const char>(r, conv, s);
+    return;
+  }
+  if (!s) {
+    r->args[r->nargs++] = KTF_TRACE_NULL;
+    return;
+  }
+  r->args[r->nargs++] = r->slen;
+  if (!room)
+    return;
+  len = strnlen(s, room - 1);
+  memcpy(r->str + r->slen, s, len);
+  r->str[r->slen + len] = '\0';
+  r->slen += len + 1;
+}
+
+static inline void ktf_trace_arg(struct ktf_trace_record* r, char conv, char* s)
+{
+  ktf_trace_arg(r, conv, (const char*)s);
+}
+
+template <typename T>
+static inline typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type
+ktf_trace_arg(struct ktf_trace_record* r, char conv, T v)
+{
+  r->args[r->nargs++] = (uint64_t)v;
+}
+
+template <typename T>
+static inline typename std::enable_if<std::is_floating_point<T>::value>::type
+ktf_trace_arg(struct ktf_trace_record* r, char conv, T v)
+{
+  double d = v;
+  memcpy(&r->args[r->nargs++], &d, sizeof(d));
+}
+
+static inline void ktf_trace_args(struct ktf_trace_record* r, const char* fmt)
+{
+}
+
+template <typename T, typename... Rest>
+static inline void ktf_trace_args(struct ktf_trace_record* r, const char* fmt, T v, Rest... rest)
+{
+  char conv = ktf_trace_conv(&fmt);
+
+  if (r->nargs < KTF_TRACE_ARGS)
+    ktf_trace_arg(r, conv, v);
+  ktf_trace_args(r, fmt, rest...);
+}
+
+template <typename... Args>
+static inline void ktf_trace(const char* func, const char* fmt, Args... args)
+{
+  struct ktf_trace_record* r = ktf_trace_next();
+
+  if (!r)
+    return;
+  r->fmt = (uintptr_t)fmt;
+  r->func = (uintptr_t)func;
+  ktf_trace_args(r, fmt, args...);
+  ktf_trace_commit();
+}
+
+#endif
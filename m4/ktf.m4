@@ -42,12 +42,11 @@ AC_ARG_VAR([KVER],[Kernel devel version to build against])
 AC_DEFUN([AC_CHECK_CXXFLAGS],
 [
 AC_LANG_PUSH([C++])
-dnl Enable C++11 if possible. If it cannot be enabled,
-dnl googletest would have had to be compiled without it too, implying
-dnl an older version where the flag was named c++0x, if existing at all:
+dnl KTF and its installed headers use C++11 features
+dnl (unordered_map, thread_local, variadic templates):
 AX_CHECK_COMPILE_FLAG([-std=c++11],
 	[KTF_CXXFLAGS="-std=c++11 $KTF_CXXFLAGS"],
-	[KTF_CXXFLAGS="-std=c++0x $KTF_CXXFLAGS"])
+	[AC_MSG_ERROR([A C++ compiler with C++11 support (-std=c++11) is required])])
 AC_LANG_POP([C++])
 ])
 
@@ -122,7 +121,7 @@ KTF_CFLAGS="-I$ktf_src/lib $GTEST_CFLAGS"
 KTF_CXXFLAGS="-I$ktf_src/lib $GTEST_CFLAGS"
 KTF_LIBS="-L$ktf_build/lib -lktf $GTEST_LIBS $NETLINK_LIBS"
 
-dnl optionally set the -std=c++11 flag for c++ (see def, above):
+dnl set the required -std=c++11 flag for c++ (see def, above):
 AC_CHECK_CXXFLAGS
 
 AC_ARG_VAR([KTF_CFLAGS],[Include files options needed for C user space program clients])
@@ -262,7 +261,7 @@ KTF_CFLAGS="-I$srcdir/lib $GTEST_CFLAGS"
 KTF_CXXFLAGS="-I$srcdir/lib $GTEST_CFLAGS"
 KTF_LIBS="-L$(pwd)/lib -lktf $GTEST_LIBS $NETLINK_LIBS"
 
-dnl optionally set the -std=c++11 flag for c++ (see def, above):
+dnl set the required -std=c++11 flag for c++ (see def, above):
 AC_CHECK_CXXFLAGS
 
 AC_ARG_VAR([KTF_CFLAGS],[Include files options needed for C user space program clients])
@@ -27,7 +27,46 @@ TEST(selftest, msg)
 	EXPECT_LONG_EQ(data->val, HYBRID_MSG_VAL);
 }
 
+/* Large out-of-band data passed in place via memory shared with user space */
+TEST(selftest, shm)
+{
+	unsigned char *buf = self->data;
+	unsigned long i;
+
+	ASSERT_TRUE(buf);
+	ASSERT_LONG_EQ(self->data_sz, HYBRID_SHM_SIZE);
+	for (i = 0; i < HYBRID_SHM_SIZE; i++)
+		if (buf[i] != HYBRID_SHM_PATTERN(i))
+			break;
+	EXPECT_LONG_EQ(i, HYBRID_SHM_SIZE);
+}
+
+/* A test that hangs in a killable wait. Run with a timeout, the kernel abandons it
+ * and sends it a SIGKILL, which ends the wait early:
+ */
+TEST(selftest, timeout)
+{
+	long left = schedule_timeout_killable(msecs_to_jiffies(HYBRID_TIMEOUT_SLEEP_MS));
+
+	tlog(T_DEBUG, "selftest.timeout: woke up with %u ms left", jiffies_to_msecs(left));
+}
+
+/* Fails HYBRID_FAILURES times at one location and once at another, all in the same
+ * iteration. The user side checks that every failure is reported with its location:
+ */
+TEST(selftest, many_failures)
+{
+	int i;
+
+	for (i = 0; i < HYBRID_FAILURES; i++)
+		EXPECT_INT_EQ(i, -1);
+	EXPECT_TRUE(false);
+}
+
 void add_hybrid_tests(void)
 {
 	ADD_TEST(msg);
+	ADD_TEST(shm);
+	ADD_TEST(timeout);
+	ADD_TEST(many_failures);
 }
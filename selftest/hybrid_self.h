@@ -23,4 +23,21 @@ struct hybrid_self_params
 #define HYBRID_MSG "a little test string"
 #define HYBRID_MSG_VAL  0xffUL
 
+/* Constants for the selftest.shm test: A buffer too large for a netlink attribute,
+ * filled with a pattern that the kernel side verifies:
+ */
+#define HYBRID_SHM_SIZE (1UL << 20)
+#define HYBRID_SHM_PATTERN(__i) ((unsigned char)((__i) % 251))
+
+/* Constants for the selftest.timeout test: The user side runs it with a timeout
+ * much shorter than the time it sleeps for, if not interrupted:
+ */
+#define HYBRID_TIMEOUT_MS 200
+#define HYBRID_TIMEOUT_SLEEP_MS 5000
+
+/* Constants for the selftest.many_failures test: More failures in one iteration
+ * than the kernel has room to record the reports of:
+ */
+#define HYBRID_FAILURES 40
+
 #endif
@@ -5,8 +5,10 @@
  * self.c: Some simple self tests for KTF
  */
 #include <linux/module.h>
+#include <linux/delay.h>
 #include <linux/mm_types.h>
 #include <linux/slab.h>
+#include <linux/hash.h>
 #include "ktf.h"
 #include "ktf_map.h"
 #include "ktf_cov.h"
@@ -295,6 +297,39 @@ TEST(selftest, wrongversion)
 	EXPECT_TRUE(false);
 }
 
+/* The user side (user/hybrid.cpp) checks that the metrics arrive */
+TEST(selftest, metric)
+{
+	int answer = 6 * 7;
+
+	EXPECT_INT_EQ(answer, 42);
+	KTF_METRIC(self, "answer", answer, "");
+	KTF_METRIC(self, "latency", -1, "ns");
+	/* Replaces the previous value */
+	KTF_METRIC(self, "latency", 1000, "ns");
+}
+
+BENCH(selftest, bench_hash)
+{
+	u32 h = hash_32(_value, 16);
+
+	ktf_bench_keep(h);
+}
+
+/* An operation slow enough for a single one to fill a sample, that takes
+ * 10 and 20 ms in turn, for a standard deviation of about 5 ms (5e9 ps).
+ * The user side (user/hybrid.cpp) checks the statistics:
+ */
+BENCH(selftest, bench_slow)
+{
+	static unsigned int calls;
+
+	if (calls++ & 1)
+		usleep_range(20000, 20100);
+	else
+		usleep_range(10000, 10100);
+}
+
 static void add_map_tests(void)
 {
 	ADD_TEST(dummy);
@@ -304,6 +339,9 @@ static void add_map_tests(void)
 	ADD_TEST_TO(dual_handle, mapcmpfunc);
 	ADD_TEST(map_keyoverflow);
 	ADD_TEST(map_customkey);
+	ADD_TEST(bench_hash);
+	ADD_TEST(bench_slow);
+	ADD_TEST(metric);
 
 	terr("-- version check test: --");
 	/* This should fail */
@@ -575,7 +613,7 @@ TEST(selftest, thread)
 	for (i = 0; i < NUM_TEST_THREADS; i++)
 		KTF_THREAD_WAIT_COMPLETED(&test_threads[i]);
 
-	assertions = (int)ktf_get_assertion_count();
+	assertions = (int)ktf_get_run_assertion_count(self);
 
 	/* Verify assertion in thread */
 	ASSERT_INT_EQ(assertions, NUM_TEST_THREADS);
@@ -612,6 +650,54 @@ static void add_symbol_tests(void)
 	ADD_TEST(symbol);
 }
 
+/* Test the kernel side matching of gtest style filters (see ktf::set_kernel_filter) */
+TEST(selftest, filter)
+{
+	/* No filter or an empty one matches all tests */
+	EXPECT_TRUE(ktf_filter_match(NULL, "selftest.dummy"));
+	EXPECT_TRUE(ktf_filter_match("", "selftest.dummy"));
+
+	/* '*' matches any string, also an empty one */
+	EXPECT_TRUE(ktf_filter_match("*", "selftest.dummy"));
+	EXPECT_TRUE(ktf_filter_match("selftest.*", "selftest.dummy"));
+	EXPECT_TRUE(ktf_filter_match("selftest.dummy*", "selftest.dummy"));
+	EXPECT_FALSE(ktf_filter_match("selftest.*", "hybrid.msg"));
+	EXPECT_TRUE(ktf_filter_match("*map*key*", "selftest.map_customkey"));
+	EXPECT_FALSE(ktf_filter_match("*map*key*", "selftest.mapref"));
+
+	/* '?' matches exactly one character */
+	EXPECT_TRUE(ktf_filter_match("selftest.dumm?", "selftest.dummy"));
+	EXPECT_TRUE(ktf_filter_match("?elftest.*", "selftest.dummy"));
+	EXPECT_FALSE(ktf_filter_match("selftest.dum?", "selftest.dummy"));
+	EXPECT_FALSE(ktf_filter_match("selftest.dummy?", "selftest.dummy"));
+
+	/* Without wildcards the whole name must match */
+	EXPECT_TRUE(ktf_filter_match("selftest.dummy", "selftest.dummy"));
+	EXPECT_FALSE(ktf_filter_match("selftest.dumm", "selftest.dummy"));
+	EXPECT_FALSE(ktf_filter_match("selftest.dummy", "selftest.dumm"));
+
+	/* ':' separates alternatives */
+	EXPECT_TRUE(ktf_filter_match("hybrid.*:selftest.dummy", "selftest.dummy"));
+	EXPECT_TRUE(ktf_filter_match("hybrid.*:selftest.dummy", "hybrid.msg"));
+	EXPECT_FALSE(ktf_filter_match("hybrid.*:selftest.dummy", "selftest.mapref"));
+
+	/* '-' starts the patterns to exclude */
+	EXPECT_TRUE(ktf_filter_match("selftest.*-selftest.dummy", "selftest.mapref"));
+	EXPECT_FALSE(ktf_filter_match("selftest.*-selftest.dummy", "selftest.dummy"));
+	EXPECT_FALSE(ktf_filter_match("selftest.*-*.dummy:*.mapref", "selftest.mapref"));
+	EXPECT_FALSE(ktf_filter_match("selftest.*-selftest.dummy", "hybrid.msg"));
+
+	/* An empty positive part includes all tests but the excluded ones */
+	EXPECT_TRUE(ktf_filter_match("-selftest.dummy", "hybrid.msg"));
+	EXPECT_FALSE(ktf_filter_match("-selftest.dummy", "selftest.dummy"));
+	EXPECT_FALSE(ktf_filter_match("-*", "selftest.dummy"));
+}
+
+static void add_filter_tests(void)
+{
+	ADD_TEST(filter);
+}
+
 static int __init selftest_init(void)
 {
 	int ret = KTF_CONTEXT_ADD_TO(dual_handle, &s_mctx[1].k, "map1");
@@ -637,6 +723,7 @@ static int __init selftest_init(void)
 	add_hybrid_tests();
 	add_context_tests();
 	add_symbol_tests();
+	add_filter_tests();
 	tlog(T_INFO, "selftest: loaded");
 	return 0;
 fail:
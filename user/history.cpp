@@ -0,0 +1,112 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *
+ * history.cpp: User mode selftests of sharding the kernel tests
+ *   by their history of durations (lib/ktf_history.cpp)
+ */
+
+#include "ktf.h"
+#include "ktf_history.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static std::vector<std::string> history_names()
+{
+  std::vector<std::string> names;
+  char name[32];
+
+  for (int i = 0; i < 12; i++) {
+    snprintf(name, sizeof(name), "hist.test%d", i);
+    names.push_back(name);
+  }
+  return names;
+}
+
+/* Write a history file with varying durations for names */
+static void write_history(const std::string& path, const std::vector<std::string>& names)
+{
+  FILE* f = fopen(path.c_str(), "w");
+
+  ASSERT_TRUE(f);
+  for (size_t i = 0; i < names.size(); i++)
+    fprintf(f, "%llu %s\n", (i % 4 + 1) * 1000000ULL, names[i].c_str());
+  fclose(f);
+}
+
+/* The duration of name in the history file at path, or 0 */
+static unsigned long long history_duration(const std::string& path, const std::string& name)
+{
+  FILE* f = fopen(path.c_str(), "r");
+  unsigned long long ns = 0, d;
+  char n[64];
+
+  if (!f)
+    return 0;
+  while (fscanf(f, "%llu %63s", &d, n) == 2)
+    if (name == n)
+      ns = d;
+  fclose(f);
+  return ns;
+}
+
+/* Shard 0 saves its measurements before shard 1 divides the tests:
+ * The shards must still agree, and run every test exactly once:
+ */
+TEST(history, shards_agree)
+{
+  char dir[] = "/tmp/ktf_history.XXXXXX";
+  ASSERT_TRUE(mkdtemp(dir));
+  std::string path = std::string(dir) + "/durations";
+  std::vector<std::string> names = history_names();
+  std::set<std::string>::iterator it;
+
+  write_history(path, names);
+
+  ktf::History h0(path.c_str());
+  h0.load();
+  std::set<std::string> s0 = h0.shard(names, 2, 0);
+  for (it = s0.begin(); it != s0.end(); ++it)
+    h0.record(*it, 1000000000000ULL);
+  EXPECT_EQ(0, h0.save());
+
+  ktf::History h1(path.c_str());
+  h1.load();
+  std::set<std::string> s1 = h1.shard(names, 2, 1);
+  for (it = s1.begin(); it != s1.end(); ++it)
+    h1.record(*it, 1);
+  EXPECT_EQ(0, h1.save());
+
+  for (size_t i = 0; i < names.size(); i++)
+    EXPECT_EQ(1UL, s0.count(names[i]) + s1.count(names[i])) << names[i];
+
+  /* A run that is not sharded merges the measurements of the shards into the history */
+  ktf::History h(path.c_str());
+  h.load();
+  EXPECT_EQ(0, h.save());
+  EXPECT_NE(0, access((path + ".shard0").c_str(), F_OK));
+  EXPECT_NE(0, access((path + ".shard1").c_str(), F_OK));
+  ASSERT_FALSE(s0.empty());
+  ASSERT_FALSE(s1.empty());
+  EXPECT_GT(history_duration(path, *s0.begin()), 100000000000ULL);
+  EXPECT_LT(history_duration(path, *s1.begin()), 5000000ULL);
+
+  unlink(path.c_str());
+  rmdir(dir);
+}
+
+/* Without a history, every shard divides the tests the same way by name */
+TEST(history, shard_by_name)
+{
+  std::vector<std::string> names = history_names();
+  std::set<std::string> s[3];
+
+  for (size_t i = 0; i < 3; i++)
+    s[i] = ktf::shard_by_name(names, 3, i);
+  for (size_t i = 0; i < names.size(); i++)
+    EXPECT_EQ(1UL, s[0].count(names[i]) + s[1].count(names[i]) + s[2].count(names[i]))
+      << names[i];
+  EXPECT_EQ(s[1], ktf::shard_by_name(names, 3, 1));
+}
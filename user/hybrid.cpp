@@ -8,7 +8,10 @@
  */
 
 #include "ktf.h"
+#include "ktf_int.h"
+#include <stdlib.h>
 #include <string.h>
+#include <set>
 
 extern "C" {
 #include "../selftest/hybrid_self.h"
@@ -37,3 +40,153 @@ HTEST(selftest, msg)
   /* and here.. */
   EXPECT_TRUE(true);
 }
+
+/* Large out-of-band data is shared with the kernel instead of sent with the request */
+HTEST(selftest, shm)
+{
+  KTF_SHARED_DATA(self, HYBRID_SHM_SIZE, data);
+  unsigned char* buf = (unsigned char*)data;
+
+  for (unsigned long i = 0; i < HYBRID_SHM_SIZE; i++)
+    buf[i] = HYBRID_SHM_PATTERN(i);
+
+  ktf::run(self);
+}
+
+/* Return the value of a property recorded for the running test, or NULL */
+static const char* test_property(const char* key)
+{
+  const ::testing::TestResult* r =
+    ::testing::UnitTest::GetInstance()->current_test_info()->result();
+
+  for (int i = 0; i < r->test_property_count(); i++)
+    if (!strcmp(r->GetTestProperty(i).key(), key))
+      return r->GetTestProperty(i).value();
+  return NULL;
+}
+
+/* Check that the statistics of benchmarks arrive as properties: */
+
+HTEST(selftest, bench_hash)
+{
+  ktf::run(self);
+
+  const char* samples = test_property("bench_samples");
+  ASSERT_TRUE(samples);
+  EXPECT_STREQ("16", samples);
+  ASSERT_TRUE(test_property("bench_iterations"));
+  EXPECT_GT(strtoull(test_property("bench_iterations"), NULL, 10), 1ULL);
+  EXPECT_TRUE(test_property("bench_mean_ps"));
+  EXPECT_TRUE(test_property("bench_median_ps"));
+  EXPECT_TRUE(test_property("bench_stddev_ps"));
+  EXPECT_TRUE(test_property("bench_min_ps"));
+}
+
+/* The operations take 10 and 20 ms in turn, for a standard deviation of
+ * about 5 ms, which overflows if computed from the squares in ps:
+ */
+HTEST(selftest, bench_slow)
+{
+  ktf::run(self);
+
+  ASSERT_TRUE(test_property("bench_iterations"));
+  EXPECT_STREQ("1", test_property("bench_iterations"));
+  ASSERT_TRUE(test_property("bench_mean_ps"));
+  EXPECT_GT(strtoull(test_property("bench_mean_ps"), NULL, 10), 14000000000ULL);
+  ASSERT_TRUE(test_property("bench_stddev_ps"));
+  unsigned long long stddev = strtoull(test_property("bench_stddev_ps"), NULL, 10);
+  EXPECT_GT(stddev, 4000000000ULL);
+  EXPECT_LT(stddev, 7000000000ULL);
+}
+
+/* Check that metrics arrive as properties, with the last value reported: */
+
+HTEST(selftest, metric)
+{
+  ktf::run(self);
+
+  ASSERT_TRUE(test_property("metric_latency"));
+  EXPECT_STREQ("1000", test_property("metric_latency"));
+  ASSERT_TRUE(test_property("metric_latency_unit"));
+  EXPECT_STREQ("ns", test_property("metric_latency_unit"));
+  ASSERT_TRUE(test_property("metric_answer"));
+  EXPECT_STREQ("42", test_property("metric_answer"));
+  /* A metric without a unit has no unit property */
+  EXPECT_FALSE(test_property("metric_answer_unit"));
+}
+
+/* Whether the results kept from a batched run of kt contain a failure, or the report */
+static bool has_failure(ktf::KernelTest* kt, const std::string& ctx, const char* report = NULL)
+{
+  std::map<std::string, ktf::result_vec>::const_iterator rit = kt->pending.find(ctx);
+
+  if (rit == kt->pending.end())
+    return false;
+  for (ktf::result_vec::const_iterator it = rit->second.begin(); it != rit->second.end(); ++it)
+    if (!it->result && (!report || it->report.find(report) != std::string::npos))
+      return true;
+  return false;
+}
+
+/* Run the kernel side, which sleeps for much longer than the timeout, in a batch
+ * followed by another test. The kernel must give up on it with -ETIMEDOUT (reported
+ * as a failure with the result) and still run the test after it:
+ */
+HTEST(selftest, timeout)
+{
+  std::string ctx;
+  ktf::KernelTest* dummy = KTF_FIND("selftest", "dummy", &ctx);
+  ASSERT_TRUE(dummy);
+
+  ktf::run_list tests;
+  tests.push_back(ktf::run_entry(self, ""));
+  tests.push_back(ktf::run_entry(dummy, ctx));
+
+  unsigned int timeout = ktf::get_timeout();
+  ktf::set_timeout(HYBRID_TIMEOUT_MS);
+  int ret = ktf::run_batch(tests);
+  ktf::set_timeout(timeout);
+  ASSERT_EQ(0, ret);
+
+  EXPECT_TRUE(has_failure(self, "", "timed out"));
+  EXPECT_TRUE(dummy->pending.count(ctx));
+  EXPECT_FALSE(has_failure(dummy, ctx));
+
+  /* The results are ours - gtest runs selftest.dummy on its own */
+  self->pending.erase("");
+  self->timing.erase("");
+  dummy->pending.erase(ctx);
+  dummy->timing.erase(ctx);
+}
+
+/* Run the kernel side, which fails more often than the kernel keeps the reports of
+ * between flush points. The failures that did not fit must still be reported with
+ * their location, as a count per location:
+ */
+HTEST(selftest, many_failures)
+{
+  ktf::run_list tests;
+  tests.push_back(ktf::run_entry(self, ""));
+  ASSERT_EQ(0, ktf::run_batch(tests));
+
+  const ktf::result_vec& results = self->pending[""];
+  unsigned long failures = 0;
+  std::set<int> lines;
+
+  for (ktf::result_vec::const_iterator it = results.begin(); it != results.end(); ++it) {
+    if (it->result)
+      continue;
+    EXPECT_NE("ktf", it->file) << it->report;
+    lines.insert(it->line);
+    if (it->report.find("more failure(s) here") != std::string::npos)
+      failures += strtoul(it->report.c_str(), NULL, 10);
+    else
+      failures++;
+  }
+  EXPECT_EQ(HYBRID_FAILURES + 1UL, failures);
+  EXPECT_EQ(2UL, lines.size());
+
+  /* The failures are expected - don't let gtest report them */
+  self->pending.erase("");
+  self->timing.erase("");
+}
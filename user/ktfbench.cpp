@@ -0,0 +1,94 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktfbench.cpp: Run kernel benchmarks (tests defined with BENCH())
+ *   and print a table of the results. Use --gtest_filter to select the benchmarks.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <ktf.h>
+
+/* Format a time in ps with a suitable unit */
+static std::string fmt_time(const char* s)
+{
+  char buf[32];
+  double ps = s ? strtod(s, NULL) : 0;
+
+  if (ps < 1e6)
+    snprintf(buf, sizeof(buf), "%.2f ns", ps / 1e3);
+  else if (ps < 1e9)
+    snprintf(buf, sizeof(buf), "%.2f us", ps / 1e6);
+  else
+    snprintf(buf, sizeof(buf), "%.2f ms", ps / 1e9);
+  return buf;
+}
+
+static const char* property(const ::testing::TestResult* r, const char* key)
+{
+  for (int i = 0; i < r->test_property_count(); i++)
+    if (strcmp(r->GetTestProperty(i).key(), key) == 0)
+      return r->GetTestProperty(i).value();
+  return NULL;
+}
+
+/* Print a table with a line per benchmark instead of gtest's usual output */
+class BenchPrinter : public ::testing::EmptyTestEventListener
+{
+public:
+  virtual void OnTestProgramStart(const ::testing::UnitTest& ut)
+  {
+    printf("%-40s %12s %12s %12s %12s %10s %12s\n", "Benchmark", "Mean", "Median",
+	   "StdDev", "Min", "Cycles", "Iterations");
+    printf("%s\n", std::string(116, '-').c_str());
+  }
+
+  virtual void OnTestPartResult(const ::testing::TestPartResult& r)
+  {
+    if (r.failed())
+      printf("%s:%d: Failure\n%s\n", r.file_name() ? r.file_name() : "unknown",
+	     r.line_number(), r.summary());
+  }
+
+  virtual void OnTestEnd(const ::testing::TestInfo& ti)
+  {
+    const ::testing::TestResult* r = ti.result();
+    std::string name = std::string(ti.test_case_name()) + "." + ti.name();
+    const char* cycles = property(r, "bench_cycles_x1000");
+    char cbuf[32] = "-";
+
+    /* Kernel test names are prefixed by the name of the gtest parameterized test */
+    if (name.compare(0, 7, "Kernel/") == 0)
+      name.erase(0, 7);
+
+    if (r->Failed()) {
+      printf("%-40s FAILED\n", name.c_str());
+      return;
+    }
+    if (!property(r, "bench_samples"))
+      return;
+    if (cycles)
+      snprintf(cbuf, sizeof(cbuf), "%.1f", strtod(cycles, NULL) / 1000);
+    printf("%-40s %12s %12s %12s %12s %10s %12s\n", name.c_str(),
+	   fmt_time(property(r, "bench_mean_ps")).c_str(),
+	   fmt_time(property(r, "bench_median_ps")).c_str(),
+	   fmt_time(property(r, "bench_stddev_ps")).c_str(),
+	   fmt_time(property(r, "bench_min_ps")).c_str(),
+	   cbuf, property(r, "bench_iterations"));
+    fflush(stdout);
+  }
+};
+
+int main (int argc, char** argv)
+{
+  ktf::setup();
+  testing::InitGoogleTest(&argc,argv);
+
+  ::testing::TestEventListeners& listeners = ::testing::UnitTest::GetInstance()->listeners();
+  delete listeners.Release(listeners.default_result_printer());
+  listeners.Append(new BenchPrinter());
+
+  return RUN_ALL_TESTS();
+}
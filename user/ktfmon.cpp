@@ -0,0 +1,52 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktfmon.cpp: Monitor the execution of kernel tests on this host,
+ *   regardless of how they are run.
+ */
+#include <stdio.h>
+#include <ktf_int.h>
+#include "../kernel/ktf_unlproto.h"
+
+static void print_event(const ktf::test_event& ev, void* arg)
+{
+  unsigned long long sec = ev.time / 1000000000ULL;
+  unsigned long usec = (ev.time % 1000000000ULL) / 1000;
+  std::string name = ev.setname + "." + ev.testname;
+
+  if (!ev.ctx.empty())
+    name += "_" + ev.ctx;
+
+  switch (ev.type) {
+  case KTF_EVENT_TEST_START:
+    printf("%llu.%06lu START  %s\n", sec, usec, name.c_str());
+    break;
+  case KTF_EVENT_ASSERT:
+    printf("%llu.%06lu FAIL   %s: %s:%d: %s\n", sec, usec, name.c_str(),
+	   ev.file.c_str(), ev.line, ev.report.c_str());
+    break;
+  case KTF_EVENT_TEST_END:
+    printf("%llu.%06lu END    %s: %u assertions, %u failed\n", sec, usec, name.c_str(),
+	   ev.asserts, ev.failures);
+    break;
+  }
+  fflush(stdout);
+}
+
+int main (int argc, char** argv)
+{
+  int err = ktf::event_subscribe(print_event, NULL);
+
+  if (err < 0) {
+    fprintf(stderr, "%s: Unable to subscribe to ktf events (status %d) - is the ktf module loaded?\n",
+	    argv[0], err);
+    return 1;
+  }
+
+  while ((err = ktf::event_poll()) == 0)
+    ;
+  fprintf(stderr, "%s: Failed to receive events (status %d)\n", argv[0], err);
+  ktf::event_unsubscribe();
+  return 1;
+}
@@ -6,14 +6,54 @@
  * ktfrun.cpp: Generic user level application to run kernel tests
  *   provided by modules subscribing to ktf services.
  */
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <ktf.h>
 
+/* Parse a worker count: a positive decimal number and nothing else */
+static bool parse_workers(const char* s, size_t* workers)
+{
+  char* end;
+  unsigned long n;
+
+  if (!*s || *s < '0' || *s > '9')
+    return false;
+  errno = 0;
+  n = strtoul(s, &end, 10);
+  if (*end || errno || !n)
+    return false;
+  *workers = n;
+  return true;
+}
+
+static int usage(const char* prog)
+{
+  fprintf(stderr, "Usage: %s [gtest options] [-j workers]\n", prog);
+  return 1;
+}
+
 int main (int argc, char** argv)
 {
+  size_t workers;
+
   ktf::setup();
   testing::InitGoogleTest(&argc,argv);
 
+  /* Optionally run independent test sets in parallel: -j <workers> or -j<workers> */
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-j") == 0) {
+      if (i + 1 >= argc || !parse_workers(argv[++i], &workers)) {
+	fprintf(stderr, "%s: -j needs a positive number of workers\n", argv[0]);
+	return usage(argv[0]);
+      }
+    } else if (strncmp(argv[i], "-j", 2) != 0 || !parse_workers(&argv[i][2], &workers)) {
+      fprintf(stderr, "%s: Unknown argument '%s'\n", argv[0], argv[i]);
+      return usage(argv[0]);
+    }
+    ktf::set_workers(workers);
+  }
+
   return RUN_ALL_TESTS();
 }
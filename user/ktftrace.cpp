@@ -0,0 +1,194 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktftrace.cpp: Decode a binary trace of the user mode debug log into text,
+ *   in time order across all threads.
+ */
+#include <ctype.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include <ktf_trace.h>
+
+struct entry
+{
+  uint32_t tid;
+  struct ktf_trace_record rec;
+};
+
+static bool by_time(const entry& a, const entry& b)
+{
+  return a.rec.ns < b.rec.ns;
+}
+
+static bool get(FILE* f, void* p, size_t sz)
+{
+  return fread(p, sz, 1, f) == 1;
+}
+
+static std::string string_arg(const struct ktf_trace_record& r, uint64_t arg)
+{
+  if (arg == KTF_TRACE_NULL)
+    return "(null)";
+  if (arg >= r.slen)
+    return "...";
+  return std::string(r.str + arg, strnlen(r.str + arg, r.slen - arg));
+}
+
+/* Format one conversion spec (without the length modifiers) with arg,
+ * as the type the length modifiers lmod of the original spec implied:
+ */
+static void format_arg(std::string& out, std::string spec, const std::string& lmod, char conv,
+		       const struct ktf_trace_record& r, uint64_t arg)
+{
+  char buf[256];
+  bool sgn = conv == 'd' || conv == 'i';
+
+  switch (conv) {
+  case 's':
+    snprintf(buf, sizeof(buf), (spec + 's').c_str(), string_arg(r, arg).c_str());
+    break;
+  case 'p':
+    snprintf(buf, sizeof(buf), (spec + 'p').c_str(), (void*)(uintptr_t)arg);
+    break;
+  case 'c':
+    snprintf(buf, sizeof(buf), (spec + 'c').c_str(), (int)arg);
+    break;
+  case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A': {
+    double d;
+    memcpy(&d, &arg, sizeof(d));
+    snprintf(buf, sizeof(buf), (spec + conv).c_str(), d);
+    break;
+  }
+  default:
+    /* Integer conversions: Truncate to the original type, then print it as a long long */
+    if (lmod == "hh")
+      arg = sgn ? (uint64_t)(signed char)arg : (unsigned char)arg;
+    else if (lmod == "h")
+      arg = sgn ? (uint64_t)(short)arg : (unsigned short)arg;
+    else if (lmod == "l")
+      arg = sgn ? (uint64_t)(long)arg : (unsigned long)arg;
+    else if (lmod == "z")
+      arg = sgn ? (uint64_t)(ssize_t)arg : (size_t)arg;
+    else if (lmod != "ll" && lmod != "j" && lmod != "q")
+      arg = sgn ? (uint64_t)(int)arg : (unsigned int)arg;
+    spec += "ll";
+    spec += conv;
+    if (sgn)
+      snprintf(buf, sizeof(buf), spec.c_str(), (long long)arg);
+    else
+      snprintf(buf, sizeof(buf), spec.c_str(), (unsigned long long)arg);
+    break;
+  }
+  out += buf;
+}
+
+static std::string format(const char* fmt, const struct ktf_trace_record& r)
+{
+  std::string out;
+  uint32_t a = 0;
+  const char* p = fmt;
+
+  while (*p) {
+    if (*p != '%') {
+      out += *p++;
+      continue;
+    }
+    if (p[1] == '%') {
+      out += '%';
+      p += 2;
+      continue;
+    }
+    /* Flags, width and precision are kept, length modifiers replaced */
+    std::string spec(1, *p++);
+    while (*p && strchr("#0- +'", *p))
+      spec += *p++;
+    while (*p && (isdigit(*p) || *p == '.'))
+      spec += *p++;
+    std::string lmod;
+    while (*p && strchr("hlLqjzt", *p))
+      lmod += *p++;
+    if (!*p)
+      break;
+    if (a < r.nargs)
+      format_arg(out, spec, lmod, *p, r, r.args[a++]);
+    else
+      out += "<missing>";
+    p++;
+  }
+  return out;
+}
+
+int main (int argc, char** argv)
+{
+  struct ktf_trace_header h;
+  std::map<uint64_t, std::string> strs;
+  std::vector<entry> entries;
+  uint32_t i, j, nstrs;
+  FILE* f;
+
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s <trace file>\n", argv[0]);
+    return 1;
+  }
+
+  f = fopen(argv[1], "r");
+  if (!f) {
+    perror(argv[1]);
+    return 1;
+  }
+  if (!get(f, &h, sizeof(h)) || memcmp(h.magic, KTF_TRACE_MAGIC, sizeof(h.magic)) ||
+      h.record_size != sizeof(struct ktf_trace_record)) {
+    fprintf(stderr, "%s: Not a trace file from this version of ktf\n", argv[1]);
+    return 1;
+  }
+
+  for (i = 0; i < h.nrings; i++) {
+    uint32_t tid, n;
+
+    if (!get(f, &tid, sizeof(tid)) || !get(f, &n, sizeof(n)))
+      goto truncated;
+    for (j = 0; j < n; j++) {
+      entry e;
+      e.tid = tid;
+      if (!get(f, &e.rec, sizeof(e.rec)))
+	goto truncated;
+      entries.push_back(e);
+    }
+  }
+
+  if (!get(f, &nstrs, sizeof(nstrs)))
+    goto truncated;
+  for (i = 0; i < nstrs; i++) {
+    uint64_t addr;
+    uint32_t len;
+
+    if (!get(f, &addr, sizeof(addr)) || !get(f, &len, sizeof(len)))
+      goto truncated;
+    std::string s(len, '\0');
+    if (len && !get(f, &s[0], len))
+      goto truncated;
+    strs[addr] = s;
+  }
+  fclose(f);
+
+  std::stable_sort(entries.begin(), entries.end(), by_time);
+  for (std::vector<entry>::iterator it = entries.begin(); it != entries.end(); ++it) {
+    const struct ktf_trace_record& r = it->rec;
+    printf("%llu.%09llu [%u] %s: %s", (unsigned long long)(r.ns / 1000000000ULL),
+	   (unsigned long long)(r.ns % 1000000000ULL), it->tid,
+	   strs[r.func].c_str(), format(strs[r.fmt].c_str(), r).c_str());
+  }
+  return 0;
+
+truncated:
+  fprintf(stderr, "%s: Truncated trace file\n", argv[1]);
+  fclose(f);
+  return 1;
+}